@@ -20,6 +20,7 @@ extern "C" {
 #include <functional>
 #include <list>
 #include <map>
+#include <memory>
 #include <queue>
 #include <string>
 #include <tuple>
@@ -118,6 +119,13 @@ struct Computer {
     uint16_t bundledRedstoneInputs[6] = {0, 0, 0, 0, 0, 0}; // Bundled redstone inputs (for plugins)
     uint16_t bundledRedstoneOutputs[6] = {0, 0, 0, 0, 0, 0}; // Bundled redstone outputs
 
+    // The following fields are available in API version 10.3 and later.
+    void * profiler = NULL; // A pointer to the sampling profiler for the computer, if --profile was passed
+    std::shared_ptr<const std::unordered_map<lua_Integer, std::vector<std::string> > > breakpointIndex; // The source names (in both forms) with a breakpoint on each line, built from breakpoints; only replaced as a whole with std::atomic_store, so read it with std::atomic_load
+    void * allocator = NULL; // A pointer to the ComputerAllocator that owns the memory of the Lua state (see src/allocator.hpp)
+    void * headlessOutput = NULL; // A pointer to the HeadlessOutput that assembles the computer's text in headless mode (see src/headless.hpp)
+    void * metrics = NULL; // A pointer to the ComputerMetrics for the computer, if metrics are enabled (see src/metrics.hpp)
+
 private:
     // The constructor is marked private to avoid having to implement it in this file.
     // It isn't necessary to construct a Computer directly; just use the startComputer function instead.
@@ -219,6 +219,18 @@ struct PluginFunctions {
      * @param userdata An optional opaque pointer to pass to the function.
      */
     void (*registerConfigSetting)(const std::string& name, int type, const std::function<int(const std::string&, void*)>& callback, void* userdata);
+
+    // The following fields are available in API version 10.3.
+
+    /**
+     * Sets how often a peripheral's update() method is called. Peripherals
+     * don't receive updates until this is called. Updates run on a worker
+     * thread, never at the same time as another update for the same computer.
+     * @param comp The computer the peripheral is attached to
+     * @param p The peripheral to update
+     * @param rate The number of updates per second (up to 1000), or 0 to stop updating
+     */
+    void (*setPeripheralUpdateRate)(Computer * comp, peripheral * p, unsigned rate);
 };
 
 /**
@@ -14,6 +14,7 @@
 
 #include <cstdint>
 #include <cstring>
+#include <algorithm>
 #include <chrono>
 #include <list>
 #include <mutex>
@@ -105,6 +106,37 @@ public:
         height = h;
     }
     T* data() { return vec.data(); }
+    // Returns a pointer to the first element of a row. The row is NOT bounds checked, and is
+    // only valid until the next resize.
+    T* row_data(unsigned y) { return vec.data() + (size_t)y * width; }
+    // Copies `len` elements into row `y` starting at column `x` (which may be negative),
+    // dropping anything outside the buffer. Returns the number of elements written.
+    unsigned write_run(int x, unsigned y, const T* src, size_t len) {
+        if (!clip_run(x, y, len, src)) return 0;
+        std::copy(src, src + len, vec.begin() + (size_t)y * width + x);
+        return (unsigned)len;
+    }
+    // Same as write_run, but sets every element to `v`.
+    unsigned fill_run(int x, unsigned y, T v, size_t len) {
+        const T* src = NULL;
+        if (!clip_run(x, y, len, src)) return 0;
+        std::fill(vec.begin() + (size_t)y * width + x, vec.begin() + (size_t)y * width + x + len, v);
+        return (unsigned)len;
+    }
+private:
+    bool clip_run(int& x, unsigned y, size_t& len, const T*& src) const {
+        if (y >= height) return false;
+        if (x < 0) {
+            const size_t skip = (size_t)-(long long)x;
+            if (skip >= len) return false;
+            len -= skip;
+            src += skip;
+            x = 0;
+        }
+        if ((unsigned)x >= width) return false;
+        if (len > width - (unsigned)x) len = width - (unsigned)x;
+        return true;
+    }
 };
 
 // The Terminal class is the base class for all renderers. It stores the basic info about all terminal objects, as well as its contents.
@@ -144,6 +176,9 @@ public:
     // The following fields are available in API version 10.2 and later.
     std::list<uint8_t> mouseButtonOrder; // An ordered list of mouse buttons that have been pressed
 
+    // The following fields are available in API version 10.3 and later.
+    void * metrics = NULL; // A pointer to the render metrics for the terminal, set on its first render if metrics are enabled (see src/metrics.hpp)
+
 protected:
     // Initial constructor to fill the contents with their defaults for the specified width and height
     Terminal(unsigned w, unsigned h): width(w), height(h), screen(w, h, ' '), colors(w, h, 0xF0), pixels(w*fontWidth, h*fontHeight, 0x0F) {
@@ -80,6 +80,9 @@ struct configuration {
     int http_proxy_port;
     bool extendMargins;
     bool snapToSize;
+
+    // The following fields are available in API version 10.3 and later.
+    int maxComputerMemory; // maximum number of bytes a computer's Lua state may use (0 = unlimited)
 };
 
 // A smaller structure that holds the configuration for a single computer.
@@ -10,6 +10,10 @@
 
 #ifndef CRAFTOS_PC_PERIPHERAL_HPP
 #define CRAFTOS_PC_PERIPHERAL_HPP
+#include <cstring>
+#include <initializer_list>
+#include <unordered_map>
+#include <utility>
 #include "lib.hpp"
 
 class peripheral;
@@ -45,9 +49,12 @@ public:
     // separately in the class, you just need to convert the method name string
     // into the proper function calls: 
     //   if (m == "a") return a(L); else if (m == "b") return b(L); ...
+    // For more than a few methods, use a peripheral_method_table (below) instead.
     virtual int call(lua_State *L, const char * method)=0;
-    // This function is called every render tick on the render thread. This can
-    // be used for anything that requires a constant update cycle.
+    // This function is called periodically for anything that requires a constant
+    // update cycle. It's only called after the peripheral requests an update rate
+    // with setPeripheralUpdateRate (see PluginFunctions), and it runs on a worker
+    // thread with the computer's peripherals_mutex held.
     virtual void update() {}
     // This function should return a library_t containing the names of all of the
     // methods available to the peripheral. Only the keys, name, and size members
@@ -60,4 +67,40 @@ public:
     virtual void reinitialize(lua_State *L) {}
 };
 inline peripheral::~peripheral() {}
+
+// A hash table mapping method names to member functions, which can be used to implement
+// call() without comparing the name against every method. Create it once as a static
+// member with the names and functions of the peripheral, then forward call() to it:
+//   const peripheral_method_table<myperipheral> myperipheral::dispatch = {{"a", &myperipheral::a}, ...};
+//   int call(lua_State *L, const char * method) override {return dispatch.call(this, L, method);}
+// Method names are not copied, so they must be string literals or otherwise outlive the table.
+template<class T>
+class peripheral_method_table {
+public:
+    typedef int (T::*method_t)(lua_State*);
+private:
+    struct name_hash {
+        size_t operator()(const char * s) const { // FNV-1a
+            size_t h = (size_t)2166136261U;
+            for (; *s; s++) h = (h ^ (unsigned char)*s) * (size_t)16777619U;
+            return h;
+        }
+    };
+    struct name_equal {
+        bool operator()(const char * a, const char * b) const {return strcmp(a, b) == 0;}
+    };
+    std::unordered_map<const char *, method_t, name_hash, name_equal> table;
+public:
+    peripheral_method_table(std::initializer_list<std::pair<const char *, method_t>> methods): table(methods.begin(), methods.end()) {}
+    // Returns the function for a method, or NULL if there is no method with that name.
+    method_t find(const char * name) const {
+        auto it = table.find(name);
+        return it == table.end() ? NULL : it->second;
+    }
+    // Calls a method on a peripheral. Unknown methods return no values, like the old if/else chains.
+    int call(T * self, lua_State *L, const char * name) const {
+        const method_t m = find(name);
+        return m == NULL ? 0 : (self->*m)(L);
+    }
+};
 #endif
\ No newline at end of file
@@ -0,0 +1,77 @@
+-- Measures how fast modem messages of different shapes can be sent and received.
+-- Two modems are attached on a private network, and each payload is sent from
+-- one to the other in batches for a few seconds. This covers the modem payload
+-- encoding only: xcopy is just used by the debugger, so it's measured separately
+-- by BenchmarkXcopy.cpp (`make xcopy-benchmark`).
+
+if periphemu == nil then error("This program requires CraftOS-PC.") end
+
+local netID = math.random(100000, 999999)
+local duration = tonumber(...) or 2000
+local batchSize = 100
+
+local function list(n, f)
+    local t = {}
+    for i = 1, n do t[i] = f(i) end
+    return t
+end
+
+local shared = {x = 1, y = 2, z = 3}
+local cyclic = {name = "node"}
+cyclic.self = cyclic
+
+local payloads = {
+    {"number", 42},
+    {"short string", "hello world"},
+    {"1 KiB string", ("x"):rep(1024)},
+    {"64 KiB string", ("x"):rep(65536)},
+    {"256 numbers", list(256, function(i) return i * 0.5 end)},
+    {"256 strings", list(256, function(i) return "item" .. i end)},
+    {"rednet message", {nMessageID = 123456, nRecipient = 7, message = "ping", sProtocol = "benchmark"}},
+    {"100 records", list(100, function(i) return {id = i, name = "record" .. i, pos = {i, i * 2, i * 3}, active = i % 2 == 0} end)},
+    {"nested tree", (function()
+        local function tree(depth) if depth == 0 then return "leaf" end return {left = tree(depth - 1), right = tree(depth - 1)} end
+        return tree(8)
+    end)()},
+    {"shared subtables", list(100, function() return shared end)},
+    {"cycle", cyclic},
+}
+
+local function check(name, sent, received)
+    if name == "shared subtables" then
+        assert(received[1] == received[100] and received[1].z == 3, "shared subtables were not preserved")
+    elseif name == "cycle" then
+        assert(received.self == received, "cycle was not preserved")
+    elseif type(sent) == "table" then
+        assert(type(received) == "table", "table payload was not received as a table")
+    else
+        assert(received == sent, "payload was not received intact")
+    end
+end
+
+periphemu.create("benchmark_tx", "modem", netID)
+periphemu.create("benchmark_rx", "modem", netID)
+local tx, rx = peripheral.wrap("benchmark_tx"), peripheral.wrap("benchmark_rx")
+rx.open(1)
+
+local ok, err = pcall(function()
+    for _, v in ipairs(payloads) do
+        local name, payload = v[1], v[2]
+        local count = 0
+        local start = os.epoch "utc"
+        repeat
+            for _ = 1, batchSize do tx.transmit(1, 1, payload) end
+            for i = 1, batchSize do
+                local _, side, _, _, message = os.pullEvent("modem_message")
+                if side == "benchmark_rx" and count == 0 and i == 1 then check(name, payload, message) end
+            end
+            count = count + batchSize
+        until os.epoch "utc" - start >= duration
+        local time = os.epoch "utc" - start
+        print(("%-18s %8d msgs in %5d ms (%d msgs/s)"):format(name, count, time, math.floor(count / (time / 1000))))
+    end
+end)
+
+periphemu.remove("benchmark_tx")
+periphemu.remove("benchmark_rx")
+if not ok then printError(err) end
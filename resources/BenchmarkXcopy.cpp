@@ -0,0 +1,161 @@
+/*
+ * BenchmarkXcopy.cpp
+ * CraftOS-PC 2
+ *
+ * This file measures how fast xcopy copies values of different shapes from one
+ * Lua state to another, next to the recursive copy it replaced. The payloads
+ * are the same as in BenchmarkModem.lua. Build it with `make xcopy-benchmark`
+ * and run `./xcopy-benchmark [milliseconds per payload]`.
+ *
+ * This code is licensed under the MIT license.
+ * Copyright (c) 2019-2021 JackMacWindows.
+ */
+
+extern "C" {
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+}
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_set>
+
+extern void xcopy(lua_State *from, lua_State *to, int n);
+
+// The recursive copy that xcopy used to be, kept for comparison. It turns any
+// table it has already seen into "<recursive table>", so it doesn't preserve
+// shared subtables or cycles.
+static void reference_copy(lua_State *from, lua_State *to, int n, std::unordered_set<const void*>& copies) {
+    for (int i = n - 1; i >= 0; i--) {
+        if (lua_type(from, -1-i) == LUA_TNUMBER) lua_pushnumber(to, lua_tonumber(from, -1-i));
+        else if (lua_type(from, -1-i) == LUA_TSTRING) lua_pushlstring(to, lua_tostring(from, -1-i), lua_strlen(from, -1-i));
+        else if (lua_type(from, -1-i) == LUA_TBOOLEAN) lua_pushboolean(to, lua_toboolean(from, -1-i));
+        else if (lua_type(from, -1-i) == LUA_TTABLE) {
+            const void* ptr = lua_topointer(from, -1-i);
+            if (copies.count(ptr)) {
+                lua_pushstring(to, "<recursive table>");
+                continue;
+            } else copies.insert(ptr);
+            lua_newtable(to);
+            lua_pushnil(from);
+            while (lua_next(from, -2-i) != 0) {
+                reference_copy(from, to, 2, copies);
+                lua_settable(to, -3);
+                lua_pop(from, 1);
+            }
+        } else if (lua_isnil(from, -1-i)) lua_pushnil(to);
+        else {
+            if (luaL_callmeta(from, -1-i, "__tostring")) {
+                lua_pushlstring(to, lua_tostring(from, -1), lua_strlen(from, -1));
+                lua_pop(from, 1);
+            } else lua_pushfstring(to, "<%s: %p>", lua_typename(from, lua_type(from, -1-i)), lua_topointer(from, -1-i));
+        }
+    }
+}
+
+static lua_State * dest;
+
+// copies the value in argument 1 into dest for the number of seconds in argument 2, and returns the copies per second
+static int bench(lua_State *L, bool reference) {
+    const double duration = luaL_checknumber(L, 2);
+    lua_settop(L, 1);
+    const auto start = std::chrono::steady_clock::now();
+    long count = 0;
+    double time;
+    do {
+        for (int i = 0; i < 100; i++) {
+            if (reference) {
+                std::unordered_set<const void*> copies;
+                reference_copy(L, dest, 1, copies);
+            } else xcopy(L, dest, 1);
+            lua_settop(dest, 0);
+        }
+        count += 100;
+        time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (time < duration);
+    lua_gc(dest, LUA_GCCOLLECT, 0);
+    lua_pushnumber(L, count / time);
+    return 1;
+}
+
+static int bench_xcopy(lua_State *L) {return bench(L, false);}
+static int bench_reference(lua_State *L) {return bench(L, true);}
+
+// copies the value in argument 1 there and back with xcopy, and returns the result
+static int roundtrip(lua_State *L) {
+    lua_settop(L, 1);
+    xcopy(L, dest, 1);
+    lua_settop(L, 0);
+    xcopy(dest, L, 1);
+    lua_settop(dest, 0);
+    return 1;
+}
+
+static const char * benchmark = R"(
+local duration = ...
+
+local function list(n, f)
+    local t = {}
+    for i = 1, n do t[i] = f(i) end
+    return t
+end
+
+local shared = {x = 1, y = 2, z = 3}
+local cyclic = {name = "node"}
+cyclic.self = cyclic
+
+local payloads = {
+    {"number", 42},
+    {"short string", "hello world"},
+    {"1 KiB string", ("x"):rep(1024)},
+    {"64 KiB string", ("x"):rep(65536)},
+    {"256 numbers", list(256, function(i) return i * 0.5 end)},
+    {"256 strings", list(256, function(i) return "item" .. i end)},
+    {"rednet message", {nMessageID = 123456, nRecipient = 7, message = "ping", sProtocol = "benchmark"}},
+    {"100 records", list(100, function(i) return {id = i, name = "record" .. i, pos = {i, i * 2, i * 3}, active = i % 2 == 0} end)},
+    {"nested tree", (function()
+        local function tree(depth) if depth == 0 then return "leaf" end return {left = tree(depth - 1), right = tree(depth - 1)} end
+        return tree(8)
+    end)()},
+    {"shared subtables", list(100, function() return shared end)},
+    {"cycle", cyclic},
+}
+
+local copy = roundtrip(payloads[10][2])
+assert(copy[1] == copy[100] and copy[1].z == 3, "shared subtables were not preserved")
+copy = roundtrip(cyclic)
+assert(copy.self == copy and copy.name == "node", "cycle was not preserved")
+
+-- each payload is measured in a few rounds that alternate between the copies, and the best round counts
+local rounds = 5
+print(("%-18s %12s %12s"):format("payload", "xcopy/s", "recursive/s"))
+for _, v in ipairs(payloads) do
+    local new, old = 0, 0
+    for _ = 1, rounds do
+        new = math.max(new, bench_xcopy(v[2], duration / rounds))
+        old = math.max(old, bench_reference(v[2], duration / rounds))
+    end
+    print(("%-18s %12d %12d %+5d%%"):format(v[1], new, old, math.floor((new / old - 1) * 100 + 0.5)))
+end
+)";
+
+int main(int argc, char ** argv) {
+    const double duration = argc > 1 ? atof(argv[1]) / 1000.0 : 1.0;
+    dest = luaL_newstate();
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+    lua_register(L, "bench_xcopy", bench_xcopy);
+    lua_register(L, "bench_reference", bench_reference);
+    lua_register(L, "roundtrip", roundtrip);
+    int status = luaL_loadbuffer(L, benchmark, strlen(benchmark), "=BenchmarkXcopy");
+    if (status == 0) {
+        lua_pushnumber(L, duration > 0 ? duration : 1.0);
+        status = lua_pcall(L, 1, 0, 0);
+    }
+    if (status != 0) fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    lua_close(L);
+    lua_close(dest);
+    return status != 0;
+}
@@ -462,6 +462,37 @@ testStart "parallel"
 	testLocal("i", i, 9)
 testEnd()
 
+if periphemu ~= nil then testStart "periphemu"
+	test("create", true, "test_channel_a", "channel", "CraftOSTest")
+	test("create", true, "test_channel_b", "channel", "CraftOSTest", 16)
+	local a = callLocal("peripheral.wrap", peripheral.wrap, "test_channel_a")
+	local b = callLocal("peripheral.wrap", peripheral.wrap, "test_channel_b")
+	testLocal("channel.getName", callLocal("channel.getName", b.getName), "CraftOSTest")
+	testLocal("channel.getCapacity", callLocal("channel.getCapacity", b.getCapacity), 65536)
+	testLocal("channel.write", callLocal("channel.write", a.write, "hello"), 5)
+	testLocal("channel.write", callLocal("channel.write", a.write, " world"), 6)
+	testLocal("channel.available", callLocal("channel.available", b.available), 11)
+	testLocal("channel.space", callLocal("channel.space", a.space), 65525)
+	testLocal("channel_data", {callLocal("os.pullEvent", os.pullEvent, "channel_data")}, {"channel_data", "test_channel_b", 11})
+	testLocal("channel.peek", callLocal("channel.peek", b.peek, 5), "hello")
+	testLocal("channel.read", callLocal("channel.read", b.read, 6), "hello ")
+	testLocal("channel.read", callLocal("channel.read", a.read), "world")
+	testLocal("channel.read", callLocal("channel.read", b.read), nil)
+	testLocal("channel.wait", callLocal("channel.wait", b.wait, 0.1), false)
+	callLocal("channel.write", b.write, "data")
+	callLocal("channel.clear", a.clear)
+	testLocal("channel.available", callLocal("channel.available", b.available), 0)
+	local waited
+	callLocal("parallel.waitForAll", parallel.waitForAll,
+		function() waited = callLocal("channel.wait", b.wait, 5) end,
+		function() callLocal("sleep", sleep, 0.1) callLocal("channel.write", a.write, "x") end)
+	testLocal("channel.wait", waited, true)
+	testLocal("channel.wait", callLocal("channel.wait", b.wait), true)
+	testLocal("channel.read", callLocal("channel.read", b.read), "x")
+	test("remove", true, "test_channel_a")
+	test("remove", true, "test_channel_b")
+testEnd() end
+
 testStart "settings"
 	test("save", true, "old_settings.ltn")
 	call("clear")
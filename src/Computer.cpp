@@ -17,16 +17,23 @@ extern "C" {
 #include <configuration.hpp>
 #include <peripheral.hpp>
 #include <sys/stat.h>
+#include "allocator.hpp"
 #include "apis.hpp"
+#include "chunkcache.hpp"
+#include "headless.hpp"
 #include "main.hpp"
+#include "metrics.hpp"
 #include "peripheral/computer.hpp"
 #include "platform.hpp"
+#include "profiler.hpp"
+#include "romimage.hpp"
 #include "runtime.hpp"
 #include "terminal/SDLTerminal.hpp"
 #include "terminal/CLITerminal.hpp"
 #include "terminal/RawTerminal.hpp"
 #include "terminal/TRoRTerminal.hpp"
 #include "terminal/HardwareSDLTerminal.hpp"
+#include "terminal/OffscreenTerminal.hpp"
 #include "termsupport.hpp"
 
 #ifdef STANDALONE_ROM
@@ -49,15 +56,9 @@ std::unordered_set<Terminal*> orphanedTerminals;
 
 // Context structure for yieldable load
 struct load_ctx {
-    std::thread thread;
-    std::mutex lock;
-    std::condition_variable notify;
-    int oldtop;
-    int status;
-    int argcount;
-    lua_State *L;
-    lua_State *coro;
-    const char * name;
+    int top; // stack size of the loader before the reader's yielded values were pushed
+    int pieces; // number of strings collected from the reader so far
+    lua_State *coro; // thread that runs the reader function
 };
 
 // Basic CraftOS libraries
@@ -79,7 +80,11 @@ Computer::Computer(int i, bool debug): isDebugger(debug) {
     const computer_configuration _config = getComputerConfig(id);
     // Create the terminal
     const std::string term_title = _config.label.empty() ? "CraftOS Terminal: " + std::string(debug ? "Debugger" : "Computer") + " " + std::to_string(id) : "CraftOS Terminal: " + asciify(_config.label);
-    if (selectedRenderer == 1) term = NULL;
+    if (selectedRenderer == 1) {
+        // the terminal is kept in memory for captures, and its text is written to stdout
+        term = new OffscreenTerminal(term_title);
+        headlessOutput = new HeadlessOutput(id, term->height);
+    }
 #ifndef NO_CLI
     else if (selectedRenderer == 2) term = new CLITerminal(term_title);
 #endif
@@ -88,19 +93,28 @@ Computer::Computer(int i, bool debug): isDebugger(debug) {
     else if (selectedRenderer == 5) term = new HardwareSDLTerminal(term_title);
     else term = new SDLTerminal(term_title);
     if (term) term->grayscale = !_config.isColor;
+    if (metricsEnabled) metrics = new ComputerMetrics(id);
     // Tell the mounter it's initializing to prevent checking rom remounts
     mounter_initializing = true;
 #ifdef STANDALONE_ROM
     addVirtualMount(this, standaloneROM, "rom");
     if (debug) addVirtualMount(this, standaloneDebug, "debug");
 #else
+    if (romImage != NULL) {
+        addVirtualMount(this, (*romImage)["rom"], "rom");
+        if (debug) {
+            if (romImage->dir.find("debug") == romImage->dir.end()) { if (::config.standardsMode && term) { displayFailure(term, "Cannot mount ROM"); orphanedTerminals.insert(term); } else if (term) delete term; throw std::runtime_error("Could not mount debugger ROM"); }
+            addVirtualMount(this, (*romImage)["debug"], "debug");
+        }
+    } else {
 #ifdef _WIN32
-    if (!addMount(this, getROMPath() + WS("\\rom"), "rom", ::config.romReadOnly)) { if (::config.standardsMode && term) { displayFailure(term, "Cannot mount ROM"); orphanedTerminals.insert(term); } else delete term; throw std::runtime_error("Could not mount ROM"); }
-    if (debug) if (!addMount(this, getROMPath() + WS("\\debug"), "debug", true)) { if (::config.standardsMode && term) { displayFailure(term, "Cannot mount ROM"); orphanedTerminals.insert(term); } else delete term; throw std::runtime_error("Could not mount debugger ROM"); }
+        if (!addMount(this, getROMPath() + WS("\\rom"), "rom", ::config.romReadOnly)) { if (::config.standardsMode && term) { displayFailure(term, "Cannot mount ROM"); orphanedTerminals.insert(term); } else delete term; throw std::runtime_error("Could not mount ROM"); }
+        if (debug) if (!addMount(this, getROMPath() + WS("\\debug"), "debug", true)) { if (::config.standardsMode && term) { displayFailure(term, "Cannot mount ROM"); orphanedTerminals.insert(term); } else delete term; throw std::runtime_error("Could not mount debugger ROM"); }
 #else
-    if (!addMount(this, getROMPath() + WS("/rom"), "rom", ::config.romReadOnly)) { if (::config.standardsMode && term) { displayFailure(term, "Cannot mount ROM"); orphanedTerminals.insert(term); } else if (term) delete term; throw std::runtime_error("Could not mount ROM"); }
-    if (debug) if (!addMount(this, getROMPath() + WS("/debug"), "debug", true)) { if (::config.standardsMode && term) { displayFailure(term, "Cannot mount ROM"); orphanedTerminals.insert(term); } else if (term) delete term; throw std::runtime_error("Could not mount debugger ROM"); }
+        if (!addMount(this, getROMPath() + WS("/rom"), "rom", ::config.romReadOnly)) { if (::config.standardsMode && term) { displayFailure(term, "Cannot mount ROM"); orphanedTerminals.insert(term); } else if (term) delete term; throw std::runtime_error("Could not mount ROM"); }
+        if (debug) if (!addMount(this, getROMPath() + WS("/debug"), "debug", true)) { if (::config.standardsMode && term) { displayFailure(term, "Cannot mount ROM"); orphanedTerminals.insert(term); } else if (term) delete term; throw std::runtime_error("Could not mount debugger ROM"); }
 #endif // _WIN32
+    }
 #endif // STANDALONE_ROM
     // Mount custom directories from the command line
     for (auto m : customMounts) {
@@ -134,10 +148,12 @@ Computer::~Computer() {
         if (term->errorMode) orphanedTerminals.insert(term);
         else delete term;
     }
+    delete (HeadlessOutput*)headlessOutput; // writes out the last line
     // Save config
     setComputerConfig(id, *config);
     delete config;
     // Deinitialize all peripherals
+    removePeripheralUpdates(this);
     for (const auto& p : peripherals) p.second->getDestructor()(p.second);
     for (auto c = referencers.begin(); c != referencers.end(); ++c) {
         std::lock_guard<std::mutex> lock((*c)->peripherals_mutex);
@@ -161,6 +177,10 @@ Computer::~Computer() {
     if (eventTimeout != 0) SDL_RemoveTimer(eventTimeout);
     // Stop all open websockets
     while (!openWebsockets.empty()) stopWebsocket(*openWebsockets.begin());
+    // The metrics point to the allocator, so they have to go first
+    delete (ComputerMetrics*)metrics;
+    // The Lua state has been closed by now, so its memory can be released
+    delete (ComputerAllocator*)allocator;
 }
 
 extern "C" {
@@ -168,10 +188,11 @@ extern "C" {
         Computer * computer = get_comp(L);
         const int id = !computer->breakpoints.empty() ? computer->breakpoints.rbegin()->first + 1 : 1;
         computer->breakpoints[id] = std::make_pair("@/" + astr(fixpath(computer, luaL_checkstring(L, 1), false, false)), luaL_checkinteger(L, 2));
+        updateBreakpointIndex(computer);
         if (!computer->hasBreakpoints) computer->forceCheckTimeout = true;
         computer->hasBreakpoints = true;
-        lua_sethook(computer->L, termHook, LUA_MASKCOUNT | LUA_MASKLINE | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 1000000);
-        lua_sethook(L, termHook, LUA_MASKCOUNT | LUA_MASKLINE | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 1000000);
+        setComputerHook(computer, computer->L, LUA_MASKCOUNT | LUA_MASKLINE | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 1000000);
+        setComputerHook(computer, L, LUA_MASKCOUNT | LUA_MASKLINE | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 1000000);
         lua_pushinteger(L, id);
         return 1;
     }
@@ -180,12 +201,13 @@ extern "C" {
         Computer * computer = get_comp(L);
         if (computer->breakpoints.find((int)luaL_checkinteger(L, 1)) != computer->breakpoints.end()) {
             computer->breakpoints.erase((int)lua_tointeger(L, 1));
+            updateBreakpointIndex(computer);
             if (computer->breakpoints.empty()) {
                 computer->hasBreakpoints = false;
                 //lua_sethook(computer->L, termHook, LUA_MASKCOUNT | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 1000000);
                 //lua_sethook(L, termHook, LUA_MASKCOUNT | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 1000000);
-                lua_sethook(computer->L, NULL, 0, 0);
-                lua_sethook(L, NULL, 0, 0);
+                setComputerHook(computer, computer->L, 0, 0);
+                setComputerHook(computer, L, 0, 0);
             }
             lua_pushboolean(L, true);
         } else lua_pushboolean(L, false);
@@ -199,123 +221,75 @@ extern "C" {
 }
 
 
-static const char * file_reader(lua_State *L, void * ud, size_t *size) {
-    static char file_read_tmp[4096];
-    if (feof((FILE*)ud)) return NULL;
-    *size = fread(file_read_tmp, 1, 4096, (FILE*)ud);
-    return file_read_tmp;
-}
-
-// These functions implement a strategy for allowing `load` to yield.
-// Basically, it spins up a new thread that runs the actual parser, and
-// when the function yields, the thread signals the computer thread to
-// yield itself. Once the computer thread resumes loading, the contents
-// are sent to the loader thread, and parsing continues. This continues
-// until the loader finishes, at which point the loader signals the
-// computer thread that it's done. The results are copied back to the
-// main state, and the loader returns.
-
-static const char * yield_loader(lua_State *L, void* data, size_t *size) {
-    load_ctx* ctx = (load_ctx*)data;
-    lua_State *coro = lua_newthread(L);
-    lua_pushvalue(ctx->coro, 1);
-    lua_xmove(ctx->coro, coro, 1);
-    ctx->argcount = 0;
-    int status;
-    do {
-        status = lua_resume(coro, ctx->argcount);
-        if (status == 0) {
-            if (lua_isnoneornil(coro, 1)) return NULL;
-            else if (lua_isstring(coro, 1)) return lua_tolstring(coro, 1, size);
-            else luaL_error(L, "reader function must return a string");
-        } else if (status == LUA_YIELD) {
-            std::unique_lock<std::mutex> lock(ctx->lock);
-            ctx->status = 1;
-            ctx->argcount = lua_gettop(coro);
-            lua_xmove(coro, ctx->L, ctx->argcount);
-            ctx->notify.notify_all();
-            while (ctx->status == 1) ctx->notify.wait(lock);
-            if (ctx->status == 3) luaL_error(L, "");
-            lua_xmove(ctx->L, coro, ctx->argcount);
-            ctx->status = 0;
-        } else {
-            lua_error(L);
-        }
-    } while (status == LUA_YIELD);
-    return NULL;
-}
-
-static void load_thread(load_ctx* ctx) {
-    int status = lua_load(ctx->coro, yield_loader, ctx, ctx->name);
-    if (ctx->status == 3) return;
-    std::unique_lock<std::mutex> lock(ctx->lock);
-    if (status == 0) {
-        ctx->argcount = 1;
-        lua_xmove(ctx->coro, ctx->L, 1);
-    } else {
-        ctx->argcount = 2;
-        lua_pushnil(ctx->L);
-        lua_xmove(ctx->coro, ctx->L, 1);
-    }
-    ctx->status = 2;
-    ctx->notify.notify_all();
-}
-
-static int load_ctx_gc(lua_State *L) {
-    load_ctx* ctx = (load_ctx*)lua_touserdata(L, 1);
-    if (ctx->thread.joinable()) {
-        {
-            std::unique_lock<std::mutex> lock(ctx->lock);
-            ctx->status = 3;
-            ctx->notify.notify_all();
-        }
-        ctx->thread.join();
-    }
-    ctx->thread.~thread();
-    ctx->lock.~mutex();
-    ctx->notify.~condition_variable();
-    return 0;
-}
+// This function implements a strategy for allowing `load` to yield.
+// The reader function is run in its own coroutine on the computer thread,
+// and each string it returns is stored in a table. If the reader yields,
+// `load` yields the same values, and passes whatever it's resumed with
+// back to the reader. Once the reader is done, the pieces are joined and
+// parsed in one go.
+// Stack layout: 1 = reader, 2 = chunk name, 3 = context, 4 = pieces, 5 = reader thread
 
 static int yieldable_load(lua_State *L) {
-    load_ctx* ctx;
-    if (lua_vcontext(L)) {
-        ctx = (load_ctx*)lua_vcontext(L);
-        std::unique_lock<std::mutex> lock(ctx->lock);
-        ctx->status = 0;
-        ctx->L = L;
-        ctx->argcount = lua_gettop(L) - ctx->argcount;
-        ctx->notify.notify_all();
-    } else {
+    load_ctx* ctx = (load_ctx*)lua_vcontext(L);
+    int nargs;
+    if (ctx != NULL) nargs = lua_gettop(L) - ctx->top;
+    else {
         luaL_checktype(L, 1, LUA_TFUNCTION);
-        const char * name = luaL_optstring(L, 2, "=(load)");
-        load_ctx * basectx = new load_ctx;
+        luaL_optstring(L, 2, "=(load)");
+        lua_settop(L, 2);
+        // the name has to stay on the stack while the reader yields
+        if (lua_isnil(L, 2)) {
+            lua_pushliteral(L, "=(load)");
+            lua_replace(L, 2);
+        }
         ctx = (load_ctx*)lua_newuserdata(L, sizeof(load_ctx));
-        memcpy(ctx, basectx, sizeof(load_ctx));
-        delete basectx;
-        lua_createtable(L, 0, 1);
-        lua_pushcfunction(L, load_ctx_gc);
-        lua_setfield(L, -2, "__gc");
-        lua_setmetatable(L, -2);
-        ctx->thread = std::thread(load_thread, ctx);
-        setThreadName(ctx->thread, "Loader Thread: " + std::string(name));
-        ctx->status = 0;
-        ctx->name = name;
-        ctx->L = L;
+        ctx->pieces = 0;
+        lua_newtable(L);
         ctx->coro = lua_newthread(L);
         lua_pushvalue(L, 1);
         lua_xmove(L, ctx->coro, 1);
+        nargs = 0;
+    }
+    lua_xmove(L, ctx->coro, nargs);
+    while (true) {
+        const int status = lua_resume(ctx->coro, nargs);
+        if (status == LUA_YIELD) {
+            nargs = lua_gettop(ctx->coro);
+            ctx->top = lua_gettop(L);
+            lua_xmove(ctx->coro, L, nargs);
+            return lua_vyield(L, nargs, ctx);
+        } else if (status != 0) {
+            lua_pushnil(L);
+            lua_xmove(ctx->coro, L, 1);
+            return 2;
+        }
+        if (lua_isnoneornil(ctx->coro, 1)) break;
+        else if (!lua_isstring(ctx->coro, 1)) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "reader function must return a string");
+            return 2;
+        } else if (lua_objlen(ctx->coro, 1) == 0) break;
+        lua_settop(ctx->coro, 1);
+        lua_xmove(ctx->coro, L, 1);
+        lua_rawseti(L, 4, ++ctx->pieces);
+        // the reader returned normally, so the thread can run it again
+        lua_pushvalue(L, 1);
+        lua_xmove(L, ctx->coro, 1);
+        nargs = 0;
     }
-    while (ctx->status != 2) {
-        std::unique_lock<std::mutex> lock(ctx->lock);
-        ctx->notify.wait(lock);
-        if (ctx->status == 1) {
-            int argcount = ctx->argcount;
-            ctx->argcount = lua_gettop(L) - ctx->argcount;
-            return lua_vyield(L, argcount, ctx);
-        } else if (ctx->status == 3) return 0; // this should never happen
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    for (int i = 1; i <= ctx->pieces; i++) {
+        lua_rawgeti(L, 4, i);
+        luaL_addvalue(&b);
     }
-    return ctx->argcount;
+    luaL_pushresult(&b);
+    size_t size;
+    const char * chunk = lua_tolstring(L, -1, &size);
+    if (loadCachedChunk(L, chunk, size, lua_tostring(L, 2)) == 0) return 1;
+    lua_pushnil(L);
+    lua_insert(L, -2);
+    return 2;
 }
 
 // Main computer loop
@@ -344,7 +318,16 @@ void runComputer(Computer * self, const path_t& bios_name) {
         * All Lua contexts are held in this structure. We work with it almost
         * all the time.
         */
-        lua_State *L = self->L = luaL_newstate();
+        if (self->allocator == NULL) self->allocator = new ComputerAllocator();
+        // the memory limit is only enforced once a panic handler is installed, see below
+        ((ComputerAllocator*)self->allocator)->limit = 0;
+        if (self->metrics != NULL) ((ComputerMetrics*)self->metrics)->allocator = (ComputerAllocator*)self->allocator;
+        lua_State *L = self->L = lua_newstate(ComputerAllocator::alloc, self->allocator);
+        if (L == NULL) {
+            fprintf(stderr, "Could not allocate a Lua state for computer %d (maxComputerMemory is %d bytes)\n", self->id, ::config.maxComputerMemory);
+            return;
+        }
+        startProfiler(self, L);
 
         self->coro = lua_newthread(L);
         self->paramQueue = lua_newthread(L);
@@ -373,10 +356,12 @@ void runComputer(Computer * self, const path_t& bios_name) {
         lua_setglobal(L, "os_date");
         lua_pop(L, 1);
         // TODO: Fix logErrors since error hooks are no longer enabled
-        if (self->debugger != NULL && !self->isDebugger) lua_sethook(self->coro, termHook, LUA_MASKLINE | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 0);
+        if (self->debugger != NULL && !self->isDebugger) setComputerHook(self, self->coro, LUA_MASKLINE | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 0);
         //else if (config.debug_enable && !self->isDebugger) lua_sethook(self->coro, termHook, LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 0);
         //else lua_sethook(self->coro, termHook, LUA_MASKERROR, 0);
         lua_atpanic(L, termPanic);
+        // an allocation failing before this would have aborted the whole program
+        ((ComputerAllocator*)self->allocator)->limit = ::config.maxComputerMemory > 0 ? ::config.maxComputerMemory : 0;
         for (library_t * lib : libraries) load_library(self, self->coro, *lib);
         if (config.http_enable) load_library(self, self->coro, http_lib);
         if (self->isDebugger && self->debugger != NULL) load_library(self, self->coro, *((library_t*)self->debugger));
@@ -388,6 +373,10 @@ void runComputer(Computer * self, const path_t& bios_name) {
         lua_pop(L, 1);
         lua_pushnil(L);
         lua_setglobal(L, "os_date");
+        // The ROM loads every file through loadstring, so this lets computers share the compiled ROM
+        lua_getglobal(L, "loadstring");
+        lua_pushcclosure(L, cached_loadstring, 1);
+        lua_setglobal(L, "loadstring");
         if (config.standardsMode) {
             // Override the default loader to allow yielding from `load`
             lua_pushcfunction(L, yieldable_load);
@@ -541,7 +530,8 @@ void runComputer(Computer * self, const path_t& bios_name) {
 
         /* Load the file containing the script we are going to run */
 #ifdef STANDALONE_ROM
-        status = luaL_loadstring(self->coro, astr(bios_name).c_str());
+        const std::string bios_source = astr(bios_name);
+        status = loadCachedChunk(self->coro, bios_source.c_str(), bios_source.size(), bios_source.c_str(), true);
         path_t bios_path_expanded = WS("standalone ROM");
 #else
 #ifdef WIN32
@@ -549,9 +539,27 @@ void runComputer(Computer * self, const path_t& bios_name) {
 #else
         path_t bios_path_expanded = getROMPath() + WS("/") + bios_name;
 #endif
-        FILE * bios_file = platform_fopen(bios_path_expanded.c_str(), "r");
-        status = lua_load(self->coro, file_reader, bios_file, "@bios.lua");
-        fclose(bios_file);
+        std::string bios_source;
+        FILE * bios_file;
+        if (romImage != NULL) {
+            bios_path_expanded = WS("ROM image: ") + bios_name;
+            const FileEntry * bios_entry = NULL;
+            try {bios_entry = &romImage->path(bios_name);} catch (...) {}
+            if (bios_entry != NULL && !bios_entry->isDir) status = loadCachedChunk(self->coro, bios_entry->data.data(), bios_entry->data.size(), "@bios.lua", true);
+            else {
+                lua_pushfstring(self->coro, "cannot open %s", astr(bios_path_expanded).c_str());
+                status = LUA_ERRFILE;
+            }
+        } else if ((bios_file = platform_fopen(bios_path_expanded.c_str(), "rb")) != NULL) {
+            char buf[16384];
+            size_t size;
+            while ((size = fread(buf, 1, sizeof(buf), bios_file)) > 0) bios_source.append(buf, size);
+            fclose(bios_file);
+            status = loadCachedChunk(self->coro, bios_source.data(), bios_source.size(), "@bios.lua", true);
+        } else {
+            lua_pushfstring(self->coro, "cannot open %s", astr(bios_path_expanded).c_str());
+            status = LUA_ERRFILE;
+        }
 #endif
         if (status || !lua_isfunction(self->coro, -1)) {
             /* If something went wrong, error message is at the top of */
@@ -647,6 +655,7 @@ void* computerThread(void* data) {
             comp->L = NULL;
         }
     }
+    stopProfiler(comp);
     freedComputers.insert(comp);
     {
         LockGuard lock(computers);
@@ -0,0 +1,85 @@
+/*
+ * allocator.cpp
+ * CraftOS-PC 2
+ *
+ * This file implements the ComputerAllocator class.
+ *
+ * This code is licensed under the MIT license.
+ * Copyright (c) 2019-2021 JackMacWindows.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include "allocator.hpp"
+
+ComputerAllocator::~ComputerAllocator() {
+    for (char * slab : slabs) free(slab);
+}
+
+void * ComputerAllocator::allocate(size_t size) {
+    if (size > maxPooledSize) return malloc(size);
+    const size_t index = (size - 1) / granularity;
+    void * block = freeLists[index];
+    if (block != NULL) {
+        freeLists[index] = *(void**)block;
+        return block;
+    }
+    const size_t blockSize = (index + 1) * granularity;
+    if (slabPos == NULL || (size_t)(slabEnd - slabPos) < blockSize) {
+        // the rest of the old slab is too small for this class, so it's left unused
+        char * slab = (char*)malloc(slabSize);
+        if (slab == NULL) return NULL;
+        slabs.push_back(slab);
+        slabPos = slab;
+        slabEnd = slab + slabSize;
+    }
+    block = slabPos;
+    slabPos += blockSize;
+    return block;
+}
+
+void ComputerAllocator::release(void * ptr, size_t size) {
+    if (size > maxPooledSize) {
+        free(ptr);
+        return;
+    }
+    const size_t index = (size - 1) / granularity;
+    *(void**)ptr = freeLists[index];
+    freeLists[index] = ptr;
+}
+
+void * ComputerAllocator::alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    ComputerAllocator * self = (ComputerAllocator*)ud;
+    if (ptr == NULL) osize = 0;
+    const size_t used = self->used.load(std::memory_order_relaxed);
+    if (nsize == 0) {
+        if (ptr != NULL) self->release(ptr, osize);
+        self->used.store(used - osize, std::memory_order_relaxed);
+        return NULL;
+    }
+    // Lua can't handle a failed shrink, so only growing is checked against the limit
+    if (nsize > osize && self->limit != 0 && used - osize + nsize > self->limit) return NULL;
+    void * retval;
+    if (ptr != NULL && (osize - 1) / granularity == (nsize - 1) / granularity && osize <= maxPooledSize && nsize <= maxPooledSize) retval = ptr;
+    else if (ptr != NULL && osize > maxPooledSize && nsize > maxPooledSize) {
+        retval = realloc(ptr, nsize);
+        if (retval == NULL) {
+            if (nsize > osize) return NULL;
+            retval = ptr;
+        }
+    } else {
+        retval = self->allocate(nsize);
+        if (retval == NULL) {
+            if (nsize > osize) return NULL;
+            // a shrinking block can stay where it is; it's recycled as a block of its new size later
+            retval = ptr;
+        } else if (ptr != NULL) {
+            memcpy(retval, ptr, osize < nsize ? osize : nsize);
+            self->release(ptr, osize);
+        }
+    }
+    const size_t newUsed = used - osize + nsize;
+    self->used.store(newUsed, std::memory_order_relaxed);
+    if (newUsed > self->peak.load(std::memory_order_relaxed)) self->peak.store(newUsed, std::memory_order_relaxed);
+    return retval;
+}
@@ -0,0 +1,46 @@
+/*
+ * allocator.hpp
+ * CraftOS-PC 2
+ *
+ * This file defines the ComputerAllocator class, which is the Lua memory
+ * allocator used by each computer.
+ *
+ * This code is licensed under the MIT license.
+ * Copyright (c) 2019-2021 JackMacWindows.
+ */
+
+#ifndef ALLOCATOR_HPP
+#define ALLOCATOR_HPP
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Small blocks are carved out of large slabs and recycled through free lists
+// (one per 16-byte size class), so most of Lua's allocations never reach the
+// system allocator. Blocks over maxPooledSize go straight to malloc. The pools
+// aren't locked: only the thread currently running the computer allocates.
+// Slabs are kept when the Lua state closes and reused after a reboot, and are
+// freed along with the allocator.
+class ComputerAllocator {
+    static const size_t granularity = 16;
+    static const size_t maxPooledSize = 512;
+    static const size_t slabSize = 65536;
+    void * freeLists[maxPooledSize / granularity] = {};
+    std::vector<char*> slabs;
+    char * slabPos = NULL;
+    char * slabEnd = NULL;
+    std::atomic<size_t> used {0};
+    std::atomic<size_t> peak {0};
+    void * allocate(size_t size);
+    void release(void * ptr, size_t size);
+public:
+    size_t limit = 0; // maximum live bytes (0 = unlimited); allocations over it fail with a memory error
+    ~ComputerAllocator();
+    // The lua_Alloc function; pass the allocator as the userdata.
+    static void * alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+    // These may be read from any thread.
+    size_t usedBytes() const {return used.load(std::memory_order_relaxed);}
+    size_t peakBytes() const {return peak.load(std::memory_order_relaxed);}
+};
+
+#endif
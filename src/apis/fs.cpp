@@ -21,6 +21,7 @@
 #include <FileEntry.hpp>
 #include <sys/stat.h>
 #include "handles/fs_handle.hpp"
+#include "../metrics.hpp"
 #include "../platform.hpp"
 #include "../runtime.hpp"
 #ifdef WIN32
@@ -52,6 +53,7 @@ static path_t ignored_files[4] = {
 
 static int fs_list(lua_State *L) {
     lastCFunction = __func__;
+    countMetric(get_comp(L), &ComputerMetrics::fsOperations);
     struct_dirent *dir;
     const path_t paths = fixpath(get_comp(L), luaL_checkstring(L, 1), true, true, NULL, true);
     if (paths.empty()) err(L, 1, "Not a directory");
@@ -96,6 +98,7 @@ static int fs_list(lua_State *L) {
 
 static int fs_exists(lua_State *L) {
     lastCFunction = __func__;
+    countMetric(get_comp(L), &ComputerMetrics::fsOperations);
     const path_t path = fixpath(get_comp(L), luaL_checkstring(L, 1), true);
     if (std::regex_search(path, pathregex(WS("^\\d+:")))) {
         bool found = true;
@@ -113,6 +116,7 @@ static int fs_exists(lua_State *L) {
 
 static int fs_isDir(lua_State *L) {
     lastCFunction = __func__;
+    countMetric(get_comp(L), &ComputerMetrics::fsOperations);
     const path_t path = fixpath(get_comp(L), luaL_checkstring(L, 1), true);
     if (path.empty()) {
         lua_pushboolean(L, false);
@@ -130,6 +134,7 @@ static int fs_isDir(lua_State *L) {
 
 static int fs_isReadOnly(lua_State *L) {
     lastCFunction = __func__;
+    countMetric(get_comp(L), &ComputerMetrics::fsOperations);
     if (fixpath_ro(get_comp(L), luaL_checkstring(L, 1))) {
         lua_pushboolean(L, true);
         return 1;
@@ -172,6 +177,7 @@ static int fs_getDrive(lua_State *L) {
 
 static int fs_getSize(lua_State *L) {
     lastCFunction = __func__;
+    countMetric(get_comp(L), &ComputerMetrics::fsOperations);
     const path_t path = fixpath(get_comp(L), luaL_checkstring(L, 1), true);
     if (path.empty()) err(L, 1, "No such file");
     if (std::regex_search(path, pathregex(WS("^\\d+:")))) {
@@ -212,6 +218,7 @@ static int calculateDirectorySize(const path_t& path) {
 
 static int fs_getFreeSpace(lua_State *L) {
     lastCFunction = __func__;
+    countMetric(get_comp(L), &ComputerMetrics::fsOperations);
     std::string mountPath;
     const path_t path = fixpath(get_comp(L), luaL_checkstring(L, 1), false, true, &mountPath);
     if (path.empty()) err(L, 1, "No such path");
@@ -223,6 +230,7 @@ static int fs_getFreeSpace(lua_State *L) {
 
 static int fs_makeDir(lua_State *L) {
     lastCFunction = __func__;
+    countMetric(get_comp(L), &ComputerMetrics::fsOperations);
     if (fixpath_ro(get_comp(L), luaL_checkstring(L, 1))) err(L, 1, "Access denied");
     const path_t path = fixpath_mkdir(get_comp(L), lua_tostring(L, 1));
     if (path.empty()) err(L, 1, "Could not create directory");
@@ -234,6 +242,7 @@ static int fs_makeDir(lua_State *L) {
 
 static int fs_move(lua_State *L) {
     lastCFunction = __func__;
+    countMetric(get_comp(L), &ComputerMetrics::fsOperations);
     if (fixpath_ro(get_comp(L), luaL_checkstring(L, 1))) luaL_error(L, "Access denied");
     if (fixpath_ro(get_comp(L), luaL_checkstring(L, 2))) luaL_error(L, "Access denied");
     bool isRoot = false;
@@ -294,6 +303,7 @@ std::pair<int, std::string> recursiveCopy(const path_t& fromPath, const path_t&
 
 static int fs_copy(lua_State *L) {
     lastCFunction = __func__;
+    countMetric(get_comp(L), &ComputerMetrics::fsOperations);
     if (fixpath_ro(get_comp(L), luaL_checkstring(L, 2))) luaL_error(L, "/%s: Access denied", fixpath(get_comp(L), lua_tostring(L, 2), false, false).c_str());
     const path_t fromPath = fixpath(get_comp(L), luaL_checkstring(L, 1), true);
     const path_t toPath = fixpath_mkdir(get_comp(L), lua_tostring(L, 2));
@@ -340,6 +350,7 @@ static int fs_copy(lua_State *L) {
 
 static int fs_delete(lua_State *L) {
     lastCFunction = __func__;
+    countMetric(get_comp(L), &ComputerMetrics::fsOperations);
     if (fixpath_ro(get_comp(L), luaL_checkstring(L, 1))) err(L, 1, "Access denied");
     bool isRoot = false;
     const path_t path = fixpath(get_comp(L), lua_tostring(L, 1), true, true, NULL, false, &isRoot);
@@ -360,6 +371,7 @@ static int fs_combine(lua_State *L) {
 
 static int fs_open(lua_State *L) {
     lastCFunction = __func__;
+    countMetric(get_comp(L), &ComputerMetrics::fsOperations);
     Computer * computer = get_comp(L);
     if (computer->files_open >= config.maximumFilesOpen) err(L, 1, "Too many files open");
     const char * mode = luaL_checkstring(L, 2);
@@ -620,6 +632,7 @@ static std::list<std::string> matchWildcard(Computer * comp, const std::list<std
 
 static int fs_find(lua_State *L) {
     lastCFunction = __func__;
+    countMetric(get_comp(L), &ComputerMetrics::fsOperations);
     std::vector<std::string> elems = split(luaL_checkstring(L, 1), "/\\");
     std::list<std::string> pathc;
     for (const std::string& s : elems) {
@@ -676,6 +689,7 @@ static int fs_getDir(lua_State *L) {
 
 static int fs_attributes(lua_State *L) {
     lastCFunction = __func__;
+    countMetric(get_comp(L), &ComputerMetrics::fsOperations);
     const path_t path = fixpath(get_comp(L), luaL_checkstring(L, 1), true);
     if (path.empty()) err(L, 1, "No such file");
     if (std::regex_search(path, pathregex(WS("^\\d+:")))) {
@@ -738,6 +752,7 @@ static int fs_attributes(lua_State *L) {
 
 static int fs_getCapacity(lua_State *L) {
     lastCFunction = __func__;
+    countMetric(get_comp(L), &ComputerMetrics::fsOperations);
     std::string mountPath;
     const path_t path = fixpath(get_comp(L), luaL_checkstring(L, 1), false, true, &mountPath);
     if (mountPath == "rom") {
@@ -15,6 +15,7 @@
 #include <locale>
 #include <string>
 #include "fs_handle.hpp"
+#include "../../metrics.hpp"
 #include "../../util.hpp"
 #ifdef __EMSCRIPTEN__
 #include <emscripten/emscripten.h>
@@ -91,6 +92,7 @@ int fs_handle_readAll(lua_State *L) {
     }
     const std::string out = makeASCIISafe(retval, i - (i == size ? 0 : 1));
     delete[] retval;
+    countMetric(get_comp(L), &ComputerMetrics::fsBytesRead, out.length());
     lua_pushlstring(L, out.c_str(), out.length());
     return 1;
 }
@@ -115,6 +117,7 @@ int fs_handle_istream_readAll(lua_State *L) {
     }
     const std::string out = makeASCIISafe(retval, i - (i == size ? 0 : 1));
     delete[] retval;
+    countMetric(get_comp(L), &ComputerMetrics::fsBytesRead, out.length());
     lua_pushlstring(L, out.c_str(), out.length());
     return 1;
 }
@@ -143,6 +146,7 @@ int fs_handle_readLine(lua_State *L) {
     if (len > 0 && retval[len-1] == '\r') retval[--len] = '\0';
     const std::string out = lua_toboolean(L, lua_upvalueindex(2)) ? std::string(retval, len) : makeASCIISafe(retval, len);
     free(retval);
+    countMetric(get_comp(L), &ComputerMetrics::fsBytesRead, out.length());
     lua_pushlstring(L, out.c_str(), out.length());
     return 1;
 }
@@ -158,6 +162,7 @@ int fs_handle_istream_readLine(lua_State *L) {
     size_t len = retval.length() - (retval[retval.length()-1] == '\n' && !lua_toboolean(L, 1));
     if (len > 0 && retval[len-1] == '\r') {if (lua_toboolean(L, 1)) {retval[len] = '\0'; retval[--len] = '\n';} else retval[--len] = '\0';}
     const std::string out = lua_toboolean(L, lua_upvalueindex(2)) ? std::string(retval, 0, len) : makeASCIISafe(retval.c_str(), len);
+    countMetric(get_comp(L), &ComputerMetrics::fsBytesRead, out.length());
     lua_pushlstring(L, out.c_str(), out.length());
     return 1;
 }
@@ -199,6 +204,7 @@ int fs_handle_readChar(lua_State *L) {
             retval += (unsigned char)codepoint;
         }
     }
+    countMetric(get_comp(L), &ComputerMetrics::fsBytesRead, retval.length());
     lua_pushlstring(L, retval.c_str(), retval.length());
     return 1;
 }
@@ -240,6 +246,7 @@ int fs_handle_istream_readChar(lua_State *L) {
             retval += (char)codepoint;
         }
     }
+    countMetric(get_comp(L), &ComputerMetrics::fsBytesRead, retval.length());
     lua_pushlstring(L, retval.c_str(), retval.length());
     return 1;
 }
@@ -261,11 +268,13 @@ int fs_handle_readByte(lua_State *L) {
         char* retval = new char[s];
         const size_t actual = fread(retval, 1, s, fp);
         if (actual == 0 && feof(fp)) {delete[] retval; return 0;}
+        countMetric(get_comp(L), &ComputerMetrics::fsBytesRead, actual);
         lua_pushlstring(L, retval, actual);
         delete[] retval;
     } else {
         const int retval = fgetc(fp);
         if (retval == EOF || feof(fp)) return 0;
+        countMetric(get_comp(L), &ComputerMetrics::fsBytesRead, 1);
         lua_pushinteger(L, (unsigned char)retval);
     }
     return 1;
@@ -286,11 +295,13 @@ int fs_handle_istream_readByte(lua_State *L) {
         char* retval = new char[s];
         const size_t actual = fp->readsome(retval, s);
         if (actual == 0) {delete[] retval; return 0;}
+        countMetric(get_comp(L), &ComputerMetrics::fsBytesRead, actual);
         lua_pushlstring(L, retval, actual);
         delete[] retval;
     } else {
         const int retval = fp->get();
         if (retval == EOF || fp->eof()) return 0;
+        countMetric(get_comp(L), &ComputerMetrics::fsBytesRead, 1);
         lua_pushinteger(L, (unsigned char)retval);
     }
     return 1;
@@ -314,6 +325,7 @@ int fs_handle_readAllByte(lua_State *L) {
         }
         str = strn;
     }
+    countMetric(get_comp(L), &ComputerMetrics::fsBytesRead, size);
     lua_pushlstring(L, str, size);
     return 1;
 }
@@ -336,6 +348,7 @@ int fs_handle_istream_readAllByte(lua_State *L) {
         }
         str = strn;
     }
+    countMetric(get_comp(L), &ComputerMetrics::fsBytesRead, size);
     lua_pushlstring(L, str, size);
     return 1;
 }
@@ -352,6 +365,7 @@ int fs_handle_writeString(lua_State *L) {
     std::wstring_convert<std::codecvt_utf8_utf16<wchar_t> > converter;
     const std::string newstr = converter.to_bytes(wstr);
     fwrite(newstr.c_str(), newstr.size(), 1, fp);
+    countMetric(get_comp(L), &ComputerMetrics::fsBytesWritten, newstr.size());
     return 0;
 }
 
@@ -368,6 +382,7 @@ int fs_handle_writeLine(lua_State *L) {
     const std::string newstr = converter.to_bytes(wstr);
     fwrite(newstr.c_str(), newstr.size(), 1, fp);
     fputc('\n', fp);
+    countMetric(get_comp(L), &ComputerMetrics::fsBytesWritten, newstr.size() + 1);
     return 0;
 }
 
@@ -378,9 +393,11 @@ int fs_handle_writeByte(lua_State *L) {
     if (lua_type(L, 1) == LUA_TNUMBER) {
         const char b = (unsigned char)(lua_tointeger(L, 1) & 0xFF);
         fputc(b, fp);
+        countMetric(get_comp(L), &ComputerMetrics::fsBytesWritten, 1);
     } else if (lua_isstring(L, 1)) {
         if (lua_strlen(L, 1) == 0) return 0;
         fwrite(lua_tostring(L, 1), lua_strlen(L, 1), 1, fp);
+        countMetric(get_comp(L), &ComputerMetrics::fsBytesWritten, lua_strlen(L, 1));
     } else luaL_typerror(L, 1, "number or string");
     return 0;
 }
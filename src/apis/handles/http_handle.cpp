@@ -9,42 +9,204 @@
  */
 
 #ifndef __EMSCRIPTEN__
+#include <algorithm>
 #include <cstdlib>
-#include <codecvt>
-#include <locale>
+#include <cstring>
+#include <memory>
+#include <sstream>
 #include <Poco/Net/HTTPResponse.h>
 #include <Poco/Net/HTTPClientSession.h>
-#include <Poco/Net/HTTPServerResponse.h>
-#include <Poco/Net/HTTPServerRequest.h>
 #include "http_handle.hpp"
 #include "../../util.hpp"
 
 using namespace Poco::Net;
 
+// How long the writer waits for the computer to read from a full buffer before giving up on it.
+static const std::chrono::seconds bodyStallTimeout(60);
+
 struct http_handle_t {
-    bool closed;
+    bool closed = false;
     std::string url;
-    HTTPClientSession * session;
-    HTTPResponse * handle;
-    std::istream * stream;
-    bool isBinary;
+    HTTPResponse * handle = NULL;
+    std::shared_ptr<HTTPBodyBuffer> body;
+    bool isBinary = false;
     std::string failureReason;
-    http_handle_t(std::istream * s) : stream(s) {}
 };
 
-struct http_res {
-    std::string body;
-    HTTPServerResponse * res;
-};
+bool HTTPBodyBuffer::write(const char * data, size_t size) {
+    std::unique_lock<std::mutex> l(lock);
+    while (size > 0) {
+        if (!notify.wait_for(l, bodyStallTimeout, [this]()->bool{return closed || count < ring.size();})) {
+            // nobody is reading the handle (e.g. it was dropped without closing), so stop downloading it
+            closed = true;
+            notify.notify_all();
+            return false;
+        }
+        if (closed) return false;
+        const size_t end = (start + count) % ring.size();
+        const size_t n = min(size, min(ring.size() - count, ring.size() - end));
+        memcpy(&ring[end], data, n);
+        count += n;
+        data += n;
+        size -= n;
+        if (wakeRequested) {
+            wakeRequested = false;
+            if (progress) progress();
+        }
+    }
+    return true;
+}
+
+size_t HTTPBodyBuffer::space() {
+    std::lock_guard<std::mutex> l(lock);
+    return ring.size() - count;
+}
+
+void HTTPBodyBuffer::finish(const std::string& error) {
+    std::lock_guard<std::mutex> l(lock);
+    complete = true;
+    errorMessage = error;
+    notify.notify_all();
+    if (wakeRequested) {
+        wakeRequested = false;
+        if (progress) progress();
+    }
+}
+
+void HTTPBodyBuffer::setProgressCallback(const std::function<void()>& callback) {
+    std::lock_guard<std::mutex> l(lock);
+    progress = callback;
+}
+
+bool HTTPBodyBuffer::poll(size_t bytes, bool line) {
+    std::lock_guard<std::mutex> l(lock);
+    if (complete || closed || count >= min(bytes, ring.size())) return true;
+    if (line && count > 0) {
+        const size_t n = min(count, ring.size() - start);
+        if (memchr(&ring[start], '\n', n) != NULL || (n < count && memchr(&ring[0], '\n', count - n) != NULL)) return true;
+    }
+    wakeRequested = true;
+    return false;
+}
+
+size_t HTTPBodyBuffer::read(char * data, size_t size) {
+    std::lock_guard<std::mutex> l(lock);
+    size_t total = 0;
+    while (total < size && count > 0) {
+        const size_t n = min(size - total, min(count, ring.size() - start));
+        memcpy(data + total, &ring[start], n);
+        start = (start + n) % ring.size();
+        count -= n;
+        total += n;
+    }
+    if (total < size && count == 0 && complete) hitEnd = true;
+    notify.notify_all();
+    return total;
+}
+
+int HTTPBodyBuffer::get() {
+    std::lock_guard<std::mutex> l(lock);
+    if (count == 0) {
+        if (complete) hitEnd = true;
+        return EOF;
+    }
+    const unsigned char c = ring[start];
+    start = (start + 1) % ring.size();
+    count--;
+    notify.notify_all();
+    return c;
+}
+
+bool HTTPBodyBuffer::readLine(std::string& line) {
+    std::lock_guard<std::mutex> l(lock);
+    line.clear();
+    while (true) {
+        if (count == 0) {
+            // a line that doesn't fit in the buffer is returned in pieces
+            if (complete) hitEnd = true;
+            return !line.empty() || !complete;
+        }
+        const size_t n = min(count, ring.size() - start);
+        const char * p = &ring[start];
+        const char * nl = (const char*)memchr(p, '\n', n);
+        const size_t len = nl != NULL ? nl - p : n;
+        line.append(p, len);
+        start = (start + len + (nl != NULL)) % ring.size();
+        count -= len + (nl != NULL);
+        notify.notify_all();
+        if (nl != NULL) return true;
+    }
+}
+
+bool HTTPBodyBuffer::readAvailable(std::string& str) {
+    std::lock_guard<std::mutex> l(lock);
+    if (count > 0) {
+        str.reserve(str.size() + count);
+        const size_t n = min(count, ring.size() - start);
+        str.append(&ring[start], n);
+        if (n < count) str.append(&ring[0], count - n);
+        start = count = 0;
+        notify.notify_all();
+    }
+    if (complete) hitEnd = true;
+    return complete;
+}
+
+bool HTTPBodyBuffer::eof() {
+    std::lock_guard<std::mutex> l(lock);
+    return hitEnd;
+}
+
+std::string HTTPBodyBuffer::error() {
+    std::lock_guard<std::mutex> l(lock);
+    return errorMessage;
+}
+
+void HTTPBodyBuffer::close() {
+    std::lock_guard<std::mutex> l(lock);
+    closed = true;
+    progress = nullptr;
+    notify.notify_all();
+}
+
+// Converts UTF-8 text to the single-byte charset used by CC, replacing characters
+// above U+00FF with '?' (twice for characters outside the BMP, as CC does).
+// Returns false if the string isn't valid UTF-8.
+static bool utf8ToLatin1(const std::string& in, std::string& out) {
+    out.clear();
+    out.reserve(in.size());
+    for (size_t i = 0; i < in.size();) {
+        const unsigned char c = in[i];
+        if (c < 0x80) {out += (char)c; i++; continue;}
+        size_t len;
+        uint32_t codepoint;
+        if ((c & 0xE0) == 0xC0) {len = 2; codepoint = c & 0x1F;}
+        else if ((c & 0xF0) == 0xE0) {len = 3; codepoint = c & 0x0F;}
+        else if ((c & 0xF8) == 0xF0) {len = 4; codepoint = c & 0x07;}
+        else return false;
+        if (i + len > in.size()) return false;
+        for (size_t j = 1; j < len; j++) {
+            const unsigned char cc = in[i+j];
+            if ((cc & 0xC0) != 0x80) return false;
+            codepoint = (codepoint << 6) | (cc & 0x3F);
+        }
+        if ((len == 2 && codepoint < 0x80) || (len == 3 && codepoint < 0x800) || (len == 4 && (codepoint < 0x10000 || codepoint > 0x10FFFF)) || (codepoint >= 0xD800 && codepoint < 0xE000)) return false;
+        if (codepoint < 256) out += (char)codepoint;
+        else if (codepoint < 0x10000) out += '?';
+        else out += "??";
+        i += len;
+    }
+    return true;
+}
 
 int http_handle_free(lua_State *L) {
     lastCFunction = __func__;
     http_handle_t* handle = (http_handle_t*)lua_touserdata(L, lua_upvalueindex(1));
     if (!handle->closed) {
         handle->closed = true;
-        if (handle->failureReason.empty()) get_comp(L)->requests_open--;
+        if (handle->failureReason.empty()) releaseHTTPRequest(get_comp(L));
+        handle->body->close();
         delete handle->handle;
-        delete handle->session;
     }
     delete handle;
     return 0;
@@ -55,32 +217,81 @@ int http_handle_close(lua_State *L) {
     http_handle_t* handle = (http_handle_t*)lua_touserdata(L, lua_upvalueindex(1));
     if (handle->closed) return luaL_error(L, "attempt to use a closed file");
     handle->closed = true;
-    if (handle->failureReason.empty()) get_comp(L)->requests_open--;
+    if (handle->failureReason.empty()) releaseHTTPRequest(get_comp(L));
+    handle->body->close();
     delete handle->handle;
-    delete handle->session;
     return 0;
 }
 
+// Handle reads never wait for the network on the computer thread. If the data a read needs
+// hasn't arrived yet, the function yields for an http_body event (queued once the download
+// has made progress) and is called again from the start when resumed.
+struct http_read_ctx {
+    int top; // the stack size when the function yielded
+    int pieces; // readAll: the number of pieces collected so far, in the table at index 1
+};
+
+// Returns the context if the function was resumed, after removing the event it was resumed with.
+static http_read_ctx * resumeRead(lua_State *L) {
+    http_read_ctx * ctx = (http_read_ctx*)lua_vcontext(L);
+    if (ctx == NULL) return NULL;
+    if (lua_gettop(L) > ctx->top && lua_isstring(L, ctx->top + 1) && strcmp(lua_tostring(L, ctx->top + 1), "terminate") == 0) {
+        lua_settop(L, ctx->top);
+        luaL_error(L, "Terminated");
+    }
+    lua_settop(L, ctx->top);
+    return ctx;
+}
+
+static int waitForBody(lua_State *L, http_read_ctx * ctx) {
+    if (ctx == NULL) {
+        ctx = (http_read_ctx*)lua_newuserdata(L, sizeof(http_read_ctx));
+        ctx->pieces = 0;
+    }
+    ctx->top = lua_gettop(L);
+    lua_pushliteral(L, "http_body");
+    return lua_vyield(L, 1, ctx);
+}
+
 int http_handle_readAll(lua_State *L) {
     lastCFunction = __func__;
     http_handle_t * handle = (http_handle_t*)lua_touserdata(L, lua_upvalueindex(1));
-    if (handle->closed || !handle->stream->good()) return luaL_error(L, "attempt to use a closed file");
+    http_read_ctx * ctx = resumeRead(L);
+    if (ctx == NULL) {
+        if (handle->closed || handle->body->eof()) return luaL_error(L, "attempt to use a closed file");
+        lua_settop(L, 0);
+        lua_newtable(L); // the pieces that arrived so far
+        ctx = (http_read_ctx*)lua_newuserdata(L, sizeof(http_read_ctx));
+        ctx->pieces = 0;
+    } else if (handle->closed) return luaL_error(L, "attempt to use a closed file");
+    // what has arrived is moved out of the buffer each time, so the download can keep going
+    while (true) {
+        std::string piece;
+        const bool done = handle->body->readAvailable(piece);
+        if (!piece.empty()) {
+            lua_pushlstring(L, piece.data(), piece.size());
+            lua_rawseti(L, 1, ++ctx->pieces);
+        }
+        if (done) break;
+        if (!handle->body->poll(1)) return waitForBody(L, ctx);
+    }
     std::string ret;
-    char buffer[4096];
-    while (handle->stream->read(buffer, sizeof(buffer)))
-        ret.append(buffer, sizeof(buffer));
-    ret.append(buffer, handle->stream->gcount());
+    for (int i = 1; i <= ctx->pieces; i++) {
+        size_t len = 0;
+        lua_rawgeti(L, 1, i);
+        const char * str = lua_tolstring(L, -1, &len);
+        ret.append(str, len);
+        lua_pop(L, 1);
+    }
+    const std::string err = handle->body->error();
+    if (!err.empty()) return luaL_error(L, "%s", err.c_str());
     if (!lua_toboolean(L, lua_upvalueindex(2))) ret.erase(std::remove(ret.begin(), ret.end(), '\r'), ret.end());
-    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
-    std::wstring wstr;
-    try {wstr = converter.from_bytes(ret.c_str(), ret.c_str() + ret.length());}
-    catch (std::exception & e) {
-        fprintf(stderr, "http_handle_readAll: Error decoding UTF-8: %s\n", e.what());
+    std::string out;
+    if (!utf8ToLatin1(ret, out)) {
+        fprintf(stderr, "http_handle_readAll: Error decoding UTF-8\n");
         lua_pushlstring(L, ret.c_str(), ret.length());
         return 1;
     }
-    std::string out;
-    for (wchar_t c : wstr) {if (c < 256) out += (char)c; else out += '?';}
     lua_pushlstring(L, out.c_str(), out.length());
     return 1;
 }
@@ -88,21 +299,22 @@ int http_handle_readAll(lua_State *L) {
 int http_handle_readLine(lua_State *L) {
     lastCFunction = __func__;
     http_handle_t * handle = (http_handle_t*)lua_touserdata(L, lua_upvalueindex(1));
+    http_read_ctx * ctx = resumeRead(L);
     if (handle->closed) return luaL_error(L, "attempt to use a closed file");
-    if (!handle->stream->good()) return 0;
+    if (!handle->body->poll(SIZE_MAX, true)) return waitForBody(L, ctx);
     std::string line;
-    std::getline(*handle->stream, line, '\n');
+    if (!handle->body->readLine(line)) {
+        const std::string err = handle->body->error();
+        if (!err.empty()) return luaL_error(L, "%s", err.c_str());
+        return 0;
+    }
     line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
-    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
-    std::wstring wstr;
-    try {wstr = converter.from_bytes(line.c_str(), line.c_str() + line.length());}
-    catch (std::exception & e) {
-        fprintf(stderr, "http_handle_readLine: Error decoding UTF-8: %s\n", e.what());
+    std::string out;
+    if (!utf8ToLatin1(line, out)) {
+        fprintf(stderr, "http_handle_readLine: Error decoding UTF-8\n");
         lua_pushlstring(L, line.c_str(), line.length());
         return 1;
     }
-    std::string out;
-    for (wchar_t c : wstr) {if (c < 256) out += (char)c; else out += '?';}
     lua_pushlstring(L, out.c_str(), out.length());
     return 1;
 }
@@ -110,21 +322,28 @@ int http_handle_readLine(lua_State *L) {
 int http_handle_readChar(lua_State *L) {
     lastCFunction = __func__;
     http_handle_t * handle = (http_handle_t*)lua_touserdata(L, lua_upvalueindex(1));
+    http_read_ctx * ctx = resumeRead(L);
     if (handle->closed) return luaL_error(L, "attempt to use a closed file");
-    if (!handle->stream->good()) return 0;
+    if (handle->body->eof()) {
+        const std::string err = handle->body->error();
+        if (!err.empty()) return luaL_error(L, "%s", err.c_str());
+        return 0;
+    }
+    // a character is at most 4 bytes long
+    if (!handle->body->poll(4)) return waitForBody(L, ctx);
     uint32_t codepoint;
-    const char c = (char)handle->stream->get();
+    const char c = (char)handle->body->get();
     if (c < 0) {
         if (c & 64) {
-            const char c2 = (char)handle->stream->get();
+            const char c2 = (char)handle->body->get();
             if (c2 >= 0 || c2 & 64) codepoint = 1U<<31;
             else if (c & 32) {
-                const char c3 = (char)handle->stream->get();
+                const char c3 = (char)handle->body->get();
                 if (c3 >= 0 || c3 & 64) codepoint = 1U<<31;
                 else if (c & 16) {
                     if (c & 8) codepoint = 1U<<31;
                     else {
-                        const char c4 = (char)handle->stream->get();
+                        const char c4 = (char)handle->body->get();
                         if (c4 >= 0 || c4 & 64) codepoint = 1U<<31;
                         else codepoint = ((c & 0x7) << 18) | ((c2 & 0x3F) << 12) | ((c3 & 0x3F) << 6) | (c4 & 0x3F);
                     }
@@ -147,15 +366,26 @@ int http_handle_readChar(lua_State *L) {
 int http_handle_readByte(lua_State *L) {
     lastCFunction = __func__;
     http_handle_t * handle = (http_handle_t*)lua_touserdata(L, lua_upvalueindex(1));
+    http_read_ctx * ctx = resumeRead(L);
     if (handle->closed) return luaL_error(L, "attempt to use a closed file");
-    if (!handle->stream->good()) return 0;
+    if (handle->body->eof()) {
+        const std::string err = handle->body->error();
+        if (!err.empty()) return luaL_error(L, "%s", err.c_str());
+        return 0;
+    }
+    if (!handle->body->poll(lua_isnumber(L, 1) ? max<size_t>(lua_tointeger(L, 1), 1) : 1)) return waitForBody(L, ctx);
     if (!lua_isnumber(L, 1)) {
-        lua_pushinteger(L, handle->stream->get());
+        lua_pushinteger(L, handle->body->get());
     } else {
         const size_t c = lua_tointeger(L, 1);
-        char * retval = new char[c];
-        handle->stream->read(retval, c);
-        lua_pushlstring(L, retval, c);
+        std::string retval(c, '\0');
+        size_t total = 0;
+        while (total < c) {
+            const size_t n = handle->body->read(&retval[total], c - total);
+            if (n == 0) break;
+            total += n;
+        }
+        lua_pushlstring(L, retval.c_str(), total);
     }
     return 1;
 }
@@ -181,38 +411,70 @@ int http_handle_getResponseHeaders(lua_State *L) {
     return 1;
 }
 
+void http_server_request::send() {
+    if (sent) return;
+    sent = true;
+    std::ostringstream out;
+    response.setContentLength(responseBody.size());
+    response.setKeepAlive(false);
+    response.write(out);
+    out.write(responseBody.c_str(), responseBody.size());
+    const std::string data = out.str();
+    try {
+        for (size_t pos = 0; pos < data.size();) {
+            const int n = socket.sendBytes(data.c_str() + pos, (int)min(data.size() - pos, (size_t)65536));
+            if (n <= 0) break;
+            pos += n;
+        }
+        socket.shutdownSend();
+    } catch (Poco::Exception &e) {
+        socket.close();
+        throw;
+    }
+    socket.close();
+}
+
+// All methods of a server request share one upvalue holding a reference to the request
+static http_server_request * get_request(lua_State *L) {
+    return ((std::shared_ptr<http_server_request>*)lua_touserdata(L, lua_upvalueindex(1)))->get();
+}
+
+static bool request_sent(http_server_request * req) {
+    std::lock_guard<std::mutex> lock(req->lock);
+    return req->sent;
+}
+
 int req_read(lua_State *L) {
     lastCFunction = __func__;
-    HTTPServerRequest * req = (HTTPServerRequest*)lua_touserdata(L, lua_upvalueindex(1));
-    if (*(bool*)lua_touserdata(L, lua_upvalueindex(2)) || !req->stream().good()) return luaL_error(L, "attempt to use a closed file");
-    char tmp[2];
-    tmp[0] = (char)req->stream().get();
-    lua_pushstring(L, tmp);
+    http_server_request * req = get_request(L);
+    if (request_sent(req)) return luaL_error(L, "attempt to use a closed file");
+    if (req->bodyPos >= req->body.size()) return 0;
+    lua_pushlstring(L, &req->body[req->bodyPos++], 1);
     return 1;
 }
 
 int req_readLine(lua_State *L) {
     lastCFunction = __func__;
-    HTTPServerRequest * req = (HTTPServerRequest*)lua_touserdata(L, lua_upvalueindex(1));
-    if (*(bool*)lua_touserdata(L, lua_upvalueindex(2)) || !req->stream().good()) return luaL_error(L, "attempt to use a closed file");
-    std::string line;
-    std::getline(req->stream(), line);
+    http_server_request * req = get_request(L);
+    if (request_sent(req)) return luaL_error(L, "attempt to use a closed file");
+    if (req->bodyPos >= req->body.size()) return 0;
+    size_t end = req->body.find('\n', req->bodyPos);
+    if (end == std::string::npos) end = req->body.size();
+    std::string line = req->body.substr(req->bodyPos, end - req->bodyPos);
+    req->bodyPos = min(end + 1, req->body.size());
     line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
-    lua_pushstring(L, line.c_str());
+    lua_pushlstring(L, line.c_str(), line.size());
     return 1;
 }
 
 int req_readAll(lua_State *L) {
     lastCFunction = __func__;
-    HTTPServerRequest * req = (HTTPServerRequest*)lua_touserdata(L, lua_upvalueindex(1));
-    if (*(bool*)lua_touserdata(L, lua_upvalueindex(2)) || !req->stream().good()) return luaL_error(L, "attempt to use a closed file");
-    std::string ret;
-    char buffer[4096];
-    while (req->stream().read(buffer, sizeof(buffer)))
-        ret.append(buffer, sizeof(buffer));
-    ret.append(buffer, req->stream().gcount());
+    http_server_request * req = get_request(L);
+    if (request_sent(req)) return luaL_error(L, "attempt to use a closed file");
+    std::string ret = req->body.substr(req->bodyPos);
+    req->bodyPos = req->body.size();
     ret.erase(std::remove(ret.begin(), ret.end(), '\r'), ret.end());
-    lua_pushstring(L, ret.c_str());
+    lua_pushlstring(L, ret.c_str(), ret.size());
     return 1;
 }
 
@@ -223,32 +485,38 @@ int req_close(lua_State *L) {
 
 int req_free(lua_State *L) {
     lastCFunction = __func__;
-    delete (bool*)lua_touserdata(L, lua_upvalueindex(1));
+    std::shared_ptr<http_server_request> * req = (std::shared_ptr<http_server_request>*)lua_touserdata(L, 1);
+    {
+        // the handle can't be closed anymore, so don't make the client wait for the timeout
+        std::lock_guard<std::mutex> lock((*req)->lock);
+        try {(*req)->send();} catch (Poco::Exception &e) {}
+    }
+    req->~shared_ptr();
     return 0;
 }
 
 int req_getURL(lua_State *L) {
     lastCFunction = __func__;
-    HTTPServerRequest * req = (HTTPServerRequest*)lua_touserdata(L, lua_upvalueindex(1));
-    if (*(bool*)lua_touserdata(L, lua_upvalueindex(2))) return luaL_error(L, "attempt to use a closed file");
-    lua_pushstring(L, req->getURI().c_str());
+    http_server_request * req = get_request(L);
+    if (request_sent(req)) return luaL_error(L, "attempt to use a closed file");
+    lua_pushstring(L, req->url.c_str());
     return 1;
 }
 
 int req_getMethod(lua_State *L) {
     lastCFunction = __func__;
-    HTTPServerRequest * req = (HTTPServerRequest*)lua_touserdata(L, lua_upvalueindex(1));
-    if (*(bool*)lua_touserdata(L, lua_upvalueindex(2))) return luaL_error(L, "attempt to use a closed file");
-    lua_pushstring(L, req->getMethod().c_str());
+    http_server_request * req = get_request(L);
+    if (request_sent(req)) return luaL_error(L, "attempt to use a closed file");
+    lua_pushstring(L, req->method.c_str());
     return 1;
 }
 
 int req_getRequestHeaders(lua_State *L) {
     lastCFunction = __func__;
-    HTTPServerRequest * req = (HTTPServerRequest*)lua_touserdata(L, lua_upvalueindex(1));
-    if (*(bool*)lua_touserdata(L, lua_upvalueindex(2))) return luaL_error(L, "attempt to use a closed file");
-    lua_createtable(L, 0, req->size());
-    for (const auto& h : *req) {
+    http_server_request * req = get_request(L);
+    if (request_sent(req)) return luaL_error(L, "attempt to use a closed file");
+    lua_createtable(L, 0, req->headers.size());
+    for (const auto& h : req->headers) {
         lua_pushstring(L, h.first.c_str());
         lua_pushstring(L, h.second.c_str());
         lua_settable(L, -3);
@@ -258,54 +526,74 @@ int req_getRequestHeaders(lua_State *L) {
 
 int res_write(lua_State *L) {
     lastCFunction = __func__;
-    struct http_res * res = (http_res*)lua_touserdata(L, lua_upvalueindex(1));
-    if (*(bool*)lua_touserdata(L, lua_upvalueindex(2)) || res->res->sent()) return luaL_error(L, "attempt to use a closed file");
+    http_server_request * req = get_request(L);
     size_t len = 0;
     const char * buf = luaL_checklstring(L, 1, &len);
-    res->body += std::string(buf, len);
+    bool sent;
+    {
+        std::lock_guard<std::mutex> lock(req->lock);
+        if (!(sent = req->sent)) req->responseBody.append(buf, len);
+    }
+    if (sent) return luaL_error(L, "attempt to use a closed file");
     return 0;
 }
 
 int res_writeLine(lua_State *L) {
     lastCFunction = __func__;
-    struct http_res * res = (http_res*)lua_touserdata(L, lua_upvalueindex(1));
-    if (*(bool*)lua_touserdata(L, lua_upvalueindex(2)) || res->res->sent()) return luaL_error(L, "attempt to use a closed file");
+    http_server_request * req = get_request(L);
     size_t len = 0;
     const char * buf = luaL_checklstring(L, 1, &len);
-    res->body += std::string(buf, len);
-    res->body += "\n";
+    bool sent;
+    {
+        std::lock_guard<std::mutex> lock(req->lock);
+        if (!(sent = req->sent)) {
+            req->responseBody.append(buf, len);
+            req->responseBody += "\n";
+        }
+    }
+    if (sent) return luaL_error(L, "attempt to use a closed file");
     return 0;
 }
 
 int res_close(lua_State *L) {
     lastCFunction = __func__;
-    struct http_res * res = (http_res*)lua_touserdata(L, lua_upvalueindex(1));
-    if (*(bool*)lua_touserdata(L, lua_upvalueindex(2)) || res->res->sent()) return luaL_error(L, "attempt to use a closed file");
-    const std::string body((const std::string)res->body);
-    try {
-        res->res->setContentLength(body.size());
-        res->res->send().write(body.c_str(), body.size());
-    } catch (std::exception &e) {
-        *(bool*)lua_touserdata(L, lua_upvalueindex(2)) = true;
-        luaL_error(L, "Could not send data: %s", e.what());
+    http_server_request * req = get_request(L);
+    bool sent;
+    std::string err;
+    {
+        std::lock_guard<std::mutex> lock(req->lock);
+        if (!(sent = req->sent)) {
+            try {req->send();} catch (Poco::Exception &e) {err = e.displayText();}
+        }
     }
-    *(bool*)lua_touserdata(L, lua_upvalueindex(2)) = true;
+    if (sent) return luaL_error(L, "attempt to use a closed file");
+    if (!err.empty()) return luaL_error(L, "Could not send data: %s", err.c_str());
     return 0;
 }
 
 int res_setStatusCode(lua_State *L) {
     lastCFunction = __func__;
-    struct http_res * res = (http_res*)lua_touserdata(L, lua_upvalueindex(1));
-    if (*(bool*)lua_touserdata(L, lua_upvalueindex(2)) || res->res->sent()) return luaL_error(L, "attempt to use a closed file");
-    res->res->setStatus((HTTPResponse::HTTPStatus)luaL_checkinteger(L, 1));
+    http_server_request * req = get_request(L);
+    const lua_Integer status = luaL_checkinteger(L, 1);
+    bool sent;
+    {
+        std::lock_guard<std::mutex> lock(req->lock);
+        if (!(sent = req->sent)) req->response.setStatusAndReason((HTTPResponse::HTTPStatus)status);
+    }
+    if (sent) return luaL_error(L, "attempt to use a closed file");
     return 0;
 }
 
 int res_setResponseHeader(lua_State *L) {
     lastCFunction = __func__;
-    struct http_res * res = (http_res*)lua_touserdata(L, lua_upvalueindex(1));
-    if (*(bool*)lua_touserdata(L, lua_upvalueindex(2)) || res->res->sent()) return luaL_error(L, "attempt to use a closed file");
-    res->res->set(luaL_checkstring(L, 1), luaL_checkstring(L, 2));
+    http_server_request * req = get_request(L);
+    const std::string key = luaL_checkstring(L, 1), value = luaL_checkstring(L, 2);
+    bool sent;
+    {
+        std::lock_guard<std::mutex> lock(req->lock);
+        if (!(sent = req->sent)) req->response.set(key, value);
+    }
+    if (sent) return luaL_error(L, "attempt to use a closed file");
     return 0;
 }
 
@@ -13,6 +13,76 @@
 extern "C" {
 #include <lua.h>
 }
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <Poco/Net/HTTPResponse.h>
+#include <Poco/Net/NameValueCollection.h>
+#include <Poco/Net/StreamSocket.h>
+namespace Poco {namespace Net {class HTTPClientSession;}}
+struct Computer;
+extern void releaseHTTPSession(Poco::Net::HTTPClientSession * session, bool reusable);
+extern void releaseHTTPRequest(Computer * comp);
+
+// A bounded ring buffer that an HTTP response body is downloaded into by a network thread.
+// The writer blocks while the buffer is full, so at most `capacity` bytes are held in memory
+// at a time. The reader never waits: it only takes bytes that have already arrived, and uses
+// poll to be told (through the progress callback) once there's more to read.
+// If the reader doesn't make room for a while, the handle is treated as abandoned and closed.
+class HTTPBodyBuffer {
+    std::vector<char> ring;
+    size_t start = 0; // position of the first unread byte
+    size_t count = 0; // number of unread bytes
+    bool complete = false; // set by the writer once the whole body (or as much as will arrive) is in
+    bool closed = false; // set by the reader when the handle is closed
+    bool hitEnd = false; // set once a read has tried to go past the end, like std::istream::eof()
+    std::string errorMessage; // why the body ended early, if it did
+    bool wakeRequested = false; // set by poll when the reader is waiting for more data
+    std::function<void()> progress; // called (with the lock held) when a waiting reader can go on
+    std::mutex lock;
+    std::condition_variable notify;
+public:
+    HTTPBodyBuffer(size_t capacity): ring(capacity) {}
+    // Writer side
+    bool write(const char * data, size_t size); // returns false if the reader closed the handle
+    size_t space(); // number of bytes that can be written without blocking
+    void finish(const std::string& error = ""); // error is set if the rest of the body couldn't be downloaded
+    void setProgressCallback(const std::function<void()>& callback);
+    // Reader side; none of these wait for data
+    // Returns whether `bytes` bytes (or a whole line) can be read now, or the body has ended;
+    // if not, the progress callback is called once more has arrived.
+    bool poll(size_t bytes, bool line = false);
+    size_t read(char * data, size_t size); // returns 0 if nothing has arrived yet
+    int get(); // returns EOF if nothing has arrived yet
+    bool readLine(std::string& line); // returns false at the end of the body
+    bool readAvailable(std::string& str); // appends everything that arrived; returns true once the whole body was read
+    bool eof(); // whether a previous read reached the end of the body
+    std::string error(); // the error passed to finish, if any
+    void close();
+};
+
+// A request received by an http.addListener server. The connection is detached from the
+// server thread that accepted it, so the response can be sent whenever the computer is done.
+struct http_server_request {
+    int port = 0;
+    std::string url;
+    std::string method;
+    Poco::Net::NameValueCollection headers;
+    std::string body; // read in full before the event is queued
+    size_t bodyPos = 0;
+    Poco::Net::StreamSocket socket;
+    Poco::Net::HTTPResponse response;
+    std::string responseBody;
+    std::chrono::system_clock::time_point deadline; // when the response is sent even if not closed
+    bool sent = false;
+    std::mutex lock; // protects the response fields and `sent`
+    // Sends the response and closes the connection, if not already done. Must be called with
+    // `lock` held. Throws Poco::Exception if sending fails (the connection is closed anyway).
+    void send();
+};
 extern int http_handle_free(lua_State *L);
 extern int http_handle_close(lua_State *L);
 extern int http_handle_readAll(lua_State *L);
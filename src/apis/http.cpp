@@ -16,9 +16,14 @@
 #include <cstring>
 #include <algorithm>
 #include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <list>
+#include <memory>
+#include <queue>
 #include <Computer.hpp>
 #include <configuration.hpp>
+#include <Poco/Buffer.h>
 #include <Poco/URI.h>
 #include <Poco/Version.h>
 #include <Poco/Net/HTTPRequest.h>
@@ -30,9 +35,14 @@
 #include <Poco/Net/HTTPRequestHandler.h>
 #include <Poco/Net/HTTPRequestHandlerFactory.h>
 #include <Poco/Net/HTTPServerRequest.h>
+#include <Poco/Net/HTTPServerRequestImpl.h>
 #include <Poco/Net/HTTPServerResponse.h>
+#include <Poco/Net/HTTPServerParams.h>
 #include <Poco/Net/HTTPServer.h>
+#include <Poco/Net/ServerSocket.h>
+#include <Poco/ThreadPool.h>
 #include "handles/http_handle.hpp"
+#include "../metrics.hpp"
 #include "../platform.hpp"
 #include "../runtime.hpp"
 #include "../util.hpp"
@@ -55,14 +65,12 @@ struct http_param_t {
 };
 
 struct http_handle_t {
-    bool closed;
+    bool closed = false;
     std::string url;
-    HTTPClientSession * session;
-    HTTPResponse * handle;
-    std::istream * stream;
-    bool isBinary;
+    HTTPResponse * handle = NULL;
+    std::shared_ptr<HTTPBodyBuffer> body;
+    bool isBinary = false;
     std::string failureReason;
-    http_handle_t(std::istream * s): stream(s) {}
 };
 
 struct http_check_t{
@@ -70,8 +78,11 @@ struct http_check_t{
     std::string status;
 };
 
+static void requestCompleted(Computer * comp, bool opened);
+
 static std::string http_success(lua_State *L, void* data) {
     http_handle_t * handle = (http_handle_t*)data;
+    requestCompleted(get_comp(L), true);
     luaL_checkstack(L, 30, "Unable to allocate HTTP handle");
     lua_pushlstring(L, handle->url.c_str(), handle->url.size());
     lua_createtable(L, 0, 5);
@@ -124,10 +135,11 @@ static std::string http_success(lua_State *L, void* data) {
 
 static std::string http_failure(lua_State *L, void* data) {
     http_handle_t * handle = (http_handle_t*)data;
+    requestCompleted(get_comp(L), false);
     luaL_checkstack(L, 30, "Unable to allocate HTTP handle");
     lua_pushlstring(L, handle->url.c_str(), handle->url.size());
     if (!handle->failureReason.empty()) lua_pushstring(L, handle->failureReason.c_str());
-    if (handle->stream != NULL) {
+    if (handle->body != NULL) {
         lua_createtable(L, 0, 5);
 
         lua_pushstring(L, "close");
@@ -179,6 +191,11 @@ static std::string http_failure(lua_State *L, void* data) {
     return "http_failure";
 }
 
+// Wakes up handle reads that are waiting for more of a body to arrive.
+static std::string http_body(lua_State *L, void* data) {
+    return "http_body";
+}
+
 static std::string http_check(lua_State *L, void* data) {
     http_check_t * res = (http_check_t*)data;
     lua_pushlstring(L, res->url.c_str(), res->url.size());
@@ -189,24 +206,254 @@ static std::string http_check(lua_State *L, void* data) {
     return "http_check";
 }
 
-static void downloadThread(void* arg) {
+// HTTP client connections are kept alive and shared between all computers, keyed by the
+// scheme, host, port and proxy they connect through. Sessions are checked out by a request
+// and returned once the Lua side has finished reading the response.
+static std::unordered_map<std::string, std::list<std::pair<HTTPClientSession*, std::chrono::system_clock::time_point> > > idleSessions;
+static std::mutex idleSessionsLock;
+static constexpr unsigned maxIdleSessionsPerHost = 8;
+static constexpr std::chrono::seconds idleSessionTimeout(60);
+static constexpr size_t httpBodyBufferSize = 1048576;
+
+static const Context::Ptr& clientContext() {
+    static const Context::Ptr context = new Context(Context::CLIENT_USE, "", Context::VERIFY_NONE, 9, true, "ALL:!ADH:!LOW:!EXP:!MD5:@STRENGTH");
+    return context;
+}
+
+static std::string sessionKey(bool secure, const std::string& host, Poco::UInt16 port, const std::string& proxyHost, Poco::UInt16 proxyPort) {
+    return (secure ? "https://" : "http://") + host + ":" + std::to_string(port) + " " + proxyHost + ":" + std::to_string(proxyPort);
+}
+
+static HTTPClientSession * newHTTPSession(const Poco::URI& uri) {
+    HTTPClientSession * session;
+    if (uri.getScheme() == "http") session = new HTTPClientSession(uri.getHost(), uri.getPort());
+    else session = new HTTPSClientSession(uri.getHost(), uri.getPort(), clientContext());
+    if (!config.http_proxy_server.empty()) session->setProxy(config.http_proxy_server, config.http_proxy_port);
+    session->setKeepAlive(true);
+    return session;
+}
+
+// Returns an idle session for the URI's server if one exists, or a new one otherwise.
+static HTTPClientSession * acquireHTTPSession(const Poco::URI& uri, bool& reused) {
+    const std::string key = sessionKey(uri.getScheme() != "http", uri.getHost(), uri.getPort(), config.http_proxy_server, config.http_proxy_server.empty() ? 0 : config.http_proxy_port);
+    const auto now = std::chrono::system_clock::now();
+    std::list<HTTPClientSession*> expired;
+    HTTPClientSession * session = NULL;
+    {
+        std::lock_guard<std::mutex> lock(idleSessionsLock);
+        auto it = idleSessions.find(key);
+        if (it != idleSessions.end()) {
+            while (!it->second.empty() && session == NULL) {
+                auto entry = it->second.back();
+                it->second.pop_back();
+                if (now - entry.second > idleSessionTimeout) expired.push_back(entry.first);
+                else session = entry.first;
+            }
+            if (it->second.empty()) idleSessions.erase(it);
+        }
+    }
+    for (HTTPClientSession * s : expired) delete s;
+    reused = session != NULL;
+    if (session == NULL) session = newHTTPSession(uri);
+    return session;
+}
+
+/* export */ void releaseHTTPSession(HTTPClientSession * session, bool reusable) {
+    if (session == NULL) return;
+    if (!reusable || !session->getKeepAlive() || !session->connected()) {
+        delete session;
+        return;
+    }
+    const std::string key = sessionKey(dynamic_cast<HTTPSClientSession*>(session) != NULL, session->getHost(), session->getPort(), session->getProxyHost(), session->getProxyHost().empty() ? 0 : session->getProxyPort());
+    HTTPClientSession * evicted = NULL;
+    {
+        std::lock_guard<std::mutex> lock(idleSessionsLock);
+        auto& list = idleSessions[key];
+        list.push_back(std::make_pair(session, std::chrono::system_clock::now()));
+        if (list.size() > maxIdleSessionsPerHost) {
+            evicted = list.front().first;
+            list.pop_front();
+        }
+    }
+    delete evicted;
+}
+
+// Requests are run on a shared pool of worker threads, which grows as needed up to a fixed size.
+// Each computer may have at most http_max_requests requests in flight or open at once; any more
+// are held back and dispatched in order as earlier requests finish.
+struct http_computer_state {
+    std::queue<http_param_t*> queued;
+    int inFlight = 0;
+    std::list<std::weak_ptr<HTTPBodyBuffer>> bodies; // bodies still being downloaded, closed when the computer shuts down
+};
+
+static std::unordered_map<Computer*, http_computer_state> requestStates;
+static std::mutex requestStatesLock;
+static std::queue<http_param_t*> workQueue;
+static std::mutex workQueueLock;
+static std::condition_variable workQueueNotify;
+static unsigned workerCount = 0;
+static unsigned idleWorkers = 0;
+static constexpr unsigned maxHTTPWorkers = 32;
+
+static void downloadThread(void* arg);
+
+static void httpWorkerThread() {
 #ifdef __APPLE__
-    pthread_setname_np("HTTP Download Thread");
+    pthread_setname_np("HTTP Request Thread");
 #endif
+    std::unique_lock<std::mutex> lock(workQueueLock);
+    while (true) {
+        idleWorkers++;
+        workQueueNotify.wait(lock, []()->bool{return !workQueue.empty();});
+        idleWorkers--;
+        http_param_t * param = workQueue.front();
+        workQueue.pop();
+        lock.unlock();
+        downloadThread(param);
+        lock.lock();
+    }
+}
+
+static void submitHTTPRequest(http_param_t * param) {
+    std::lock_guard<std::mutex> lock(workQueueLock);
+    workQueue.push(param);
+    if (idleWorkers == 0 && workerCount < maxHTTPWorkers) {
+        workerCount++;
+        std::thread th(httpWorkerThread);
+        setThreadName(th, "HTTP Request Thread");
+        th.detach();
+    } else workQueueNotify.notify_one();
+}
+
+// Dispatches queued requests for a computer while it has free request slots. Must be called with requestStatesLock held.
+static void dispatchQueuedRequests(Computer * comp, http_computer_state& state) {
+    while (!state.queued.empty() && (config.http_max_requests <= 0 || comp->requests_open + state.inFlight < config.http_max_requests)) {
+        http_param_t * param = state.queued.front();
+        state.queued.pop();
+        state.inFlight++;
+        submitHTTPRequest(param);
+    }
+}
+
+// Called on the computer thread when a request's result event is delivered.
+static void requestCompleted(Computer * comp, bool opened) {
+    std::lock_guard<std::mutex> lock(requestStatesLock);
+    http_computer_state& state = requestStates[comp];
+    if (state.inFlight > 0) state.inFlight--;
+    if (opened) comp->requests_open++;
+    dispatchQueuedRequests(comp, state);
+}
+
+/* export */ void releaseHTTPRequest(Computer * comp) {
+    std::lock_guard<std::mutex> lock(requestStatesLock);
+    comp->requests_open--;
+    auto it = requestStates.find(comp);
+    if (it != requestStates.end()) dispatchQueuedRequests(comp, it->second);
+}
+
+static void http_deinit(Computer * comp) {
+    std::lock_guard<std::mutex> lock(requestStatesLock);
+    auto it = requestStates.find(comp);
+    if (it == requestStates.end()) return;
+    while (!it->second.queued.empty()) {
+        delete it->second.queued.front();
+        it->second.queued.pop();
+    }
+    for (const auto& b : it->second.bodies) {
+        std::shared_ptr<HTTPBodyBuffer> body = b.lock();
+        if (body) body->close();
+    }
+    requestStates.erase(it);
+}
+
+static void downloadFailed(http_param_t * param, const std::string& reason) {
+    http_handle_t * err = new http_handle_t;
+    err->url = param->url;
+    err->failureReason = reason;
+    queueEvent(param->comp, http_failure, err);
+    delete param;
+}
+
+struct body_download_t {
+    http_param_t * param;
+    http_handle_t * handle;
+    std::shared_ptr<HTTPBodyBuffer> body;
+    HTTPClientSession * session;
+    std::istream * stream;
+    std::string pending; // read from the stream, but not written to the buffer yet
+    size_t total = 0;
+    bool queued = false;
+};
+
+// Downloads the body in the background. The event is only sent once the whole body has
+// arrived, or once the buffer fills up for bodies that are larger than it - in that case
+// the rest is streamed in as the computer reads it, on a thread of its own so that a slow
+// reader doesn't hold up a pool worker.
+static void downloadBody(body_download_t * d, bool pooled) {
+    Computer * comp = d->param->comp;
+    bool finished = false;
+    std::string error;
+    char buf[8192];
+    try {
+        while (true) {
+            if (d->pending.empty()) {
+                d->stream->read(buf, sizeof(buf));
+                const size_t n = d->stream->gcount();
+                if (n == 0) {
+                    if (d->stream->bad()) error = "Failed to read response";
+                    else finished = true;
+                    break;
+                }
+                d->total += n;
+                if (config.http_max_download > 0 && d->total > (size_t)config.http_max_download) {
+                    error = "Response is too large";
+                    break;
+                }
+                d->pending.assign(buf, n);
+            }
+            if (d->body->space() < d->pending.size()) {
+                if (!d->queued) {
+                    queueEvent(comp, d->handle->failureReason.empty() ? http_success : http_failure, d->handle);
+                    d->queued = true;
+                }
+                if (pooled) {
+                    std::thread th(downloadBody, d, false);
+                    setThreadName(th, "HTTP Download Thread");
+                    th.detach();
+                    return;
+                }
+            }
+            if (!d->body->write(d->pending.data(), d->pending.size())) break; // closed by the computer, or abandoned
+            d->pending.clear();
+        }
+    } catch (Poco::TimeoutException &e) {
+        error = "Timed out";
+    } catch (Poco::Exception &e) {
+        error = e.message();
+    }
+    // the handle may already be reading the body, so tell it why the body ended early
+    d->body->finish(d->queued ? error : "");
+    releaseHTTPSession(d->session, finished);
+    if (!d->queued) {
+        if (!error.empty()) {
+            delete d->handle->handle;
+            delete d->handle;
+            downloadFailed(d->param, error);
+            delete d;
+            return;
+        }
+        queueEvent(comp, d->handle->failureReason.empty() ? http_success : http_failure, d->handle);
+    }
+    delete d->param;
+    delete d;
+}
+
+static void downloadThread(void* arg) {
     http_param_t* param = (http_param_t*)arg;
     Poco::URI uri(param->url);
     if (uri.getHost() == "localhost") uri.setHost("127.0.0.1");
-    HTTPClientSession * session;
-    if (uri.getScheme() == "http") {
-        session = new HTTPClientSession(uri.getHost(), uri.getPort());
-    } else {
-        const Context::Ptr context = new Context(Context::CLIENT_USE, "", Context::VERIFY_NONE, 9, true, "ALL:!ADH:!LOW:!EXP:!MD5:@STRENGTH");
-        session = new HTTPSClientSession(uri.getHost(), uri.getPort(), context);
-    }
-    if (!config.http_proxy_server.empty()) session->setProxy(config.http_proxy_server, config.http_proxy_port);
     HTTPRequest request(!param->method.empty() ? param->method : (!param->postData.empty() ? "POST" : "GET"), uri.getPathAndQuery(), HTTPMessage::HTTP_1_1);
-    HTTPResponse * response = new HTTPResponse();
-    if (config.http_timeout > 0) session->setTimeout(Poco::Timespan(config.http_timeout * 1000));
     size_t requestSize = param->postData.size();
     for (const auto& h : param->headers) {request.add(h.first, h.second); requestSize += h.first.size() + h.second.size() + 1;}
     if (!request.has("User-Agent")) request.add("User-Agent", "computercraft/" CRAFTOSPC_CC_VERSION " CraftOS-PC/" CRAFTOSPC_VERSION);
@@ -216,111 +463,98 @@ static void downloadThread(void* arg) {
         if (request.getContentType() == HTTPRequest::UNKNOWN_CONTENT_TYPE) request.setContentType("application/x-www-form-urlencoded; charset=utf-8");
     }
     if (config.http_max_upload > 0 && requestSize > (unsigned)config.http_max_upload) {
-        http_handle_t * err = new http_handle_t(NULL);
-        err->url = param->url;
-        err->failureReason = "Request body is too large";
-        queueEvent(param->comp, http_failure, err);
-        delete param;
-        delete response;
-        delete session;
+        downloadFailed(param, "Request body is too large");
         return;
     }
-    try {
-        std::ostream& reqs = session->sendRequest(request);
-        if (!param->postData.empty()) reqs.write(param->postData.c_str(), param->postData.size());
-        if (reqs.bad() || reqs.fail()) {
-            http_handle_t * err = new http_handle_t(NULL);
-            err->url = param->url;
-            err->failureReason = "Failed to send request";
-            queueEvent(param->comp, http_failure, err);
-            delete param;
+    // A kept-alive connection may turn out to be closed only after the request was sent, and then
+    // the request is sent again on a new one. That's only safe for GET and HEAD, so any other
+    // method always gets a new connection.
+    bool reused = false;
+    HTTPClientSession * session;
+    if (request.getMethod() == HTTPRequest::HTTP_GET || request.getMethod() == HTTPRequest::HTTP_HEAD) session = acquireHTTPSession(uri, reused);
+    else session = newHTTPSession(uri);
+    HTTPResponse * response = new HTTPResponse();
+    std::istream * stream = NULL;
+    while (stream == NULL) {
+        if (config.http_timeout > 0) session->setTimeout(Poco::Timespan(config.http_timeout * 1000));
+        try {
+            std::ostream& reqs = session->sendRequest(request);
+            if (!param->postData.empty()) reqs.write(param->postData.c_str(), param->postData.size());
+            if (reqs.bad() || reqs.fail()) {
+                if (reused) throw NetException("Connection was closed");
+                downloadFailed(param, "Failed to send request");
+                delete response;
+                delete session;
+                return;
+            }
+            stream = &session->receiveResponse(*response);
+        } catch (Poco::TimeoutException &e) {
+            downloadFailed(param, "Timed out");
+            delete response;
+            delete session;
+            return;
+        } catch (Poco::Exception &e) {
+            if (reused) {
+                // the server closed the kept-alive connection in the meantime, so try again on a new one
+                delete session;
+                delete response;
+                session = newHTTPSession(uri);
+                response = new HTTPResponse();
+                reused = false;
+                continue;
+            }
+            fprintf(stderr, "Error while downloading %s: %s\n", param->url.c_str(), e.message().c_str());
+            downloadFailed(param, e.message());
             delete response;
             delete session;
             return;
         }
-    } catch (Poco::TimeoutException &e) {
-        http_handle_t * err = new http_handle_t(NULL);
-        err->url = param->url;
-        err->failureReason = "Timed out";
-        queueEvent(param->comp, http_failure, err);
-        delete param;
-        delete response;
-        delete session;
-        return;
-    } catch (Poco::Exception &e) {
-        fprintf(stderr, "Error while downloading %s: %s\n", param->url.c_str(), e.message().c_str());
-        http_handle_t * err = new http_handle_t(NULL);
-        err->url = param->url;
-        err->failureReason = e.message();
-        queueEvent(param->comp, http_failure, err);
-        delete param;
-        delete response;
-        delete session;
-        return;
-    }
-    http_handle_t * handle;
-    try {
-        handle = new http_handle_t(&session->receiveResponse(*response));
-    } catch (Poco::TimeoutException &e) {
-        http_handle_t * err = new http_handle_t(NULL);
-        err->url = param->url;
-        err->failureReason = "Timed out";
-        queueEvent(param->comp, http_failure, err);
-        delete param;
-        delete response;
-        delete session;
-        return;
-    } catch (Poco::Exception &e) {
-        fprintf(stderr, "Error while downloading %s: %s\n", param->url.c_str(), e.message().c_str());
-        http_handle_t * err = new http_handle_t(NULL);
-        err->url = param->url;
-        err->failureReason = e.message();
-        queueEvent(param->comp, http_failure, err);
-        delete param;
-        delete response;
-        delete session;
-        return;
     }
     if (config.http_max_download > 0 && response->hasContentLength() && response->getContentLength() > config.http_max_download) {
-        http_handle_t * err = new http_handle_t(NULL);
-        err->url = param->url;
-        err->failureReason = "Response is too large";
-        queueEvent(param->comp, http_failure, err);
-        delete param;
+        downloadFailed(param, "Response is too large");
         delete response;
         delete session;
         return;
     }
-    handle->session = session;
-    handle->handle = response;
-    handle->url = param->old_url;
-    handle->isBinary = param->isBinary;
-    if (param->redirect && handle->handle->getStatus() / 100 == 3 && handle->handle->has("Location")) {
-        std::string location = handle->handle->get("Location");
+    if (param->redirect && response->getStatus() / 100 == 3 && response->has("Location")) {
+        std::string location = response->get("Location");
         if (location.find("://") == std::string::npos) {
             if (location[0] == '/') location = uri.getScheme() + "://" + uri.getHost() + location;
             else location = uri.getScheme() + "://" + uri.getHost() + uri.getPath() + "/" + location;
         }
-        delete handle->handle;
-        delete handle->session;
-        delete handle;
+        delete response;
+        delete session;
         param->url = location;
         return downloadThread(param);
     }
-    handle->closed = false;
-    if (response->getStatus() >= 400) {
-        handle->failureReason = HTTPResponse::getReasonForStatus(response->getStatus());
-        queueEvent(param->comp, http_failure, handle);
-    } else {
-        param->comp->requests_open++;
-        queueEvent(param->comp, http_success, handle);
+    http_handle_t * handle = new http_handle_t;
+    handle->handle = response;
+    handle->url = param->old_url;
+    handle->isBinary = param->isBinary;
+    handle->body = std::make_shared<HTTPBodyBuffer>(httpBodyBufferSize);
+    if (response->getStatus() >= 400) handle->failureReason = HTTPResponse::getReasonForStatus(response->getStatus());
+    Computer * comp = param->comp;
+    handle->body->setProgressCallback([comp]() {queueEvent(comp, http_body, NULL);});
+    {
+        std::lock_guard<std::mutex> lock(requestStatesLock);
+        auto it = requestStates.find(param->comp);
+        if (it != requestStates.end()) {
+            it->second.bodies.remove_if([](const std::weak_ptr<HTTPBodyBuffer>& b)->bool {return b.expired();});
+            it->second.bodies.push_back(handle->body);
+        }
     }
-    delete param;
+    body_download_t * download = new body_download_t;
+    download->param = param;
+    download->handle = handle;
+    download->body = handle->body;
+    download->session = session;
+    download->stream = stream;
+    downloadBody(download, true);
 }
 
 void HTTPDownload(const std::string& url, const std::function<void(std::istream*, Poco::Exception*)>& callback) {
     Poco::URI uri(url);
-    HTTPSClientSession session(uri.getHost(), uri.getPort(), new Context(Context::CLIENT_USE, "", Context::VERIFY_NONE, 9, true, "ALL:!ADH:!LOW:!EXP:!MD5:@STRENGTH"));
+    HTTPSClientSession session(uri.getHost(), uri.getPort(), clientContext());
     if (!config.http_proxy_server.empty()) session.setProxy(config.http_proxy_server, config.http_proxy_port);
     HTTPRequest request(HTTPRequest::HTTP_GET, uri.getPathAndQuery(), HTTPMessage::HTTP_1_1);
     HTTPResponse response;
@@ -416,9 +650,13 @@ static int http_request(lua_State *L) {
         if (lua_isstring(L, 5)) param->method = lua_tostring(L, 5);
         param->redirect = !lua_isboolean(L, 6) || lua_toboolean(L, 6);
     }
-    std::thread th(downloadThread, param);
-    setThreadName(th, "HTTP Request Thread");
-    th.detach();
+    countMetric(param->comp, &ComputerMetrics::httpRequests);
+    {
+        std::lock_guard<std::mutex> lock(requestStatesLock);
+        http_computer_state& state = requestStates[param->comp];
+        state.queued.push(param);
+        dispatchQueuedRequests(param->comp, state);
+    }
     lua_pushboolean(L, 1);
     return 1;
 }
@@ -445,111 +683,108 @@ static int http_checkURL(lua_State *L) {
 #pragma region Server
 #endif
 
-struct http_res {
-    std::string body;
-    HTTPServerResponse * res;
-};
-
-struct http_request_data {
-    int port;
-    bool closed;
-    HTTPServerRequest * req;
-    http_res * res;
-};
-
-struct http_server_data {
-    int port;
-    Computer * comp;
-};
-
 static std::string http_request_event(lua_State *L, void* userp) {
-    http_request_data* data = (http_request_data*)userp;
-    bool* closed = &data->closed;
-    *closed = false;
-    lua_pushinteger(L, data->port);
-    lua_createtable(L, 0, 7);
-
-    lua_pushstring(L, "read");
-    lua_pushlightuserdata(L, data->req);
-    lua_pushlightuserdata(L, closed);
-    lua_pushcclosure(L, req_read, 2);
-    lua_settable(L, -3);
-
-    lua_pushstring(L, "readLine");
-    lua_pushlightuserdata(L, data->req);
-    lua_pushlightuserdata(L, closed);
-    lua_pushcclosure(L, req_readLine, 2);
-    lua_settable(L, -3);
-
-    lua_pushstring(L, "readAll");
-    lua_pushlightuserdata(L, data->req);
-    lua_pushlightuserdata(L, closed);
-    lua_pushcclosure(L, req_readAll, 2);
-    lua_settable(L, -3);
-
-    lua_pushstring(L, "close");
-    lua_pushlightuserdata(L, data->req);
-    lua_pushlightuserdata(L, closed);
+    std::shared_ptr<http_server_request> * data = (std::shared_ptr<http_server_request>*)userp;
+    lua_pushinteger(L, (*data)->port);
+    // every method holds the request through this userdata, which lets go of it once they're all collected
+    std::shared_ptr<http_server_request> * ref = (std::shared_ptr<http_server_request>*)lua_newuserdata(L, sizeof(std::shared_ptr<http_server_request>));
+    new(ref) std::shared_ptr<http_server_request>(std::move(*data));
+    delete data;
+    const int refidx = lua_gettop(L);
     lua_createtable(L, 0, 1);
     lua_pushstring(L, "__gc");
-    lua_pushlightuserdata(L, closed);
-    lua_pushcclosure(L, req_free, 1);
-    lua_settable(L, -3);
-    lua_setmetatable(L, -2);
-    lua_pushcclosure(L, req_close, 2);
-    lua_settable(L, -3);
-
-    lua_pushstring(L, "getURL");
-    lua_pushlightuserdata(L, data->req);
-    lua_pushlightuserdata(L, closed);
-    lua_pushcclosure(L, req_getURL, 2);
-    lua_settable(L, -3);
-
-    lua_pushstring(L, "getMethod");
-    lua_pushlightuserdata(L, data->req);
-    lua_pushlightuserdata(L, closed);
-    lua_pushcclosure(L, req_getMethod, 2);
+    lua_pushcfunction(L, req_free);
     lua_settable(L, -3);
+    lua_setmetatable(L, refidx);
 
-    lua_pushstring(L, "getRequestHeaders");
-    lua_pushlightuserdata(L, data->req);
-    lua_pushlightuserdata(L, closed);
-    lua_pushcclosure(L, req_getRequestHeaders, 2);
-    lua_settable(L, -3);
+    lua_createtable(L, 0, 7);
+    static const luaL_Reg req_methods[] = {
+        {"read", req_read},
+        {"readLine", req_readLine},
+        {"readAll", req_readAll},
+        {"close", req_close},
+        {"getURL", req_getURL},
+        {"getMethod", req_getMethod},
+        {"getRequestHeaders", req_getRequestHeaders},
+        {NULL, NULL}
+    };
+    for (const luaL_Reg * r = req_methods; r->name; r++) {
+        lua_pushstring(L, r->name);
+        lua_pushvalue(L, refidx);
+        lua_pushcclosure(L, r->func, 1);
+        lua_settable(L, -3);
+    }
 
     lua_createtable(L, 0, 5);
+    static const luaL_Reg res_methods[] = {
+        {"write", res_write},
+        {"writeLine", res_writeLine},
+        {"close", res_close},
+        {"setStatusCode", res_setStatusCode},
+        {"setResponseHeader", res_setResponseHeader},
+        {NULL, NULL}
+    };
+    for (const luaL_Reg * r = res_methods; r->name; r++) {
+        lua_pushstring(L, r->name);
+        lua_pushvalue(L, refidx);
+        lua_pushcclosure(L, r->func, 1);
+        lua_settable(L, -3);
+    }
 
-    lua_pushstring(L, "write");
-    lua_pushlightuserdata(L, data->res);
-    lua_pushlightuserdata(L, closed);
-    lua_pushcclosure(L, res_write, 2);
-    lua_settable(L, -3);
-
-    lua_pushstring(L, "writeLine");
-    lua_pushlightuserdata(L, data->res);
-    lua_pushlightuserdata(L, closed);
-    lua_pushcclosure(L, res_writeLine, 2);
-    lua_settable(L, -3);
+    lua_remove(L, refidx);
+    return "http_request";
+}
 
-    lua_pushstring(L, "close");
-    lua_pushlightuserdata(L, data->res);
-    lua_pushlightuserdata(L, closed);
-    lua_pushcclosure(L, res_close, 2);
-    lua_settable(L, -3);
+// Requests that haven't been answered are sent with whatever was written after this long
+static constexpr std::chrono::seconds listenerResponseTimeout(15);
+static std::queue<std::shared_ptr<http_server_request>> pendingResponses; // ordered by deadline
+static std::mutex pendingResponsesLock;
+static std::condition_variable pendingResponsesNotify;
+static bool responseTimeoutThreadRunning = false;
 
-    lua_pushstring(L, "setStatusCode");
-    lua_pushlightuserdata(L, data->res);
-    lua_pushlightuserdata(L, closed);
-    lua_pushcclosure(L, res_setStatusCode, 2);
-    lua_settable(L, -3);
+static void responseTimeoutThread() {
+#ifdef __APPLE__
+    pthread_setname_np("HTTP Server Timeout Thread");
+#endif
+    std::unique_lock<std::mutex> lock(pendingResponsesLock);
+    while (true) {
+        pendingResponsesNotify.wait(lock, []()->bool{return !pendingResponses.empty();});
+        std::shared_ptr<http_server_request> req = pendingResponses.front();
+        // closed requests don't need to wait for their deadline
+        {
+            std::lock_guard<std::mutex> rlock(req->lock);
+            if (req->sent) {
+                pendingResponses.pop();
+                continue;
+            }
+        }
+        if (pendingResponsesNotify.wait_until(lock, req->deadline) == std::cv_status::no_timeout) continue;
+        pendingResponses.pop();
+        lock.unlock();
+        {
+            std::lock_guard<std::mutex> rlock(req->lock);
+            try {req->send();} catch (Poco::Exception &e) {}
+        }
+        lock.lock();
+    }
+}
 
-    lua_pushstring(L, "setResponseHeader");
-    lua_pushlightuserdata(L, data->res);
-    lua_pushlightuserdata(L, closed);
-    lua_pushcclosure(L, res_setResponseHeader, 2);
-    lua_settable(L, -3);
+static void scheduleResponseTimeout(const std::shared_ptr<http_server_request>& req) {
+    std::lock_guard<std::mutex> lock(pendingResponsesLock);
+    pendingResponses.push(req);
+    if (!responseTimeoutThreadRunning) {
+        responseTimeoutThreadRunning = true;
+        std::thread th(responseTimeoutThread);
+        setThreadName(th, "HTTP Server Timeout Thread");
+        th.detach();
+    } else if (pendingResponses.size() == 1) pendingResponsesNotify.notify_one();
+}
 
-    return "http_request";
+// All listeners share one pool of connection threads. A thread only reads the request and then
+// detaches the connection from the server, so slow handlers don't keep any threads busy.
+static Poco::ThreadPool& listenerThreadPool() {
+    static Poco::ThreadPool pool("HTTPListener", 2, 32);
+    return pool;
 }
 
 class HTTPListener: HTTPRequestHandler {
@@ -559,15 +794,20 @@ public:
     HTTPListener(int p, Computer *c): comp(c), port(p) {}
     void handleRequest(HTTPServerRequest& req, HTTPServerResponse& res) override {
         //fprintf(stderr, "Got request: %s\n", req.getURI().c_str());
-        http_res lres = {"", &res};
-        http_request_data evdata = {port, false, &req, &lres};
-        queueEvent(comp, http_request_event, &evdata);
-        const std::chrono::system_clock::time_point start = std::chrono::system_clock::now();
-        while (!(evdata.closed && res.sent()) && std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now() - start).count() < 15) std::this_thread::yield();
-        if (!res.sent()) {
-            res.setContentLength(lres.body.size());
-            res.send().write(lres.body.c_str(), lres.body.size());
-        }
+        std::shared_ptr<http_server_request> request = std::make_shared<http_server_request>();
+        request->port = port;
+        request->url = req.getURI();
+        request->method = req.getMethod();
+        for (const auto& h : req) request->headers.add(h.first, h.second);
+        std::istream& in = req.stream();
+        char buf[4096];
+        while (in.read(buf, sizeof(buf)) || in.gcount() > 0) request->body.append(buf, in.gcount());
+        res.setKeepAlive(false);
+        request->socket = static_cast<HTTPServerRequestImpl&>(req).session().detachSocket();
+        if (config.http_timeout > 0) request->socket.setSendTimeout(Poco::Timespan(config.http_timeout * 1000));
+        request->deadline = std::chrono::system_clock::now() + listenerResponseTimeout;
+        scheduleResponseTimeout(request);
+        queueEvent(comp, http_request_event, new std::shared_ptr<http_server_request>(request));
     }
     class Factory: HTTPRequestHandlerFactory {
     public:
@@ -581,9 +821,12 @@ public:
 };
 
 static std::unordered_map<unsigned short, HTTPServer*> listeners;
+static std::mutex listenersLock;
 
 /* export */ void http_server_stop() {
+    std::lock_guard<std::mutex> lock(listenersLock);
     for (std::pair<unsigned short, HTTPServer *> s : listeners) { s.second->stopAll(true); delete s.second; }
+    listeners.clear();
 }
 
 static int http_addListener(lua_State *L) {
@@ -591,26 +834,34 @@ static int http_addListener(lua_State *L) {
     const lua_Integer port_ = (int)luaL_checkinteger(L, 1);
     if (port_ < 0 || port_ > 65535) return 0;
     const unsigned short port = (unsigned short)port_;
-    if (listeners.find(port) != listeners.end()) {
-        delete listeners[port];
-        listeners.erase(port);
+    std::string err;
+    {
+        std::lock_guard<std::mutex> lock(listenersLock);
+        if (listeners.find(port) != listeners.end()) {
+            delete listeners[port];
+            listeners.erase(port);
+        }
+        HTTPServerParams * params = new HTTPServerParams;
+        params->setMaxThreads(listenerThreadPool().capacity());
+        params->setKeepAlive(false);
+        try {
+            HTTPServer * srv = new HTTPServer((HTTPRequestHandlerFactory*)new HTTPListener::Factory(get_comp(L), port), listenerThreadPool(), ServerSocket(port), params);
+            srv->start();
+            listeners[port] = srv;
+        } catch (NetException &e) {
+            err = e.message();
+        } catch (std::exception &e) {
+            err = e.what();
+        }
     }
-    HTTPServer * srv;
-    try {
-        srv = new HTTPServer((HTTPRequestHandlerFactory*)new HTTPListener::Factory(get_comp(L), port), port, new HTTPServerParams);
-    } catch (NetException &e) {
-        return luaL_error(L, "Could not open server: %s\n", e.message().c_str());
-    } catch (std::exception &e) {
-        return luaL_error(L, "Could not open server: %s\n", e.what());
-    }
-    srv->start();
-    listeners[port] = srv;
+    if (!err.empty()) return luaL_error(L, "Could not open server: %s\n", err.c_str());
     return 0;
 }
 
 static int http_removeListener(lua_State *L) {
     lastCFunction = __func__;
     const lua_Integer port = luaL_checkinteger(L, 1);
+    std::lock_guard<std::mutex> lock(listenersLock);
     if (port < 0 || port > 65535 || listeners.find((unsigned short)port) == listeners.end()) return 0;
     delete listeners[(unsigned short)port];
     listeners.erase((unsigned short)port);
@@ -622,24 +873,44 @@ static int http_removeListener(lua_State *L) {
 #pragma region WebSockets
 #endif
 
+struct ws_message {
+    std::string url;
+    Poco::Buffer<char> data; // frames are received straight into this
+    ws_message(const std::string& u): url(u), data(0) {}
+};
+
+// Messages received in batching mode that haven't been delivered to the computer yet.
+// Shared with the queued event, since the handle may be gone by the time it's delivered.
+struct ws_inbox {
+    std::string url;
+    std::vector<ws_message*> messages; // non-empty while an event is queued
+    std::mutex lock;
+    ~ws_inbox() {for (ws_message * m : messages) delete m;}
+};
+
 struct ws_handle {
     bool closed;
     std::string url;
     bool binary;
     int externalClosed;
     WebSocket * ws;
+    std::shared_ptr<ws_inbox> inbox; // NULL unless batching was requested
+    // Outgoing messages are sent by a separate thread so the computer never waits on the network
+    std::queue<std::string> sendQueue;
+    size_t sendQueueSize = 0;
+    std::mutex sendLock;
+    std::condition_variable sendNotify;
+    std::thread sender;
 };
 
+// Lua blocks in send() once this much data is waiting to be sent
+static constexpr size_t maxWebsocketSendQueue = 16777216;
+
 struct websocket_failure_data {
     std::string url;
     std::string reason;
 };
 
-struct ws_message {
-    std::string url;
-    std::string data;
-};
-
 static std::string websocket_failure(lua_State *L, void* userp) {
     websocket_failure_data * data = (websocket_failure_data*)userp;
     if (data->url.empty()) lua_pushnil(L);
@@ -657,22 +928,89 @@ static std::string websocket_closed(lua_State *L, void* userp) {
     return "websocket_closed";
 }
 
+static void websocket_mark_closed(ws_handle * ws) {
+    {
+        std::lock_guard<std::mutex> lock(ws->sendLock);
+        ws->closed = true;
+    }
+    ws->sendNotify.notify_all();
+}
+
+// Sends queued messages until the handle is closed, then sends whatever is left and exits
+static void websocket_sender(ws_handle * ws) {
+#ifdef __APPLE__
+    pthread_setname_np("WebSocket Send Thread");
+#endif
+    const int flags = (int)WebSocket::FRAME_FLAG_FIN | (int)(ws->binary ? WebSocket::FRAME_BINARY : WebSocket::FRAME_TEXT);
+    std::unique_lock<std::mutex> lock(ws->sendLock);
+    while (true) {
+        ws->sendNotify.wait(lock, [ws]()->bool{return ws->closed || !ws->sendQueue.empty();});
+        if (ws->sendQueue.empty()) break;
+        const std::string message = std::move(ws->sendQueue.front());
+        ws->sendQueue.pop();
+        lock.unlock();
+        bool ok;
+        try {ok = ws->ws->sendFrame(message.c_str(), (int)message.size(), flags) >= 1;}
+        catch (Poco::Exception &e) {ok = false;}
+        lock.lock();
+        ws->sendQueueSize -= message.size();
+        if (!ok) {
+            ws->closed = true;
+            while (!ws->sendQueue.empty()) ws->sendQueue.pop();
+            ws->sendQueueSize = 0;
+        }
+        ws->sendNotify.notify_all();
+    }
+}
+
+static void websocket_start_sender(ws_handle * ws) {
+    ws->sender = std::thread(websocket_sender, ws);
+    setThreadName(ws->sender, "WebSocket Send Thread");
+}
+
+// Closes the handle and waits for the queued messages to be sent
+static void websocket_stop_sender(ws_handle * ws) {
+    websocket_mark_closed(ws);
+    if (ws->sender.joinable()) ws->sender.join();
+}
+
+// Receives one frame into message. A message over http_max_websocket_message closes the
+// connection with status 1009 and throws, so it's handled like any other failed read.
+static int websocket_receive_frame(ws_handle * wsh, ws_message * message, int& flags) {
+    try {
+        const int n = wsh->ws->receiveFrame(message->data, flags);
+        if (config.http_max_websocket_message > 0 && message->data.size() > (size_t)config.http_max_websocket_message)
+            throw WebSocketException("Message is too large", WebSocket::WS_ERR_PAYLOAD_TOO_BIG);
+        return n;
+    } catch (WebSocketException &e) {
+        if (e.code() == WebSocket::WS_ERR_PAYLOAD_TOO_BIG) {
+            websocket_stop_sender(wsh);
+            try {wsh->ws->shutdown(WebSocket::WS_PAYLOAD_TOO_BIG, "Message is too large");} catch (...) {}
+        }
+        throw;
+    }
+}
+
 // WebSocket handle functions
 static int websocket_send(lua_State *L) {
     lastCFunction = __func__;
-    luaL_checkstring(L, 1);
-    if (config.http_max_websocket_message > 0 && lua_strlen(L, 1) > (unsigned)config.http_max_websocket_message) luaL_error(L, "Message is too large");
+    size_t len = 0;
+    const char * str = luaL_checklstring(L, 1, &len);
+    if (config.http_max_websocket_message > 0 && len > (unsigned)config.http_max_websocket_message) luaL_error(L, "Message is too large");
     ws_handle * ws = (ws_handle*)lua_touserdata(L, lua_upvalueindex(1));
+    std::unique_lock<std::mutex> lock(ws->sendLock);
+    ws->sendNotify.wait(lock, [ws, len]()->bool{return ws->closed || ws->sendQueue.empty() || ws->sendQueueSize + len <= maxWebsocketSendQueue;});
     if (ws->closed) return 0;
-    if (ws->ws->sendFrame(lua_tostring(L, 1), lua_strlen(L, 1), (int)WebSocket::FRAME_FLAG_FIN | (int)(ws->binary ? WebSocket::FRAME_BINARY : WebSocket::FRAME_TEXT)) < 1) 
-        ws->closed = true;
+    ws->sendQueue.push(std::string(str, len));
+    ws->sendQueueSize += len;
+    lock.unlock();
+    ws->sendNotify.notify_all();
     return 0;
 }
 
 static int websocket_close(lua_State *L) {
     lastCFunction = __func__;
-    ws_handle * ws = (ws_handle*)lua_touserdata(L, lua_upvalueindex(1));
-    ws->closed = true;
+    websocket_mark_closed((ws_handle*)lua_touserdata(L, lua_upvalueindex(1)));
     return 0;
 }
 
@@ -684,7 +1022,7 @@ static int websocket_isOpen(lua_State *L) {
 
 static int websocket_free(lua_State *L) {
     lastCFunction = __func__;
-   ((ws_handle*)lua_touserdata(L, lua_upvalueindex(1)))->closed = true;
+    websocket_mark_closed((ws_handle*)lua_touserdata(L, lua_upvalueindex(1)));
     return 0;
 }
 
@@ -744,18 +1082,55 @@ static std::string websocket_message(lua_State *L, void* userp) {
     ws_message * message = (ws_message*)userp;
     if (message->url.empty()) lua_pushnil(L);
     else lua_pushstring(L, message->url.c_str());
-    lua_pushlstring(L, message->data.c_str(), message->data.size());
+    lua_pushlstring(L, message->data.begin(), message->data.size());
     delete message;
     return "websocket_message";
 }
 
+// Delivers every message that arrived since the last event as one table
+static std::string websocket_message_batch(lua_State *L, void* userp) {
+    std::shared_ptr<ws_inbox> * inbox = (std::shared_ptr<ws_inbox>*)userp;
+    std::vector<ws_message*> messages;
+    {
+        std::lock_guard<std::mutex> lock((*inbox)->lock);
+        messages.swap((*inbox)->messages);
+    }
+    if ((*inbox)->url.empty()) lua_pushnil(L);
+    else lua_pushstring(L, (*inbox)->url.c_str());
+    delete inbox;
+    lua_createtable(L, messages.size(), 0);
+    for (size_t i = 0; i < messages.size(); i++) {
+        lua_pushlstring(L, messages[i]->data.begin(), messages[i]->data.size());
+        lua_rawseti(L, -2, i + 1);
+        delete messages[i];
+    }
+    return "websocket_message";
+}
+
+// Hands a received message to the computer. In batching mode, messages that arrive before the
+// computer picks up the previous event are added to that event instead of queueing a new one.
+static void websocket_deliver(Computer * comp, ws_handle * wsh, ws_message * message) {
+    if (wsh->inbox == NULL) {
+        queueEvent(comp, websocket_message, message);
+        return;
+    }
+    bool queue;
+    {
+        std::lock_guard<std::mutex> lock(wsh->inbox->lock);
+        queue = wsh->inbox->messages.empty();
+        wsh->inbox->messages.push_back(message);
+    }
+    if (queue) queueEvent(comp, websocket_message_batch, new std::shared_ptr<ws_inbox>(wsh->inbox));
+}
+
 class websocket_server: public HTTPRequestHandler {
 public:
     Computer * comp;
     HTTPServer *srv;
     bool binary;
+    bool batch;
     std::unordered_map<std::string, std::string> headers;
-    websocket_server(Computer * c, bool b, HTTPServer *s, const std::unordered_map<std::string, std::string>& h): comp(c), srv(s), binary(b), headers(h) {}
+    websocket_server(Computer * c, bool b, bool bt, HTTPServer *s, const std::unordered_map<std::string, std::string>& h): comp(c), srv(s), binary(b), batch(bt), headers(h) {}
     void handleRequest(HTTPServerRequest &request, HTTPServerResponse &response) override {
         WebSocket * ws = NULL;
         try {
@@ -777,31 +1152,35 @@ public:
         wsh->ws = ws;
         wsh->url = "";
         wsh->binary = binary;
+        if (batch) {
+            wsh->inbox = std::make_shared<ws_inbox>();
+            wsh->inbox->url = "";
+        }
+        websocket_start_sender(wsh);
         queueEvent(comp, websocket_success, wsh);
         while (!wsh->closed) {
-            Poco::Buffer<char> buf(config.http_max_websocket_message);
+            ws_message * message = new ws_message("");
             int flags = 0;
             try {
-                if (ws->receiveFrame(buf, flags) == 0) {
-                    wsh->closed = true;
+                if (websocket_receive_frame(wsh, message, flags) == 0) {
+                    delete message;
+                    websocket_mark_closed(wsh);
                     queueEvent(comp, websocket_closed, NULL);
                     break;
                 }
             } catch (...) {
-                wsh->closed = true;
+                delete message;
+                websocket_mark_closed(wsh);
                 queueEvent(comp, websocket_closed, NULL);
                 break;
             }
             if (flags & WebSocket::FRAME_OP_CLOSE) {
-                wsh->closed = true;
+                delete message;
+                websocket_mark_closed(wsh);
                 queueEvent(comp, websocket_closed, NULL);
-            } else {
-                ws_message * message = new ws_message;
-                message->url = "";
-                message->data = std::string(buf.begin(), buf.end());
-                queueEvent(comp, websocket_message, message);
-            }
+            } else websocket_deliver(comp, wsh, message);
         }
+        websocket_stop_sender(wsh);
         try {ws->shutdown();} catch (...) {}
         if (srv != NULL) { try {srv->stop();} catch (...) {} delete srv; }
     }
@@ -810,18 +1189,19 @@ public:
         Computer *comp;
         HTTPServer *srv = NULL;
         bool binary;
+        bool batch;
         std::unordered_map<std::string, std::string> headers;
-        Factory(Computer *c, bool b, const std::unordered_map<std::string, std::string>& h): comp(c), binary(b), headers(h) {}
+        Factory(Computer *c, bool b, bool bt, const std::unordered_map<std::string, std::string>& h): comp(c), binary(b), batch(bt), headers(h) {}
         HTTPRequestHandler* createRequestHandler(const HTTPServerRequest&) override {
-            return new websocket_server(comp, binary, srv, headers);
+            return new websocket_server(comp, binary, batch, srv, headers);
         }
     };
 };
 
 /* export */ void stopWebsocket(void* wsh) {
     ws_handle * handle = (ws_handle*)wsh;
-    handle->closed = true; 
     handle->externalClosed = 1;
+    websocket_mark_closed(handle);
     handle->ws->shutdown();
     for (int i = 0; handle->externalClosed != 2; i++) {
         if (i % 4 == 0) fprintf(stderr, "Waiting for WebSocket...\n");
@@ -830,7 +1210,7 @@ public:
     handle->externalClosed = 3;
 }
 
-static void websocket_client_thread(Computer *comp, const std::string& str, bool binary, const std::unordered_map<std::string, std::string>& headers) {
+static void websocket_client_thread(Computer *comp, const std::string& str, bool binary, bool batch, const std::unordered_map<std::string, std::string>& headers) {
 #ifdef __APPLE__
     pthread_setname_np("WebSocket Client Thread");
 #endif
@@ -871,16 +1251,20 @@ static void websocket_client_thread(Computer *comp, const std::string& str, bool
     wsh->url = str;
     wsh->ws = ws;
     wsh->binary = binary;
+    if (batch) {
+        wsh->inbox = std::make_shared<ws_inbox>();
+        wsh->inbox->url = str;
+    }
+    websocket_start_sender(wsh);
     comp->openWebsockets.push_back(wsh);
     queueEvent(comp, websocket_success, wsh);
-    char * buf = new char[config.http_max_websocket_message];
     while (!wsh->closed) {
+        ws_message * message = new ws_message(str);
         int flags = 0;
-        int res;
         try {
-            res = ws->receiveFrame(buf, config.http_max_websocket_message, flags);
-            if (res == 0) {
-                wsh->closed = true;
+            if (websocket_receive_frame(wsh, message, flags) == 0) {
+                delete message;
+                websocket_mark_closed(wsh);
                 wsh->url = "";
                 char * sptr = new char[str.length()+1];
                 memcpy(sptr, str.c_str(), str.length());
@@ -889,6 +1273,7 @@ static void websocket_client_thread(Computer *comp, const std::string& str, bool
                 break;
             }
         } catch (Poco::TimeoutException &e) {
+            delete message;
             if (wsh->closed) {
                 char * sptr = new char[str.length()+1];
                 memcpy(sptr, str.c_str(), str.length());
@@ -898,7 +1283,8 @@ static void websocket_client_thread(Computer *comp, const std::string& str, bool
             }
             continue;
         } catch (NetException &e) {
-            wsh->closed = true;
+            delete message;
+            websocket_mark_closed(wsh);
             wsh->url = "";
             char * sptr = new char[str.length()+1];
             memcpy(sptr, str.c_str(), str.length());
@@ -907,22 +1293,17 @@ static void websocket_client_thread(Computer *comp, const std::string& str, bool
             break;
         }
         if (flags & WebSocket::FRAME_OP_CLOSE) {
-            wsh->closed = true;
+            delete message;
+            websocket_mark_closed(wsh);
             wsh->url = "";
             char * sptr = new char[str.length()+1];
             memcpy(sptr, str.c_str(), str.length());
             sptr[str.length()] = 0;
             queueEvent(comp, websocket_closed, sptr);
             break;
-        } else {
-            ws_message * message = new ws_message;
-            message->url = str;
-            message->data = std::string((const char*)buf, res);
-            queueEvent(comp, websocket_message, message);
-        }
-        std::this_thread::yield();
+        } else websocket_deliver(comp, wsh, message);
     }
-    delete[] buf;
+    websocket_stop_sender(wsh);
     wsh->url = "";
     try {if (!wsh->externalClosed) ws->shutdown();} catch (...) {}
     for (auto it = comp->openWebsockets.begin(); it != comp->openWebsockets.end(); ++it) {
@@ -940,6 +1321,7 @@ static int http_websocket(lua_State *L) {
     lastCFunction = __func__;
     if (!config.http_websocket_enabled) luaL_error(L, "Websocket connections are disabled");
     if (!lua_isnoneornil(L, 3) && !lua_isboolean(L, 3)) luaL_error(L, "bad argument #3 (expected boolean or nil, got %s)", lua_typename(L, lua_type(L, 3)));
+    if (!lua_isnoneornil(L, 4) && !lua_isboolean(L, 4)) luaL_error(L, "bad argument #4 (expected boolean or nil, got %s)", lua_typename(L, lua_type(L, 4)));
     if (lua_isstring(L, 1)) {
         Computer * comp = get_comp(L);
         if (config.http_max_websockets > 0 && comp->openWebsockets.size() >= (unsigned)config.http_max_websockets) luaL_error(L, "Too many websockets already open");
@@ -955,7 +1337,7 @@ static int http_websocket(lua_State *L) {
             }
             lua_pop(L, 1);
         }
-        std::thread th(websocket_client_thread, comp, url, lua_isboolean(L, 3) && lua_toboolean(L, 3), headers);
+        std::thread th(websocket_client_thread, comp, url, lua_isboolean(L, 3) && lua_toboolean(L, 3), lua_toboolean(L, 4), headers);
         setThreadName(th, "WebSocket Client Thread");
         th.detach();
     } else if (!config.serverMode && lua_isnoneornil(L, 1)) {
@@ -970,7 +1352,7 @@ static int http_websocket(lua_State *L) {
             }
             lua_pop(L, 1);
         } else if (!lua_isnoneornil(L, 2)) luaL_error(L, "bad argument #2 (expected table or nil, got %s)", lua_typename(L, lua_type(L, 2)));
-        websocket_server::Factory * f = new websocket_server::Factory(get_comp(L), lua_isboolean(L, 3) && lua_toboolean(L, 3), headers);
+        websocket_server::Factory * f = new websocket_server::Factory(get_comp(L), lua_isboolean(L, 3) && lua_toboolean(L, 3), lua_toboolean(L, 4), headers);
         try {f->srv = new HTTPServer(f, 80);}
         catch (Poco::Exception& e) {
             fprintf(stderr, "Could not open server: %s\n", e.displayText().c_str());
@@ -997,6 +1379,6 @@ static luaL_Reg http_reg[] = {
     {NULL, NULL}
 };
 
-library_t http_lib = {"http", http_reg, nullptr, nullptr};
+library_t http_lib = {"http", http_reg, nullptr, http_deinit};
 
 #endif // __EMSCRIPTEN__
\ No newline at end of file
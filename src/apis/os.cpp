@@ -10,6 +10,7 @@
 
 #include <Computer.hpp>
 #include "../main.hpp"
+#include "../metrics.hpp"
 #include "../runtime.hpp"
 #include "../util.hpp"
 
@@ -126,6 +127,7 @@ static Uint32 notifyEvent(Uint32 interval, void* param) {
 static int os_startTimer(lua_State *L) {
     lastCFunction = __func__;
     Computer * computer = get_comp(L);
+    countMetric(computer, &ComputerMetrics::timers);
     if (luaL_checknumber(L, 1) < 0.001 && !config.standardsMode) {
         queueEvent(computer, [](lua_State *L, void*)->std::string {lua_pushinteger(L, 1); return "timer"; }, NULL);
         lua_pushinteger(L, 1);
@@ -263,6 +265,7 @@ static int os_setAlarm(lua_State *L) {
     const double time = luaL_checknumber(L, 1);
     if (time < 0.0 || time >= 24.0) luaL_error(L, "Number out of range");
     Computer * computer = get_comp(L);
+    countMetric(computer, &ComputerMetrics::timers);
     const double current_time = floor((double)((std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - computer->system_start).count() + 300000LL) % 1200000LL) / 50.0) / 1000.0;
     double delta_time;
     if (time >= current_time) delta_time = time - current_time;
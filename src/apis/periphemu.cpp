@@ -11,6 +11,7 @@
 #include <algorithm>
 #include <Computer.hpp>
 #include <Terminal.hpp>
+#include "../peripheral/channel.hpp"
 #include "../peripheral/computer.hpp"
 #include "../peripheral/debugger.hpp"
 #include "../peripheral/drive.hpp"
@@ -27,6 +28,7 @@ static std::unordered_map<std::string, peripheral_init> initializers = {
     {"computer", &computer::init},
     {"modem", &modem::init},
     {"drive", &drive::init},
+    {"channel", &channel::init},
 #ifndef NO_MIXER
     {"speaker", &speaker::init}
 #endif
@@ -111,6 +113,7 @@ static int periphemu_remove(lua_State* L) {
         p = computer->peripherals[side];
         computer->peripherals.erase(side);
     }
+    removePeripheralUpdates(computer, p);
     queueTask([ ](void* p)->void*{((peripheral*)p)->getDestructor()((peripheral*)p); return NULL;}, p);
     lua_pushboolean(L, true);
     std::string * sidearg = new std::string(side);
@@ -8,8 +8,14 @@
  * Copyright (c) 2019-2021 JackMacWindows.
  */
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <thread>
 #include <Computer.hpp>
 #include <peripheral.hpp>
+#include "../platform.hpp"
 #include "../util.hpp"
 
 static int peripheral_isPresent(lua_State *L) {
@@ -48,6 +54,9 @@ static int peripheral_getMethods(lua_State *L) {
     return 1;
 }
 
+// Methods may yield with lua_vyield. This function is called again when the
+// computer resumes, so a method that yields puts the side and method name back
+// at the bottom of the stack first, and finds its context with lua_vcontext.
 static int peripheral_call(lua_State *L) {
     lastCFunction = __func__;
     Computer * computer = get_comp(L);
@@ -64,9 +73,148 @@ static int peripheral_call(lua_State *L) {
     return p->call(L, func.c_str());
 }
 
-void peripheral_update(Computer *comp) {
-    std::lock_guard<std::mutex> lock(comp->peripherals_mutex);
-    for (auto p : comp->peripherals) p.second->update();
+// Peripherals only get update() calls if they ask for them with
+// setPeripheralUpdateRate. A scheduler thread keeps track of when each one is
+// due, and hands the due peripherals of each computer to a small worker pool as
+// one job, so a computer's peripherals are always updated together on one
+// thread and never concurrently with each other.
+struct peripheral_update_entry {
+    std::chrono::steady_clock::duration interval;
+    std::chrono::steady_clock::time_point next;
+};
+
+struct peripheral_update_schedule {
+    std::unordered_map<peripheral*, peripheral_update_entry> peripherals;
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::time_point::max();
+    bool busy = false; // a job for this computer is queued or running
+};
+
+static std::unordered_map<Computer*, peripheral_update_schedule> updateSchedules;
+static std::deque<Computer*> updateJobs;
+static std::mutex updateLock;
+static std::condition_variable updateNotify; // wakes the scheduler
+static std::condition_variable updateJobNotify; // wakes workers, and anyone waiting for a job to finish
+static std::thread * updateScheduler = NULL;
+static std::vector<std::thread*> updateWorkers;
+static bool updateExiting = false;
+
+static void peripheral_update_run(Computer * comp) {
+    const auto now = std::chrono::steady_clock::now();
+    std::vector<peripheral*> due;
+    {
+        std::lock_guard<std::mutex> lock(updateLock);
+        for (const auto& p : updateSchedules[comp].peripherals) if (p.second.next <= now) due.push_back(p.first);
+    }
+    {
+        // peripherals may have been detached since the job was queued
+        std::lock_guard<std::mutex> lock(comp->peripherals_mutex);
+        for (const auto& p : comp->peripherals)
+            if (std::find(due.begin(), due.end(), p.second) != due.end()) p.second->update();
+    }
+    std::lock_guard<std::mutex> lock(updateLock);
+    peripheral_update_schedule& sched = updateSchedules[comp];
+    sched.next = std::chrono::steady_clock::time_point::max();
+    for (auto& p : sched.peripherals) {
+        if (p.second.next <= now) {
+            p.second.next += p.second.interval;
+            // don't try to catch up if updates are falling behind
+            if (p.second.next < now) p.second.next = now + p.second.interval;
+        }
+        if (p.second.next < sched.next) sched.next = p.second.next;
+    }
+    sched.busy = false;
+    updateNotify.notify_all();
+    updateJobNotify.notify_all();
+}
+
+static void peripheral_update_worker() {
+    std::unique_lock<std::mutex> lock(updateLock);
+    while (true) {
+        updateJobNotify.wait(lock, []()->bool {return updateExiting || !updateJobs.empty();});
+        if (updateExiting) return;
+        Computer * comp = updateJobs.front();
+        updateJobs.pop_front();
+        lock.unlock();
+        peripheral_update_run(comp);
+        lock.lock();
+    }
+}
+
+static void peripheral_update_scheduler() {
+    std::unique_lock<std::mutex> lock(updateLock);
+    while (!updateExiting) {
+        auto next = std::chrono::steady_clock::time_point::max();
+        for (const auto& s : updateSchedules) if (!s.second.busy && s.second.next < next) next = s.second.next;
+        if (next == std::chrono::steady_clock::time_point::max()) updateNotify.wait(lock);
+        else updateNotify.wait_until(lock, next);
+        if (updateExiting) break;
+        const auto now = std::chrono::steady_clock::now();
+        bool queued = false;
+        for (auto& s : updateSchedules) {
+            if (!s.second.busy && s.second.next <= now) {
+                s.second.busy = true;
+                updateJobs.push_back(s.first);
+                queued = true;
+            }
+        }
+        if (queued) updateJobNotify.notify_all();
+    }
+}
+
+void setPeripheralUpdateRate(Computer * comp, peripheral * p, unsigned rate) {
+    if (rate == 0) {
+        removePeripheralUpdates(comp, p);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(updateLock);
+    if (updateScheduler == NULL) {
+        const unsigned nworkers = min(max(std::thread::hardware_concurrency(), 1U), 4U);
+        for (unsigned i = 0; i < nworkers; i++) {
+            updateWorkers.push_back(new std::thread(peripheral_update_worker));
+            setThreadName(*updateWorkers.back(), "Peripheral Update Worker");
+        }
+        updateScheduler = new std::thread(peripheral_update_scheduler);
+        setThreadName(*updateScheduler, "Peripheral Update Scheduler");
+    }
+    peripheral_update_schedule& sched = updateSchedules[comp];
+    peripheral_update_entry& entry = sched.peripherals[p];
+    entry.interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(1000000000 / min(rate, 1000U)));
+    entry.next = std::chrono::steady_clock::now() + entry.interval;
+    if (entry.next < sched.next) sched.next = entry.next;
+    updateNotify.notify_all();
+}
+
+void removePeripheralUpdates(Computer * comp, peripheral * p) {
+    std::unique_lock<std::mutex> lock(updateLock);
+    auto it = updateSchedules.find(comp);
+    if (it == updateSchedules.end()) return;
+    if (p != NULL) {
+        it->second.peripherals.erase(p);
+        if (!it->second.peripherals.empty() || it->second.busy) return;
+    } else {
+        // the computer is going away, so wait for any running job to finish with it
+        updateJobNotify.wait(lock, [comp]()->bool {auto s = updateSchedules.find(comp); return s == updateSchedules.end() || !s->second.busy;});
+        it = updateSchedules.find(comp);
+        if (it == updateSchedules.end()) return;
+    }
+    updateSchedules.erase(it);
+}
+
+void peripheralUpdateQuit() {
+    {
+        std::lock_guard<std::mutex> lock(updateLock);
+        if (updateScheduler == NULL) return;
+        updateExiting = true;
+    }
+    updateNotify.notify_all();
+    updateJobNotify.notify_all();
+    updateScheduler->join();
+    delete updateScheduler;
+    for (std::thread * t : updateWorkers) {t->join(); delete t;}
+    updateWorkers.clear();
+    updateScheduler = NULL;
+    updateJobs.clear();
+    updateSchedules.clear();
 }
 
 static luaL_Reg peripheral_reg[] = {
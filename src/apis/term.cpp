@@ -10,20 +10,31 @@
 
 #include <Computer.hpp>
 #include <configuration.hpp>
+#include "../terminal/OffscreenTerminal.hpp"
 #include "../terminal/SDLTerminal.hpp"
+#include "../terminal/TRoRTerminal.hpp"
+#include "../headless.hpp"
 #include "../runtime.hpp"
 #include "../util.hpp"
 
-static int headlessCursorX = 1, headlessCursorY = 1;
-static bool can_blink_headless = true;
+// In headless mode, the computer's terminal is an OffscreenTerminal, which is
+// updated like any other so it can be captured, and the text is also sent to
+// the HeadlessOutput to be written to stdout.
+static HeadlessOutput * headless(lua_State *L) {
+    return (HeadlessOutput*)get_comp(L)->headlessOutput;
+}
 
 static int term_write(lua_State *L) {
     lastCFunction = __func__;
     if (selectedRenderer == 1) {
-        printf("%s", luaL_checkstring(L, 1));
-        headlessCursorX += lua_strlen(L, 1);
-        return 0;
-    } else if (selectedRenderer == 4) printf("TW:%d;%s\n", get_comp(L)->term->id, luaL_checkstring(L, 1));
+        size_t len = 0;
+        const char * text = luaL_checklstring(L, 1, &len);
+        headless(L)->write(text, len);
+    } else if (selectedRenderer == 4) {
+        size_t len = 0;
+        const char * text = luaL_checklstring(L, 1, &len);
+        ((TRoRTerminal*)get_comp(L)->term)->queueWrite(text, len);
+    }
     Computer * computer = get_comp(L);
     Terminal * term = computer->term;
     if (term->blinkY < 0 || (term->blinkX >= 0 && (unsigned)term->blinkX >= term->width) || (unsigned)term->blinkY >= term->height) return 0;
@@ -33,22 +44,17 @@ static int term_write(lua_State *L) {
     printf("%s\n", str);
 #endif
     std::lock_guard<std::mutex> locked_g(term->locked);
-    for (size_t i = 0; i < str_sz && (term->blinkX < 0 || (unsigned)term->blinkX < term->width); i++, term->blinkX++) {
-        if (term->blinkX >= 0) {
-            term->screen[term->blinkY][term->blinkX] = str[i];
-            term->colors[term->blinkY][term->blinkX] = computer->colors;
-        }
-    }
+    term->screen.write_run(term->blinkX, term->blinkY, (const unsigned char*)str, str_sz);
+    term->colors.fill_run(term->blinkX, term->blinkY, computer->colors, str_sz);
+    term->blinkX = (int)min<long long>((long long)term->blinkX + str_sz, term->width);
     term->changed = true;
     return 0;
 }
 
 static int term_scroll(lua_State *L) {
     lastCFunction = __func__;
-    if (selectedRenderer == 1) {
-        for (int i = 0; i < luaL_checkinteger(L, 1); i++) printf("\n");
-        return 0;
-    } else if (selectedRenderer == 4) printf("TS:%d;%d\n", get_comp(L)->term->id, (int)luaL_checkinteger(L, 1));
+    if (selectedRenderer == 1) headless(L)->scrollLines((int)luaL_checkinteger(L, 1));
+    else if (selectedRenderer == 4) ((TRoRTerminal*)get_comp(L)->term)->queuePacket("TS", "%d", (int)luaL_checkinteger(L, 1));
     Computer * computer = get_comp(L);
     Terminal * term = computer->term;
     const lua_Integer lines = luaL_checkinteger(L, 1);
@@ -74,15 +80,8 @@ static int term_scroll(lua_State *L) {
 
 static int term_setCursorPos(lua_State *L) {
     lastCFunction = __func__;
-    if (selectedRenderer == 1) {
-        if (luaL_checkinteger(L, 1) < headlessCursorX) printf("\r");
-        else if (lua_tointeger(L, 1) > headlessCursorX) for (int i = headlessCursorX; i < lua_tointeger(L, 1); i++) printf(" ");
-        if (luaL_checkinteger(L, 2) != headlessCursorY) printf("\n");
-        headlessCursorX = (int)lua_tointeger(L, 1);
-        headlessCursorY = (int)lua_tointeger(L, 2);
-        fflush(stdout);
-        return 0;
-    } else if (selectedRenderer == 4) printf("TC:%d;%d,%d\n", get_comp(L)->term->id, (int)luaL_checkinteger(L, 1), (int)luaL_checkinteger(L, 2));
+    if (selectedRenderer == 1) headless(L)->setCursorPos((int)luaL_checkinteger(L, 1), (int)luaL_checkinteger(L, 2));
+    else if (selectedRenderer == 4) ((TRoRTerminal*)get_comp(L)->term)->queuePacket("TC", "%d,%d", (int)luaL_checkinteger(L, 1), (int)luaL_checkinteger(L, 2));
     luaL_checkinteger(L, 1);
     luaL_checkinteger(L, 2);
     Computer * computer = get_comp(L);
@@ -97,21 +96,15 @@ static int term_setCursorPos(lua_State *L) {
 static int term_setCursorBlink(lua_State *L) {
     lastCFunction = __func__;
     if (!lua_isboolean(L, 1)) luaL_typerror(L, 1, "boolean");
-    if (selectedRenderer != 1) {
-        get_comp(L)->term->canBlink = lua_toboolean(L, 1);
-        get_comp(L)->term->changed = true;
-    } else can_blink_headless = lua_toboolean(L, 1);
-    if (selectedRenderer == 4) printf("TB:%d;%s\n", get_comp(L)->term->id, lua_toboolean(L, 1) ? "true" : "false");
+    get_comp(L)->term->canBlink = lua_toboolean(L, 1);
+    get_comp(L)->term->changed = true;
+    if (selectedRenderer == 1) headless(L)->canBlink = lua_toboolean(L, 1);
+    if (selectedRenderer == 4) ((TRoRTerminal*)get_comp(L)->term)->queuePacket("TB", "%s", lua_toboolean(L, 1) ? "true" : "false");
     return 0;
 }
 
 static int term_getCursorPos(lua_State *L) {
     lastCFunction = __func__;
-    if (selectedRenderer == 1) {
-        lua_pushinteger(L, headlessCursorX);
-        lua_pushinteger(L, headlessCursorY);
-        return 2;
-    }
     Computer * computer = get_comp(L);
     Terminal * term = computer->term;
     lua_pushinteger(L, (lua_Integer)term->blinkX + 1);
@@ -121,18 +114,12 @@ static int term_getCursorPos(lua_State *L) {
 
 static int term_getCursorBlink(lua_State *L) {
     lastCFunction = __func__;
-    if (selectedRenderer == 1) lua_pushboolean(L, can_blink_headless);
-    else lua_pushboolean(L, get_comp(L)->term->canBlink);
+    lua_pushboolean(L, get_comp(L)->term->canBlink);
     return 1;
 }
 
 static int term_getSize(lua_State *L) {
     lastCFunction = __func__;
-    if (selectedRenderer == 1) {
-        lua_pushinteger(L, 51);
-        lua_pushinteger(L, 19);
-        return 2;
-    }
     Computer * computer = get_comp(L);
     Terminal * term = computer->term;
     if ((lua_isboolean(L, 1) && lua_toboolean(L, 1)) || (lua_isnumber(L, 1) && lua_tonumber(L, 1) > 0)) {
@@ -147,10 +134,8 @@ static int term_getSize(lua_State *L) {
 
 static int term_clear(lua_State *L) {
     lastCFunction = __func__;
-    if (selectedRenderer == 1) {
-        for (int i = 0; i < 30; i++) printf("\n");
-        return 0;
-    } else if (selectedRenderer == 4) printf("TE:%d;\n", get_comp(L)->term->id);
+    if (selectedRenderer == 1) headless(L)->clearScreen();
+    else if (selectedRenderer == 4) ((TRoRTerminal*)get_comp(L)->term)->queuePacket("TE", "");
     Computer * computer = get_comp(L);
     Terminal * term = computer->term;
     std::lock_guard<std::mutex> locked_g(term->locked);
@@ -166,12 +151,8 @@ static int term_clear(lua_State *L) {
 
 static int term_clearLine(lua_State *L) {
     lastCFunction = __func__;
-    if (selectedRenderer == 1) {
-        printf("\r");
-        for (int i = 0; i < 100; i++) printf(" ");
-        printf("\r");
-        return 0;
-    } else if (selectedRenderer == 4) printf("TL:%d;\n", get_comp(L)->term->id);
+    if (selectedRenderer == 1) headless(L)->clearLine();
+    else if (selectedRenderer == 4) ((TRoRTerminal*)get_comp(L)->term)->queuePacket("TL", "");
     Computer * computer = get_comp(L);
     Terminal * term = computer->term;
     if (term->blinkY < 0 || (unsigned)term->blinkY >= term->height) return 0;
@@ -185,7 +166,7 @@ static int term_clearLine(lua_State *L) {
 static int term_setTextColor(lua_State *L) {
     lastCFunction = __func__;
     if (selectedRenderer == 4 && luaL_checkinteger(L, 1) >= 0 && luaL_checkinteger(L, 1) < 16)
-        printf("TF:%d;%c\n", get_comp(L)->term->id, ("0123456789abcdef")[lua_tointeger(L, 1)]);
+        ((TRoRTerminal*)get_comp(L)->term)->queueTextColor((int)lua_tointeger(L, 1));
     Computer * computer = get_comp(L);
     const unsigned int c = log2i((int)luaL_checkinteger(L, 1));
     if (c > 15) return luaL_error(L, "bad argument #1 (invalid color %d)", c);
@@ -199,7 +180,7 @@ static int term_setTextColor(lua_State *L) {
 static int term_setBackgroundColor(lua_State *L) {
     lastCFunction = __func__;
     if (selectedRenderer == 4 && luaL_checkinteger(L, 1) >= 0 && luaL_checkinteger(L, 1) < 16)
-        printf("TK:%d;%c\n", get_comp(L)->term->id, ("0123456789abcdef")[lua_tointeger(L, 1)]);
+        ((TRoRTerminal*)get_comp(L)->term)->queueBackgroundColor((int)lua_tointeger(L, 1));
     Computer * computer = get_comp(L);
     const unsigned int c = log2i((int)luaL_checkinteger(L, 1));
     if (c > 15) return luaL_error(L, "bad argument #1 (invalid color %d)", c);
@@ -233,9 +214,9 @@ static int term_getBackgroundColor(lua_State *L) {
 static int term_blit(lua_State *L) {
     lastCFunction = __func__;
     if (selectedRenderer == 1) {
-        printf("%s", lua_tostring(L, 1));
-        headlessCursorX += lua_strlen(L, 1);
-        return 0;
+        size_t len = 0;
+        const char * text = luaL_checklstring(L, 1, &len);
+        headless(L)->write(text, len);
     }
     Computer * computer = get_comp(L);
     Terminal * term = computer->term;
@@ -247,38 +228,35 @@ static int term_blit(lua_State *L) {
     const char * bg = luaL_checklstring(L, 3, &bg_sz);
     if (str_sz != fg_sz || fg_sz != bg_sz) luaL_error(L, "Arguments must be the same length");
     std::lock_guard<std::mutex> locked_g(term->locked);
-    for (unsigned i = 0; i < str_sz && (term->blinkX < 0 || (unsigned)term->blinkX < term->width); i++, term->blinkX++) {
-        if (term->blinkX >= 0) {
-            if ((computer->config->isColor || computer->isDebugger) || ((unsigned)(htoi(bg[i]) & 7) - 1) >= 6)
-                computer->colors = (unsigned char)(htoi(bg[i]) << 4) | (computer->colors & 0xF);
-            if ((computer->config->isColor || computer->isDebugger) || ((unsigned)(htoi(fg[i]) & 7) - 1) >= 6) {
-                computer->colors = (computer->colors & 0xF0) | htoi(fg[i]);
-                if (dynamic_cast<SDLTerminal*>(computer->term) != NULL) dynamic_cast<SDLTerminal*>(computer->term)->cursorColor = htoi(fg[i]);
-            }
-            if (selectedRenderer == 4)
-                printf("TF:%d;%c\nTK:%d;%c\nTW:%d;%c\n", term->id, ("0123456789abcdef")[computer->colors & 0xf], term->id, ("0123456789abcdef")[computer->colors >> 4], term->id, str[i]);
-            term->screen[term->blinkY][term->blinkX] = str[i];
-            term->colors[term->blinkY][term->blinkX] = computer->colors;
+    // characters left of the screen are skipped, and the cursor stops at the right edge
+    const size_t start = term->blinkX < 0 ? min<size_t>((size_t)-(long long)term->blinkX, str_sz) : 0;
+    const size_t end = min<long long>((long long)term->width - term->blinkX, str_sz);
+    const unsigned char * hex = htoiTable();
+    const bool allColors = computer->config->isColor || computer->isDebugger;
+    unsigned char * colorRow = term->colors.row_data(term->blinkY);
+    unsigned char colors = computer->colors;
+    int cursorColor = -1;
+    for (size_t i = start; i < end; i++) {
+        const unsigned char b = hex[(unsigned char)bg[i]], f = hex[(unsigned char)fg[i]];
+        if (allColors || ((unsigned)(b & 7) - 1) >= 6) colors = (unsigned char)(b << 4) | (colors & 0xF);
+        if (allColors || ((unsigned)(f & 7) - 1) >= 6) colors = (colors & 0xF0) | (cursorColor = f);
+        if (selectedRenderer == 4) {
+            ((TRoRTerminal*)term)->queueTextColor(colors & 0xf);
+            ((TRoRTerminal*)term)->queueBackgroundColor(colors >> 4);
+            ((TRoRTerminal*)term)->queueWrite(&str[i], 1);
         }
+        colorRow[term->blinkX + (long long)i] = colors;
     }
+    term->screen.write_run(term->blinkX, term->blinkY, (const unsigned char*)str, str_sz);
+    computer->colors = colors;
+    if (cursorColor >= 0 && dynamic_cast<SDLTerminal*>(term) != NULL) dynamic_cast<SDLTerminal*>(term)->cursorColor = cursorColor;
+    term->blinkX += (int)end;
     term->changed = true;
     return 0;
 }
 
 static int term_getPaletteColor(lua_State *L) {
     lastCFunction = __func__;
-    if (selectedRenderer == 1) {
-        if (luaL_checkinteger(L, 1) == 0x1) {
-            lua_pushnumber(L, 0xF0 / 255.0);
-            lua_pushnumber(L, 0xF0 / 255.0);
-            lua_pushnumber(L, 0xF0 / 255.0);
-        } else {
-            lua_pushnumber(L, 0x19 / 255.0);
-            lua_pushnumber(L, 0x19 / 255.0);
-            lua_pushnumber(L, 0x19 / 255.0);
-        }
-        return 3;
-    }
     Computer * computer = get_comp(L);
     Terminal * term = computer->term;
     int color;
@@ -294,7 +272,7 @@ static int term_getPaletteColor(lua_State *L) {
 static int term_setPaletteColor(lua_State *L) {
     lastCFunction = __func__;
     Computer * computer = get_comp(L);
-    if (selectedRenderer == 1 || !(computer->config->isColor || computer->isDebugger)) return 0;
+    if (!(computer->config->isColor || computer->isDebugger)) return 0;
     Terminal * term = computer->term;
     int color;
     if (term->mode == 2) color = (int)luaL_checkinteger(L, 1);
@@ -312,7 +290,7 @@ static int term_setPaletteColor(lua_State *L) {
         term->palette[color].b = (uint8_t)(luaL_checknumber(L, 4) * 255);
     }
     if (selectedRenderer == 4 && color < 16)
-        printf("TM:%d;%d,%f,%f,%f\n", term->id, color, term->palette[color].r / 255.0, term->palette[color].g / 255.0, term->palette[color].b / 255.0);
+        ((TRoRTerminal*)term)->queuePacket("TM", "%d,%f,%f,%f", color, term->palette[color].r / 255.0, term->palette[color].g / 255.0, term->palette[color].b / 255.0);
     term->changed = true;
     return 0;
 }
@@ -321,7 +299,7 @@ static int term_setGraphicsMode(lua_State *L) {
     lastCFunction = __func__;
     if (!lua_isboolean(L, 1) && !lua_isnumber(L, 1)) luaL_typerror(L, 1, "boolean or number");
     Computer * computer = get_comp(L);
-    if (selectedRenderer == 1 || selectedRenderer == 2 || !(computer->config->isColor || computer->isDebugger)) return 0;
+    if (selectedRenderer == 2 || !(computer->config->isColor || computer->isDebugger)) return 0;
     if (lua_isnumber(L, 1) && (lua_tointeger(L, 1) < 0 || lua_tointeger(L, 1) > 2)) return luaL_error(L, "bad argument %1 (invalid mode %d)", lua_tointeger(L, 1));
     std::lock_guard<std::mutex> lock(computer->term->locked);
     computer->term->mode = lua_isboolean(L, 1) ? (lua_toboolean(L, 1) ? 1 : 0) : (int)lua_tointeger(L, 1);
@@ -332,7 +310,7 @@ static int term_setGraphicsMode(lua_State *L) {
 static int term_getGraphicsMode(lua_State *L) {
     lastCFunction = __func__;
     Computer * computer = get_comp(L);
-    if (selectedRenderer == 1 || selectedRenderer == 2 || !(computer->config->isColor || computer->isDebugger)) {
+    if (selectedRenderer == 2 || !(computer->config->isColor || computer->isDebugger)) {
         lua_pushboolean(L, false);
         return 1;
     }
@@ -343,7 +321,7 @@ static int term_getGraphicsMode(lua_State *L) {
 
 static int term_setPixel(lua_State *L) {
     lastCFunction = __func__;
-    if (selectedRenderer == 1 || selectedRenderer == 2) return 0;
+    if (selectedRenderer == 2) return 0;
     Computer * computer = get_comp(L);
     Terminal * term = computer->term;
     const int x = (int)luaL_checkinteger(L, 1);
@@ -359,7 +337,7 @@ static int term_setPixel(lua_State *L) {
 
 static int term_getPixel(lua_State *L) {
     lastCFunction = __func__;
-    if (selectedRenderer == 1 || selectedRenderer == 2) {
+    if (selectedRenderer == 2) {
         lua_pushinteger(L, 0x8000);
         return 1;
     }
@@ -588,8 +566,14 @@ static int term_getPixels(lua_State* L) {
 
 static int term_screenshot(lua_State *L) {
     lastCFunction = __func__;
-    if (selectedRenderer != 0 && selectedRenderer != 5) return 0;
     Computer * computer = get_comp(L);
+    OffscreenTerminal * offscreen = dynamic_cast<OffscreenTerminal*>(computer->term);
+    if (offscreen != NULL) {
+        // headless screenshots are written right away, since there's no render to wait for
+        if (!lua_toboolean(L, 1)) offscreen->screenshot();
+        return 0;
+    }
+    if (selectedRenderer != 0 && selectedRenderer != 5) return 0;
     SDLTerminal * term = dynamic_cast<SDLTerminal*>(computer->term);
     if (term == NULL) return 0;
     if (std::chrono::system_clock::now() - term->lastScreenshotTime < std::chrono::milliseconds(1000 / config.recordingFPS)) return 0;
@@ -600,6 +584,37 @@ static int term_screenshot(lua_State *L) {
     return 0;
 }
 
+// Recording and raw export are only available in headless mode, where there's no window to do it from.
+static int term_record(lua_State *L) {
+    lastCFunction = __func__;
+    OffscreenTerminal * offscreen = dynamic_cast<OffscreenTerminal*>(get_comp(L)->term);
+    if (offscreen != NULL) offscreen->record();
+    return 0;
+}
+
+static int term_stopRecording(lua_State *L) {
+    lastCFunction = __func__;
+    OffscreenTerminal * offscreen = dynamic_cast<OffscreenTerminal*>(get_comp(L)->term);
+    if (offscreen != NULL) offscreen->stopRecording();
+    return 0;
+}
+
+static int term_isRecording(lua_State *L) {
+    lastCFunction = __func__;
+    OffscreenTerminal * offscreen = dynamic_cast<OffscreenTerminal*>(get_comp(L)->term);
+    lua_pushboolean(L, offscreen != NULL && offscreen->isRecording());
+    return 1;
+}
+
+static int term_exportRaw(lua_State *L) {
+    lastCFunction = __func__;
+    OffscreenTerminal * offscreen = dynamic_cast<OffscreenTerminal*>(get_comp(L)->term);
+    if (offscreen == NULL) return 0;
+    const std::string data = offscreen->exportRaw();
+    lua_pushlstring(L, data.data(), data.size());
+    return 1;
+}
+
 static int term_nativePaletteColor(lua_State *L) {
     lastCFunction = __func__;
     const int color = log2i((int)luaL_checkinteger(L, 1));
@@ -674,6 +689,10 @@ static luaL_reg term_reg[] = {
     {"setPixel", term_setPixel},
     {"getPixel", term_getPixel},
     {"screenshot", term_screenshot},
+    {"record", term_record},
+    {"stopRecording", term_stopRecording},
+    {"isRecording", term_isRecording},
+    {"exportRaw", term_exportRaw},
     {"nativePaletteColor", term_nativePaletteColor},
     {"nativePaletteColour", term_nativePaletteColor},
     {"drawPixels", term_drawPixels},
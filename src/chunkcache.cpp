@@ -0,0 +1,273 @@
+/*
+ * chunkcache.cpp
+ * CraftOS-PC 2
+ *
+ * This file implements the bytecode cache.
+ *
+ * This code is licensed under the MIT license.
+ * Copyright (c) 2019-2021 JackMacWindows.
+ */
+
+extern "C" {
+#include <lauxlib.h>
+}
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include "chunkcache.hpp"
+#include "romimage.hpp"
+#include "util.hpp"
+
+#ifdef STANDALONE_ROM
+extern FileEntry standaloneROM;
+#endif
+
+path_t chunkCacheDir;
+std::atomic<unsigned long> chunkCacheHits(0);
+std::atomic<unsigned long> chunkCacheMisses(0);
+
+// Small chunks are cheap to parse, and are usually generated code that never repeats.
+static const size_t minChunkSize = 1024;
+// The most memory (source + bytecode) the in-memory cache may hold before the least recently used chunks are dropped.
+static const size_t maxCacheSize = 32 * 1024 * 1024;
+static const char chunkFileMagic[8] = {'C', 'C', 'P', 'C', 'L', 'U', 'A', 'C'};
+
+// The source and name are kept so a hash collision can never load the wrong code.
+struct cached_chunk {
+    std::string name;
+    std::string source;
+    std::string bytecode;
+};
+typedef std::shared_ptr<const cached_chunk> chunk_ptr;
+
+static std::mutex cacheLock;
+static std::list<std::pair<std::string, chunk_ptr> > cacheOrder; // most recently used first
+static std::unordered_map<std::string, std::list<std::pair<std::string, chunk_ptr> >::iterator> cacheIndex;
+static size_t cacheSize = 0;
+
+static uint64_t fnv1a(const char * data, size_t size, uint64_t hash) {
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Returns a 128-bit key made from two differently seeded hashes of the name and source.
+static std::string chunkKey(const char * source, size_t size, const char * name) {
+    uint64_t hash[2] = {0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL};
+    for (uint64_t& h : hash) h = fnv1a(source, size, fnv1a(name, strlen(name) + 1, h));
+    return std::string((const char*)hash, sizeof(hash));
+}
+
+static bool chunkMatches(const chunk_ptr& chunk, const char * source, size_t size, const char * name) {
+    return chunk->name == name && chunk->source.size() == size && memcmp(chunk->source.data(), source, size) == 0;
+}
+
+// Reads a file from the ROM that computers mount at /rom.
+static bool readROMFile(const std::string& path, std::string& data) {
+    // the name comes from the computer, so don't let it point outside the ROM
+    if (path.empty() || path.find("..") != std::string::npos) return false;
+    try {
+#ifdef STANDALONE_ROM
+        const FileEntry& entry = standaloneROM.path(path);
+#else
+        if (romImage == NULL) {
+            FILE * fp = platform_fopen((getROMPath() + WS("/rom/") + wstr(path)).c_str(), "rb");
+            if (fp == NULL) return false;
+            char tmp[4096];
+            size_t read;
+            while ((read = fread(tmp, 1, sizeof(tmp), fp)) > 0) data.append(tmp, read);
+            const bool ok = !ferror(fp);
+            fclose(fp);
+            return ok;
+        }
+        const FileEntry& entry = romImage->path("rom/" + path);
+#endif
+        if (entry.isDir) return false;
+        data = entry.data;
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+// Only the BIOS and ROM are saved to disk: anything else a computer loads could be
+// generated code that never repeats, which would fill the directory without limit.
+// Any chunk can be given a name under /rom, so those only count if the source is
+// the ROM file with that name. Chunks that passed are remembered by key.
+static std::unordered_set<std::string> romChunks;
+static std::mutex romChunksLock;
+
+static bool isROMChunk(const std::string& key, const char * source, size_t size, const char * name) {
+    if (strncmp(name, "@/rom/", 6) != 0) return false;
+    {
+        std::lock_guard<std::mutex> lock(romChunksLock);
+        if (romChunks.find(key) != romChunks.end()) return true;
+    }
+    std::string data;
+    if (!readROMFile(name + 6, data) || data.size() != size || memcmp(data.data(), source, size) != 0) return false;
+    std::lock_guard<std::mutex> lock(romChunksLock);
+    romChunks.insert(key);
+    return true;
+}
+
+static path_t chunkPath(const std::string& key) {
+    static const char hex[] = "0123456789abcdef";
+    std::string name;
+    for (unsigned char c : key) {
+        name += hex[c >> 4];
+        name += hex[c & 15];
+    }
+    return chunkCacheDir + PATH_SEP + wstr(name) + WS(".luac");
+}
+
+static void insertChunk(const std::string& key, const chunk_ptr& chunk) {
+    std::lock_guard<std::mutex> lock(cacheLock);
+    auto it = cacheIndex.find(key);
+    if (it != cacheIndex.end()) {
+        // the old bytecode may not have loaded (e.g. a file written by another build), so always replace it
+        cacheSize -= it->second->second->source.size() + it->second->second->bytecode.size();
+        cacheOrder.erase(it->second);
+        cacheIndex.erase(it);
+    }
+    cacheOrder.push_front(std::make_pair(key, chunk));
+    cacheIndex[key] = cacheOrder.begin();
+    cacheSize += chunk->source.size() + chunk->bytecode.size();
+    while (cacheSize > maxCacheSize && cacheOrder.size() > 1) {
+        cacheSize -= cacheOrder.back().second->source.size() + cacheOrder.back().second->bytecode.size();
+        cacheIndex.erase(cacheOrder.back().first);
+        cacheOrder.pop_back();
+    }
+}
+
+static bool readField(FILE * fp, std::string& str) {
+    uint32_t size;
+    if (fread(&size, sizeof(size), 1, fp) != 1) return false;
+    str.resize(size);
+    return size == 0 || fread(&str[0], 1, size, fp) == size;
+}
+
+static void writeField(FILE * fp, const std::string& str) {
+    const uint32_t size = (uint32_t)str.size();
+    fwrite(&size, sizeof(size), 1, fp);
+    fwrite(str.data(), 1, str.size(), fp);
+}
+
+static chunk_ptr readChunkFile(const std::string& key) {
+    FILE * fp = platform_fopen(chunkPath(key).c_str(), "rb");
+    if (fp == NULL) return NULL;
+    char magic[sizeof(chunkFileMagic)];
+    std::shared_ptr<cached_chunk> chunk = std::make_shared<cached_chunk>();
+    const bool ok = fread(magic, sizeof(magic), 1, fp) == 1 && memcmp(magic, chunkFileMagic, sizeof(magic)) == 0 &&
+        readField(fp, chunk->name) && readField(fp, chunk->source) && readField(fp, chunk->bytecode);
+    fclose(fp);
+    if (!ok) return NULL;
+    return chunk;
+}
+
+static void writeChunkFile(lua_State *L, const std::string& key, const chunk_ptr& chunk) {
+    createDirectory(chunkCacheDir);
+    const path_t path = chunkPath(key);
+    // write to a file of our own first, so another computer can never read half of a chunk
+    const path_t tmppath = path + WS(".") + to_path_t((unsigned long long)(uintptr_t)L);
+    FILE * fp = platform_fopen(tmppath.c_str(), "wb");
+    if (fp == NULL) return;
+    fwrite(chunkFileMagic, sizeof(chunkFileMagic), 1, fp);
+    writeField(fp, chunk->name);
+    writeField(fp, chunk->source);
+    writeField(fp, chunk->bytecode);
+    const bool ok = !ferror(fp);
+    fclose(fp);
+#ifdef WIN32
+    if (!ok || _wrename(tmppath.c_str(), path.c_str()) != 0) _wremove(tmppath.c_str());
+#else
+    if (!ok || rename(tmppath.c_str(), path.c_str()) != 0) remove(tmppath.c_str());
+#endif
+}
+
+static chunk_ptr findChunk(const std::string& key, const char * source, size_t size, const char * name, bool fromROM) {
+    {
+        std::lock_guard<std::mutex> lock(cacheLock);
+        auto it = cacheIndex.find(key);
+        if (it != cacheIndex.end() && chunkMatches(it->second->second, source, size, name)) {
+            cacheOrder.splice(cacheOrder.begin(), cacheOrder, it->second);
+            return it->second->second;
+        }
+    }
+    if (chunkCacheDir.empty() || !(fromROM || isROMChunk(key, source, size, name))) return NULL;
+    chunk_ptr chunk = readChunkFile(key);
+    if (chunk == NULL || !chunkMatches(chunk, source, size, name)) return NULL;
+    insertChunk(key, chunk);
+    return chunk;
+}
+
+// Pushes the cached function for a source, if there is one that loads.
+static bool pushCachedChunk(lua_State *L, const std::string& key, const char * source, size_t size, const char * name, bool fromROM) {
+    chunk_ptr chunk = findChunk(key, source, size, name, fromROM);
+    if (chunk == NULL) return false;
+    if (luaL_loadbuffer(L, chunk->bytecode.data(), chunk->bytecode.size(), name) != 0) {
+        lua_pop(L, 1);
+        return false;
+    }
+    chunkCacheHits++;
+    return true;
+}
+
+static int chunkWriter(lua_State *L, const void * data, size_t size, void * ud) {
+    ((std::string*)ud)->append((const char*)data, size);
+    return 0;
+}
+
+// Dumps the function on top of the stack and adds it to the cache.
+static void storeChunk(lua_State *L, const std::string& key, const char * source, size_t size, const char * name, bool fromROM) {
+    if (!lua_isfunction(L, -1) || lua_iscfunction(L, -1)) return;
+    std::shared_ptr<cached_chunk> chunk = std::make_shared<cached_chunk>();
+    if (lua_dump(L, chunkWriter, &chunk->bytecode) != 0) return;
+    chunk->name = name;
+    chunk->source = std::string(source, size);
+    insertChunk(key, chunk);
+    if (!chunkCacheDir.empty() && (fromROM || isROMChunk(key, source, size, name))) writeChunkFile(L, key, chunk);
+}
+
+int loadCachedChunk(lua_State *L, const char * source, size_t size, const char * name, bool fromROM) {
+    if (size < minChunkSize || *source == LUA_SIGNATURE[0]) return luaL_loadbuffer(L, source, size, name);
+    const std::string key = chunkKey(source, size, name);
+    if (pushCachedChunk(L, key, source, size, name, fromROM)) return 0;
+    chunkCacheMisses++;
+    const int status = luaL_loadbuffer(L, source, size, name);
+    if (status == 0) storeChunk(L, key, source, size, name, fromROM);
+    return status;
+}
+
+int cached_loadstring(lua_State *L) {
+    lastCFunction = __func__;
+    const int nargs = lua_gettop(L);
+    size_t size = 0;
+    const char * source = lua_type(L, 1) == LUA_TSTRING ? lua_tolstring(L, 1, &size) : NULL;
+    const bool cacheable = source != NULL && size >= minChunkSize && *source != LUA_SIGNATURE[0];
+    std::string key;
+    const char * name = NULL;
+    if (cacheable) {
+        name = luaL_optstring(L, 2, source);
+        key = chunkKey(source, size, name);
+        if (pushCachedChunk(L, key, source, size, name, false)) return 1;
+        chunkCacheMisses++;
+    }
+    // Parsing is left to the original loadstring, so errors and any restrictions it has stay the same.
+    // The arguments are copied, so the source and name stay alive until the result is stored.
+    lua_pushvalue(L, lua_upvalueindex(1));
+    for (int i = 1; i <= nargs; i++) lua_pushvalue(L, i);
+    lua_call(L, nargs, LUA_MULTRET);
+    if (cacheable && lua_isfunction(L, nargs + 1)) {
+        lua_pushvalue(L, nargs + 1);
+        storeChunk(L, key, source, size, name, false);
+        lua_pop(L, 1);
+    }
+    return lua_gettop(L) - nargs;
+}
@@ -0,0 +1,33 @@
+/*
+ * chunkcache.hpp
+ * CraftOS-PC 2
+ *
+ * This file defines the functions for the bytecode cache, which lets every
+ * computer reuse the compiled form of Lua sources that were already loaded.
+ *
+ * This code is licensed under the MIT license.
+ * Copyright (c) 2019-2021 JackMacWindows.
+ */
+
+#ifndef CHUNKCACHE_HPP
+#define CHUNKCACHE_HPP
+extern "C" {
+#include <lua.h>
+}
+#include <atomic>
+#include "platform.hpp"
+
+// Where to keep compiled chunks between runs (empty = only cache in memory).
+extern path_t chunkCacheDir;
+extern std::atomic<unsigned long> chunkCacheHits;
+extern std::atomic<unsigned long> chunkCacheMisses;
+
+// Works like luaL_loadbuffer, but if the same source was loaded under the same
+// name before (by any computer), the function is loaded from its bytecode
+// instead of being parsed again. fromROM says the source was read from the ROM
+// (e.g. the BIOS), so its bytecode can be kept on disk under any name.
+extern int loadCachedChunk(lua_State *L, const char * source, size_t size, const char * name, bool fromROM = false);
+// Replacement for loadstring; the original function must be its first upvalue.
+extern int cached_loadstring(lua_State *L);
+
+#endif
@@ -114,7 +114,8 @@ std::unordered_map<std::string, std::pair<int, int> > configSettings = {
     {"http_max_download", {0, 1}},
     {"http_timeout", {0, 1}},
     {"extendMargins", {0, 0}},
-    {"snapToSize", {0, 0}}
+    {"snapToSize", {0, 0}},
+    {"maxComputerMemory", {1, 1}}
 };
 
 const std::string hiddenOptions[] = {"customFontPath", "customFontScale", "customCharScale", "skipUpdate", "lastVersion", "pluginData", "http_proxy_server", "http_proxy_port", "cliControlKeyMode", "serverMode"};
@@ -192,7 +193,8 @@ void config_init() {
         "",
         0,
         false,
-        true
+        true,
+        0
     };
     std::ifstream in(getBasePath() + WS("/config/global.json"));
     if (!in.is_open()) { onboardingMode = 1; return; }
@@ -276,6 +278,7 @@ void config_init() {
     readConfigSetting(http_proxy_port, Int);
     readConfigSetting(extendMargins, Bool);
     readConfigSetting(snapToSize, Bool);
+    readConfigSetting(maxComputerMemory, Int);
     if (root.isMember("pluginData")) for (const auto& e : root["pluginData"]) config.pluginData[e.first] = e.second.extract<std::string>();
     // for JIT: substr until the position of the first '-' in CRAFTOSPC_VERSION (todo: find a static way to determine this)
     if (onboardingMode == 0 && (!root.isMember("lastVersion") || root["lastVersion"].asString().substr(0, sizeof(CRAFTOSPC_VERSION) - 1) != CRAFTOSPC_VERSION)) { onboardingMode = 2; config_save(); }
@@ -334,6 +337,7 @@ void config_save() {
     root["http_proxy_port"] = config.http_proxy_port;
     root["extendMargins"] = config.extendMargins;
     root["snapToSize"] = config.snapToSize;
+    root["maxComputerMemory"] = config.maxComputerMemory;
     root["lastVersion"] = CRAFTOSPC_VERSION;
     Value pluginRoot;
     for (const auto& e : config.pluginData) pluginRoot[e.first] = e.second;
@@ -32,6 +32,7 @@
 #include <stdio.h>   // for FILE*
 #include <string.h>  // for memcpy and bzero
 #include <stdint.h>  // for integer typedefs
+#include <stddef.h>  // for ptrdiff_t
 
 // Define these macros to hook into a custom memory allocator.
 // TEMP_MALLOC and TEMP_FREE will only be called in stack fashion - frees in the reverse order of mallocs
@@ -605,39 +606,13 @@ void GifWritePalette( const GifPalette* pPal, FILE* f )
     }
 }
 
-// write the image header, LZW-compress and write out the image
-void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uint32_t width, uint32_t height, uint32_t delay, GifPalette* pPal)
+// LZW-compress a block of palette indices and write it out, including the
+// minimum code size byte and the block terminator. Each row starts rowStride
+// bytes after the previous one (which may be negative), and each index is
+// pixelStride bytes after the previous one in the row.
+void GifWriteLzwData(FILE* f, const uint8_t* image, ptrdiff_t rowStride, uint32_t pixelStride, uint32_t width, uint32_t height, int minCodeSize)
 {
-    // graphics control extension
-    fputc(0x21, f);
-    fputc(0xf9, f);
-    fputc(0x04, f);
-    fputc(0x05, f); // leave prev frame in place, this frame has transparency
-    fputc(delay & 0xff, f);
-    fputc((delay >> 8) & 0xff, f);
-    fputc(kGifTransIndex, f); // transparent color index
-    fputc(0, f);
-
-    fputc(0x2c, f); // image descriptor block
-
-    fputc(left & 0xff, f);           // corner of image in canvas space
-    fputc((left >> 8) & 0xff, f);
-    fputc(top & 0xff, f);
-    fputc((top >> 8) & 0xff, f);
-
-    fputc(width & 0xff, f);          // width and height of image
-    fputc((width >> 8) & 0xff, f);
-    fputc(height & 0xff, f);
-    fputc((height >> 8) & 0xff, f);
-
-    //fputc(0, f); // no local color table, no transparency
-    //fputc(0x80, f); // no local color table, but transparency
-
-    fputc(0x80 + pPal->bitDepth-1, f); // local color table present, 2 ^ bitDepth entries
-    GifWritePalette(pPal, f);
-
-    const int minCodeSize = pPal->bitDepth;
-    const uint32_t clearCode = 1 << pPal->bitDepth;
+    const uint32_t clearCode = 1 << minCodeSize;
 
     fputc(minCodeSize, f); // min code size 8 bits
 
@@ -657,15 +632,10 @@ void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uin
 
     for(uint32_t yy=0; yy<height; ++yy)
     {
+        const uint8_t* row = image + (ptrdiff_t)yy*rowStride;
         for(uint32_t xx=0; xx<width; ++xx)
         {
-    #ifdef GIF_FLIP_VERT
-            // bottom-left origin image (such as an OpenGL capture)
-            uint8_t nextValue = image[((height-1-yy)*width+xx)*4+3];
-    #else
-            // top-left origin
-            uint8_t nextValue = image[(yy*width+xx)*4+3];
-    #endif
+            uint8_t nextValue = row[xx*pixelStride];
 
             // "loser mode" - no compression, every single code is followed immediately by a clear
             //WriteCode( f, stat, nextValue, codeSize );
@@ -724,6 +694,46 @@ void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uin
     GIF_TEMP_FREE(codetree);
 }
 
+// write the image header, LZW-compress and write out the image
+void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uint32_t width, uint32_t height, uint32_t delay, GifPalette* pPal)
+{
+    // graphics control extension
+    fputc(0x21, f);
+    fputc(0xf9, f);
+    fputc(0x04, f);
+    fputc(0x05, f); // leave prev frame in place, this frame has transparency
+    fputc(delay & 0xff, f);
+    fputc((delay >> 8) & 0xff, f);
+    fputc(kGifTransIndex, f); // transparent color index
+    fputc(0, f);
+
+    fputc(0x2c, f); // image descriptor block
+
+    fputc(left & 0xff, f);           // corner of image in canvas space
+    fputc((left >> 8) & 0xff, f);
+    fputc(top & 0xff, f);
+    fputc((top >> 8) & 0xff, f);
+
+    fputc(width & 0xff, f);          // width and height of image
+    fputc((width >> 8) & 0xff, f);
+    fputc(height & 0xff, f);
+    fputc((height >> 8) & 0xff, f);
+
+    //fputc(0, f); // no local color table, no transparency
+    //fputc(0x80, f); // no local color table, but transparency
+
+    fputc(0x80 + pPal->bitDepth-1, f); // local color table present, 2 ^ bitDepth entries
+    GifWritePalette(pPal, f);
+
+#ifdef GIF_FLIP_VERT
+    // bottom-left origin image (such as an OpenGL capture)
+    GifWriteLzwData(f, image + (height-1)*width*4 + 3, -(ptrdiff_t)width*4, 4, width, height, pPal->bitDepth);
+#else
+    // top-left origin
+    GifWriteLzwData(f, image + 3, (ptrdiff_t)width*4, 4, width, height, pPal->bitDepth);
+#endif
+}
+
 struct GifWriter
 {
     FILE* f;
@@ -817,6 +827,126 @@ bool GifWriteFrame( GifWriter* writer, const uint8_t* image, uint32_t width, uin
     return true;
 }
 
+// write the image header and palette for an image that's already made of palette
+// indices, LZW-compress and write out the image
+// image points to the top-left corner of the rectangle, and rows are stride bytes apart
+// transIndex is the index to mark as transparent, or -1 for an opaque image
+void GifWriteLzwIndexedImage(FILE* f, const uint8_t* image, uint32_t stride, uint32_t left, uint32_t top, uint32_t width, uint32_t height, uint32_t delay, const GifPalette* pPal, int transIndex)
+{
+    // graphics control extension
+    fputc(0x21, f);
+    fputc(0xf9, f);
+    fputc(0x04, f);
+    fputc(transIndex >= 0 ? 0x05 : 0x04, f); // leave prev frame in place, this frame may have transparency
+    fputc(delay & 0xff, f);
+    fputc((delay >> 8) & 0xff, f);
+    fputc(transIndex >= 0 ? transIndex : 0, f); // transparent color index
+    fputc(0, f);
+
+    fputc(0x2c, f); // image descriptor block
+
+    fputc(left & 0xff, f);           // corner of image in canvas space
+    fputc((left >> 8) & 0xff, f);
+    fputc(top & 0xff, f);
+    fputc((top >> 8) & 0xff, f);
+
+    fputc(width & 0xff, f);          // width and height of image
+    fputc((width >> 8) & 0xff, f);
+    fputc(height & 0xff, f);
+    fputc((height >> 8) & 0xff, f);
+
+    fputc(0x80 + pPal->bitDepth-1, f); // local color table present, 2 ^ bitDepth entries
+    // unlike GifWritePalette, every entry is a real color here
+    for(int ii=0; ii<(1 << pPal->bitDepth); ++ii)
+    {
+        fputc((int)pPal->r[ii], f);
+        fputc((int)pPal->g[ii], f);
+        fputc((int)pPal->b[ii], f);
+    }
+
+    GifWriteLzwData(f, image, (ptrdiff_t)stride, 1, width, height, pPal->bitDepth);
+}
+
+// Writes out a new frame made of palette indices (one byte per pixel) to a GIF in progress.
+// This skips palette building and dithering entirely, so it's much cheaper than GifWriteFrame
+// when the source already has a palette of at most 2 ^ bitDepth colors. Only the bounding
+// rectangle of the pixels that changed since the last frame is written, and pixels inside it
+// that didn't change are marked transparent using an index that no changed pixel uses.
+// Set writer->firstFrame to true before calling to force a full opaque frame (e.g. when the
+// palette changed, since unchanged indices would otherwise keep their old colors).
+bool GifWriteIndexedFrame( GifWriter* writer, const uint8_t* image, uint32_t width, uint32_t height, uint32_t delay, const GifPalette* pPal )
+{
+    if(!writer->f) return false;
+
+    uint32_t left = 0, top = 0, right = width, bottom = height;
+    int transIndex = -1;
+    const uint8_t* oldImage = writer->oldImage;
+
+    if(!writer->firstFrame)
+    {
+        // find the bounding rectangle of all changed pixels
+        left = width; top = height; right = 0; bottom = 0;
+        for(uint32_t yy=0; yy<height; ++yy)
+        {
+            const uint8_t* row = image + (size_t)yy*width;
+            const uint8_t* oldRow = oldImage + (size_t)yy*width;
+            if(memcmp(row, oldRow, width) == 0) continue;
+            if(yy < top) top = yy;
+            bottom = yy + 1;
+            uint32_t xx = 0;
+            while(row[xx] == oldRow[xx]) ++xx;
+            if(xx < left) left = xx;
+            xx = width;
+            while(row[xx-1] == oldRow[xx-1]) --xx;
+            if(xx > right) right = xx;
+        }
+
+        if(top == height)
+        {
+            // nothing changed - emit a single transparent pixel to keep the timing
+            left = top = 0;
+            right = bottom = 1;
+        }
+
+        // pick an index that isn't used by any changed pixel to be transparent
+        bool used[256] = {false};
+        for(uint32_t yy=top; yy<bottom; ++yy)
+            for(uint32_t xx=left; xx<right; ++xx)
+                if(image[yy*width+xx] != oldImage[yy*width+xx]) used[image[yy*width+xx]] = true;
+        for(int ii=0; ii<(1 << pPal->bitDepth); ++ii)
+        {
+            if(!used[ii])
+            {
+                transIndex = ii;
+                break;
+            }
+        }
+    }
+    writer->firstFrame = false;
+
+    if(transIndex >= 0)
+    {
+        // build the frame rectangle with unchanged pixels made transparent
+        const uint32_t rw = right - left, rh = bottom - top;
+        uint8_t* rect = (uint8_t*)GIF_TEMP_MALLOC(rw*rh);
+        for(uint32_t yy=0; yy<rh; ++yy)
+        {
+            const uint8_t* row = image + (size_t)(top+yy)*width + left;
+            const uint8_t* oldRow = oldImage + (size_t)(top+yy)*width + left;
+            uint8_t* outRow = rect + (size_t)yy*rw;
+            for(uint32_t xx=0; xx<rw; ++xx)
+                outRow[xx] = row[xx] == oldRow[xx] ? (uint8_t)transIndex : row[xx];
+        }
+        GifWriteLzwIndexedImage(writer->f, rect, rw, left, top, rw, rh, delay, pPal, transIndex);
+        GIF_TEMP_FREE(rect);
+    }
+    else GifWriteLzwIndexedImage(writer->f, image + (size_t)top*width + left, width, left, top, right - left, bottom - top, delay, pPal, -1);
+
+    memcpy(writer->oldImage, image, (size_t)width*height);
+
+    return true;
+}
+
 // Writes the EOF code, closes the file handle, and frees temp memory used by a GIF.
 // Many if not most viewers will still display a GIF properly if the EOF code is missing,
 // but it's still a good idea to write it out.
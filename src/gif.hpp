@@ -11,6 +11,7 @@
 #ifndef gif_h
 #define gif_h
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -62,6 +63,7 @@ struct GifLzwNode
 };
 
 extern void GifWritePalette( const GifPalette* pPal, FILE* f );
+extern void GifWriteLzwData(FILE* f, const uint8_t* image, ptrdiff_t rowStride, uint32_t pixelStride, uint32_t width, uint32_t height, int minCodeSize);
 extern void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uint32_t width, uint32_t height, uint32_t delay, GifPalette* pPal);
 
 struct GifWriter
@@ -73,6 +75,8 @@ struct GifWriter
 
 extern bool GifBegin( GifWriter* writer, const char* filename, uint32_t width, uint32_t height, uint32_t delay, int32_t bitDepth = 8, bool dither = false );
 extern bool GifWriteFrame( GifWriter* writer, const uint8_t* image, uint32_t width, uint32_t height, uint32_t delay, int bitDepth = 8, bool dither = false );
+extern bool GifWriteIndexedFrame( GifWriter* writer, const uint8_t* image, uint32_t width, uint32_t height, uint32_t delay, const GifPalette* pPal );
+extern void GifWriteLzwIndexedImage(FILE* f, const uint8_t* image, uint32_t stride, uint32_t left, uint32_t top, uint32_t width, uint32_t height, uint32_t delay, const GifPalette* pPal, int transIndex);
 extern bool GifEnd( GifWriter* writer );
 
 #endif
\ No newline at end of file
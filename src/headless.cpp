@@ -0,0 +1,159 @@
+/*
+ * headless.cpp
+ * CraftOS-PC 2
+ *
+ * This file implements the HeadlessOutput class.
+ *
+ * This code is licensed under the MIT license.
+ * Copyright (c) 2019-2021 JackMacWindows.
+ */
+
+#include <climits>
+#include <cstdio>
+#include <unordered_set>
+#include "headless.hpp"
+#include "util.hpp"
+
+bool headlessJSON = false;
+
+// Lines are written early once this much is waiting, so a program printing in a tight loop can't use up memory.
+static const size_t maxQueuedSize = 65536;
+// Text written further right than this is dropped, so a far-off cursor can't make a row use up memory.
+static const size_t maxRowLength = 4096;
+
+static std::mutex outputsLock;
+static std::unordered_set<HeadlessOutput*> outputs;
+static std::mutex stdoutLock;
+
+static void writeOutput(const std::string& data) {
+    if (data.empty()) return;
+    std::lock_guard<std::mutex> lock(stdoutLock);
+    fwrite(data.data(), 1, data.size(), stdout);
+    fflush(stdout);
+}
+
+// Characters outside printable ASCII are escaped as their code point, so the output is always valid UTF-8.
+static void appendJSONString(std::string& out, const std::string& str) {
+    static const char hex[] = "0123456789abcdef";
+    out += '"';
+    for (unsigned char c : str) {
+        if (c == '"') out += "\\\"";
+        else if (c == '\\') out += "\\\\";
+        else if (c >= 0x20 && c < 0x7F) out += (char)c;
+        else {
+            out += "\\u00";
+            out += hex[c >> 4];
+            out += hex[c & 15];
+        }
+    }
+    out += '"';
+}
+
+// Returns the text that turns an unfinished line that was already shown into row.
+static std::string rowUpdate(const std::string& row, const std::string& shown) {
+    if (row.compare(0, shown.size(), shown) == 0) return row.substr(shown.size());
+    // the start of the row changed, so write it again from the beginning
+    std::string retval = "\r" + row;
+    if (row.size() < shown.size()) retval += std::string(shown.size() - row.size(), ' ');
+    return retval;
+}
+
+HeadlessOutput::HeadlessOutput(int id, int height): computerID(id), height(height) {
+    std::lock_guard<std::mutex> lock(outputsLock);
+    outputs.insert(this);
+}
+
+HeadlessOutput::~HeadlessOutput() {
+    {
+        std::lock_guard<std::mutex> lock(outputsLock);
+        outputs.erase(this);
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->lock);
+        finishRow();
+    }
+    flush(false);
+}
+
+// lock must be held.
+void HeadlessOutput::finishRow() {
+    if (rowUsed || !shown.empty()) {
+        if (headlessJSON) {
+            lines += "{\"computer\":" + std::to_string(computerID) + ",\"text\":";
+            appendJSONString(lines, row);
+            lines += "}\n";
+        } else lines += rowUpdate(row, shown) + "\n";
+    }
+    row.clear();
+    shown.clear();
+    rowUsed = false;
+}
+
+void HeadlessOutput::write(const char * text, size_t len) {
+    std::lock_guard<std::mutex> lock(this->lock);
+    const long long x = cursorX;
+    cursorX = (int)min<long long>(x + (long long)min<size_t>(len, INT_MAX), INT_MAX);
+    if (cursorY < 1 || cursorY > height) return;
+    rowUsed = true;
+    // characters left of the screen or past the end of a row are skipped
+    const size_t skip = x < 1 ? (size_t)min<long long>(1 - x, (long long)len) : 0;
+    const size_t col = x < 1 ? 0 : (size_t)min<long long>(x - 1, maxRowLength);
+    if (col >= maxRowLength || skip >= len) return;
+    const size_t n = min(len - skip, maxRowLength - col);
+    if (row.size() < col) row.resize(col, ' ');
+    row.replace(col, min(n, row.size() - col), text + skip, n);
+}
+
+void HeadlessOutput::setCursorPos(int x, int y) {
+    bool full = false;
+    {
+        std::lock_guard<std::mutex> lock(this->lock);
+        if (y != cursorY) {
+            finishRow();
+            full = lines.size() >= maxQueuedSize;
+        }
+        cursorX = x;
+        cursorY = y;
+    }
+    if (full) flush(false);
+}
+
+void HeadlessOutput::scrollLines(int n) {
+    if (n == 0) return;
+    bool full;
+    {
+        std::lock_guard<std::mutex> lock(this->lock);
+        finishRow();
+        full = lines.size() >= maxQueuedSize;
+    }
+    if (full) flush(false);
+}
+
+void HeadlessOutput::clearScreen() {
+    std::lock_guard<std::mutex> lock(this->lock);
+    finishRow();
+}
+
+void HeadlessOutput::clearLine() {
+    std::lock_guard<std::mutex> lock(this->lock);
+    row.clear();
+}
+
+void HeadlessOutput::flush(bool showRow) {
+    std::lock_guard<std::mutex> flock(flushLock);
+    std::string out;
+    {
+        std::lock_guard<std::mutex> lock(this->lock);
+        out.swap(lines);
+        if (showRow && !headlessJSON && rowUsed && row != shown) {
+            out += rowUpdate(row, shown);
+            shown = row;
+        }
+    }
+    writeOutput(out);
+}
+
+void flushHeadlessOutputs() {
+    std::lock_guard<std::mutex> lock(outputsLock);
+    for (HeadlessOutput * out : outputs) out->flush(false);
+}
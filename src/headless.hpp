@@ -0,0 +1,52 @@
+/*
+ * headless.hpp
+ * CraftOS-PC 2
+ *
+ * This file defines the HeadlessOutput class, which assembles the text a
+ * computer writes in headless mode into lines before sending it to stdout.
+ *
+ * This code is licensed under the MIT license.
+ * Copyright (c) 2019-2021 JackMacWindows.
+ */
+
+#ifndef HEADLESS_HPP
+#define HEADLESS_HPP
+#include <mutex>
+#include <string>
+
+// Whether headless output is written as JSON lines instead of plain text.
+extern bool headlessJSON;
+
+// Each computer has one of these in headless mode. Text is written into the
+// row the cursor is on, and the row is queued as a line once the cursor
+// leaves it. Queued lines are written with a single call on every render
+// tick, and the unfinished row is shown once the computer waits for an event.
+class HeadlessOutput {
+    std::mutex lock;
+    std::mutex flushLock; // keeps flushes from different threads in order
+    std::string row; // the row the cursor is on
+    std::string shown; // the part of the row that was already written as an unfinished line
+    std::string lines; // finished lines waiting to be written
+    bool rowUsed = false; // whether anything was written to the row since it was last finished
+    void finishRow();
+public:
+    const int computerID;
+    const int height; // writes to rows below this are dropped
+    int cursorX = 1;
+    int cursorY = 1;
+    bool canBlink = true;
+    HeadlessOutput(int id, int height);
+    ~HeadlessOutput(); // finishes the row and writes everything left
+    void write(const char * text, size_t len);
+    void setCursorPos(int x, int y);
+    void scrollLines(int n);
+    void clearScreen();
+    void clearLine();
+    // Writes all finished lines; if showRow is set, the unfinished row is written too (text mode only).
+    void flush(bool showRow);
+};
+
+// Writes the finished lines of every computer; called from the render loop.
+extern void flushHeadlessOutputs();
+
+#endif
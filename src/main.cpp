@@ -20,14 +20,20 @@ static void* releaseNotesThread(void* data);
 #include <Computer.hpp>
 #include <configuration.hpp>
 #include <sys/stat.h>
+#include "chunkcache.hpp"
+#include "headless.hpp"
+#include "metrics.hpp"
 #include "peripheral/drive.hpp"
 #include "peripheral/speaker.hpp"
 #include "platform.hpp"
+#include "profiler.hpp"
+#include "romimage.hpp"
 #include "runtime.hpp"
 #include "terminal/CLITerminal.hpp"
 #include "terminal/RawTerminal.hpp"
 #include "terminal/SDLTerminal.hpp"
 #include "terminal/TRoRTerminal.hpp"
+#include "terminal/OffscreenTerminal.hpp"
 #include "terminal/HardwareSDLTerminal.hpp"
 #include "termsupport.hpp"
 #include <Poco/Checksum.h>
@@ -495,9 +501,12 @@ int main(int argc, char*argv[]) {
     std::string base_path_storage;
     std::string rom_path_storage;
     path_t customDataDir;
+#ifndef STANDALONE_ROM
+    path_t romImagePath, packROMPath;
+#endif
     for (int i = 1; i < argc; i++) {
         std::string arg(argv[i]);
-        if (arg == "--headless") { selectedRenderer = 1; checkTTY(); } else if (arg == "--gui" || arg == "--sdl" || arg == "--software-sdl") selectedRenderer = 0;
+        if (arg == "--headless") { selectedRenderer = 1; checkTTY(); } else if (arg == "--headless-json") { selectedRenderer = 1; headlessJSON = true; checkTTY(); } else if (arg == "--gui" || arg == "--sdl" || arg == "--software-sdl") selectedRenderer = 0;
         else if (arg == "--cli" || arg == "-c") { selectedRenderer = 2; checkTTY(); } else if (arg == "--raw") { selectedRenderer = 3; checkTTY(); } else if (arg == "--raw-client") { rawClient = true; checkTTY(); } else if (arg == "--tror") { selectedRenderer = 4; checkTTY(); } else if (arg == "--hardware-sdl" || arg == "--hardware") selectedRenderer = 5;
         else if (arg == "--script") script_file = argv[++i];
         else if (arg.substr(0, 9) == "--script=") script_file = arg.substr(9);
@@ -522,6 +531,19 @@ int main(int argc, char*argv[]) {
 #endif
         else if (arg == "-i" || arg == "--id") { manualID = true; id = std::stoi(argv[++i]); }
         else if (arg == "--migrate") forceMigrate = true;
+        else if (arg == "--profile") profileDir = wstr(argv[++i]);
+        else if (arg == "--profile-rate") profileRate = std::stoul(argv[++i]);
+        else if (arg == "--bytecode-cache") chunkCacheDir = wstr(argv[++i]);
+        else if (arg == "--metrics-port") metricsPort = (unsigned short)std::stoul(argv[++i]);
+        else if (arg == "--metrics-file") metricsFile = wstr(argv[++i]);
+        else if (arg == "--metrics-interval") metricsInterval = std::stoi(argv[++i]);
+#ifndef STANDALONE_ROM
+        else if (arg == "--rom-image") romImagePath = wstr(argv[++i]);
+        else if (arg == "--pack-rom") packROMPath = wstr(argv[++i]);
+#endif
+#ifndef NO_MIXER
+        else if (arg == "--audio-output") speakerOutputPath = wstr(argv[++i]);
+#endif
         else if (arg == "--mount" || arg == "--mount-ro" || arg == "--mount-rw") {
             std::string mount_path = argv[++i];
             if (mount_path.find('=') == std::string::npos) {
@@ -606,6 +628,17 @@ int main(int argc, char*argv[]) {
                       << "      --mount      Uses default mount_mode in config\n"
                       << "      --mount-ro   Forces mount to be read-only\n"
                       << "      --mount-rw   Forces mount to be read-write\n"
+#ifndef NO_MIXER
+                      << "  --audio-output <file.wav|null>   Mixes speaker audio in software and writes it to a file\n"
+#endif
+                      << "  --profile <dir>                  Samples each computer's Lua stack and saves it to <dir>/<id>.folded\n"
+                      << "  --profile-rate <hz>              Sets how many samples --profile takes per second (default 1000)\n"
+                      << "  --bytecode-cache <dir>           Keeps compiled ROM files in <dir> so later launches don't parse them again\n"
+                      << "  --metrics-port <port>            Serves runtime metrics for Prometheus at http://127.0.0.1:<port>/metrics\n"
+                      << "  --metrics-file <file>            Writes runtime metrics to <file> every few seconds\n"
+                      << "  --metrics-interval <seconds>     Sets how often --metrics-file is written (default 10)\n"
+                      << "  --rom-image <dir|file>           Loads the ROM into memory once and shares it with every computer\n"
+                      << "  --pack-rom <file>                Packs the ROM into a single file for --rom-image and exits\n"
                       << "  -h|-?|--help                     Shows this help message\n"
                       << "  -V|--version                     Shows the current version\n\n"
                       << "Renderer options:\n"
@@ -614,6 +647,7 @@ int main(int argc, char*argv[]) {
                       << "  -c|--cli                         Outputs using an ncurses-based interface\n"
 #endif
                       << "  --headless                       Outputs only text straight to stdout\n"
+                      << "  --headless-json                  Outputs text to stdout as JSON lines\n"
                       << "  --raw                            Outputs terminal contents using a binary format\n"
                       << "  --raw-client                     Renders raw output from another terminal (GUI only)\n"
                       << "  --tror                           Outputs TRoR (terminal redirect over Rednet) packets\n"
@@ -640,6 +674,35 @@ int main(int argc, char*argv[]) {
     if (computerDir.empty()) computerDir = getBasePath() + WS("/computer");
 #endif
     if (!customDataDir.empty()) customDataDirs[id] = customDataDir;
+#ifndef STANDALONE_ROM
+    if (!packROMPath.empty()) {
+        const std::string err = packROMImage(getROMPath(), packROMPath);
+        if (!err.empty()) {
+            std::cerr << err << "\n";
+            return 1;
+        }
+        std::cout << "Packed ROM into " << astr(packROMPath) << "\n";
+        return 0;
+    }
+    if (!romImagePath.empty()) {
+        const std::string err = loadROMImage(romImagePath);
+        if (!err.empty()) {
+            std::cerr << err << "\n";
+            return 1;
+        }
+    }
+#endif
+    {
+        const std::string err = startMetrics();
+        if (!err.empty()) {
+            std::cerr << err << "\n";
+            return 1;
+        }
+    }
+#ifndef NO_MIXER
+    // captured audio doesn't need a sound card, so SDL opens its dummy device instead
+    if (!speakerOutputPath.empty()) SDL_setenv("SDL_AUDIODRIVER", "dummy", true);
+#endif
     setupCrashHandler();
     migrateData(forceMigrate);
     config_init();
@@ -653,7 +716,7 @@ int main(int argc, char*argv[]) {
     else if (selectedRenderer == 0) SDLTerminal::init();
     else if (selectedRenderer == 4) TRoRTerminal::init();
     else if (selectedRenderer == 5) HardwareSDLTerminal::init();
-    else SDL_Init(SDL_INIT_TIMER | SDL_INIT_AUDIO);
+    else OffscreenTerminal::init();
     driveInit();
 #ifndef NO_MIXER
     speakerInit();
@@ -682,6 +745,7 @@ int main(int argc, char*argv[]) {
     }
 #endif
     for (std::thread *t : computerThreads) { if (t->joinable()) {t->join(); delete t;} }
+    peripheralUpdateQuit();
     // C++ doesn't like it if we try to empty the SDL event list once the plugins are gone
     SDLTerminal::eventHandlers.clear();
     deinitializePlugins();
@@ -689,7 +753,9 @@ int main(int argc, char*argv[]) {
     speakerQuit();
 #endif
     driveQuit();
+    freeROMImage();
     http_server_stop();
+    stopMetrics();
     config_save();
     if (!updateAtQuit.empty()) {
         updateNow(updateAtQuit);
@@ -703,7 +769,7 @@ int main(int argc, char*argv[]) {
     else if (selectedRenderer == 0) SDLTerminal::quit();
     else if (selectedRenderer == 4) TRoRTerminal::quit();
     else if (selectedRenderer == 5) HardwareSDLTerminal::quit();
-    else SDL_Quit();
+    else OffscreenTerminal::quit();
 #ifdef WIN32
     if (kernel32handle != NULL) SDL_UnloadObject(kernel32handle);
 #endif
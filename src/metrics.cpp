@@ -0,0 +1,283 @@
+/*
+ * metrics.cpp
+ * CraftOS-PC 2
+ *
+ * This file implements the runtime metrics and the server and file writer
+ * that export them.
+ *
+ * This code is licensed under the MIT license.
+ * Copyright (c) 2019-2021 JackMacWindows.
+ */
+
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#ifndef __EMSCRIPTEN__
+#include <Poco/Net/HTTPRequestHandler.h>
+#include <Poco/Net/HTTPRequestHandlerFactory.h>
+#include <Poco/Net/HTTPServer.h>
+#include <Poco/Net/HTTPServerParams.h>
+#include <Poco/Net/HTTPServerRequest.h>
+#include <Poco/Net/HTTPServerResponse.h>
+#include <Poco/Net/ServerSocket.h>
+#include <Poco/Net/SocketAddress.h>
+#endif
+#include "allocator.hpp"
+#include "chunkcache.hpp"
+#include "metrics.hpp"
+#include "util.hpp"
+
+unsigned short metricsPort = 0;
+path_t metricsFile;
+int metricsInterval = 10;
+bool metricsEnabled = false;
+
+// Upper bounds of the histogram buckets, from 100 us to 2.5 s.
+static const std::chrono::nanoseconds histogramBounds[MetricHistogram::bucketCount] = {
+    std::chrono::microseconds(100), std::chrono::microseconds(250), std::chrono::microseconds(500),
+    std::chrono::milliseconds(1), std::chrono::microseconds(2500), std::chrono::milliseconds(5),
+    std::chrono::milliseconds(10), std::chrono::milliseconds(25), std::chrono::milliseconds(50),
+    std::chrono::milliseconds(100), std::chrono::milliseconds(500), std::chrono::milliseconds(2500)
+};
+
+struct terminal_metrics {
+    MetricHistogram renderTime;
+};
+
+static std::mutex computersLock;
+static std::unordered_set<ComputerMetrics*> computerMetrics;
+static std::mutex terminalsLock;
+static std::unordered_map<unsigned, std::unique_ptr<terminal_metrics> > terminalMetrics;
+
+static std::string formatNumber(double num) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.9g", num);
+    return buf;
+}
+
+MetricHistogram::MetricHistogram(): count(0), sumNanoseconds(0) {
+    for (auto& b : buckets) b.store(0, std::memory_order_relaxed);
+}
+
+void MetricHistogram::observe(std::chrono::nanoseconds time) {
+    int i = 0;
+    while (i < bucketCount && time > histogramBounds[i]) i++;
+    buckets[i].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sumNanoseconds.fetch_add(time.count() > 0 ? (unsigned long long)time.count() : 0, std::memory_order_relaxed);
+}
+
+void MetricHistogram::write(std::string& out, const std::string& name, const std::string& labels) const {
+    // buckets are stored separately, but Prometheus expects each to include all smaller ones
+    unsigned long long total = 0;
+    for (int i = 0; i <= bucketCount; i++) {
+        total += buckets[i].load(std::memory_order_relaxed);
+        out += name + "_bucket{" + labels + ",le=\"" + (i == bucketCount ? std::string("+Inf") : formatNumber(std::chrono::duration<double>(histogramBounds[i]).count())) + "\"} " + std::to_string(total) + "\n";
+    }
+    out += name + "_sum{" + labels + "} " + formatNumber(sumNanoseconds.load(std::memory_order_relaxed) / 1e9) + "\n";
+    out += name + "_count{" + labels + "} " + std::to_string(count.load(std::memory_order_relaxed)) + "\n";
+}
+
+ComputerMetrics::ComputerMetrics(int id): computerID(id), events(0), eventQueueDepth(0), waitNanoseconds(0), fsOperations(0), fsBytesRead(0),
+  fsBytesWritten(0), httpRequests(0), modemMessages(0), timers(0), allocator(NULL) {
+    std::lock_guard<std::mutex> lock(computersLock);
+    computerMetrics.insert(this);
+}
+
+ComputerMetrics::~ComputerMetrics() {
+    std::lock_guard<std::mutex> lock(computersLock);
+    computerMetrics.erase(this);
+}
+
+void observeRenderTime(Terminal * term, std::chrono::nanoseconds time) {
+    // the metrics are looked up once and kept on the terminal; metricsText only drops them once the terminal is gone
+    if (term->metrics == NULL) {
+        std::lock_guard<std::mutex> lock(terminalsLock);
+        std::unique_ptr<terminal_metrics>& m = terminalMetrics[term->id];
+        if (m == NULL) m.reset(new terminal_metrics);
+        term->metrics = m.get();
+    }
+    ((terminal_metrics*)term->metrics)->renderTime.observe(time);
+}
+
+static const struct {
+    const char * name;
+    const char * type;
+    const char * help;
+    std::atomic<unsigned long long> ComputerMetrics::*value;
+    double scale;
+} computerCounters[] = {
+    {"craftos_computer_events_total", "counter", "Events taken from the computer's queue.", &ComputerMetrics::events, 1},
+    {"craftos_computer_event_queue_depth", "gauge", "Events waiting to be delivered after the last one was taken.", &ComputerMetrics::eventQueueDepth, 1},
+    {"craftos_computer_wait_seconds_total", "counter", "Time spent waiting for events.", &ComputerMetrics::waitNanoseconds, 1e-9},
+    {"craftos_computer_fs_operations_total", "counter", "Filesystem calls that touch the disk.", &ComputerMetrics::fsOperations, 1},
+    {"craftos_computer_fs_read_bytes_total", "counter", "Bytes read from file handles.", &ComputerMetrics::fsBytesRead, 1},
+    {"craftos_computer_fs_written_bytes_total", "counter", "Bytes written to file handles.", &ComputerMetrics::fsBytesWritten, 1},
+    {"craftos_computer_http_requests_total", "counter", "HTTP requests started.", &ComputerMetrics::httpRequests, 1},
+    {"craftos_computer_modem_messages_total", "counter", "Modem messages transmitted.", &ComputerMetrics::modemMessages, 1},
+    {"craftos_computer_timers_total", "counter", "Timers and alarms started.", &ComputerMetrics::timers, 1},
+};
+
+static void writeHeader(std::string& out, const char * name, const char * type, const char * help) {
+    out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+}
+
+std::string metricsText() {
+    std::string out;
+    {
+        std::lock_guard<std::mutex> lock(computersLock);
+        writeHeader(out, "craftos_computers", "gauge", "Computers that are running.");
+        out += "craftos_computers " + std::to_string(computerMetrics.size()) + "\n";
+        for (const auto& c : computerCounters) {
+            writeHeader(out, c.name, c.type, c.help);
+            for (const ComputerMetrics * m : computerMetrics) {
+                const unsigned long long value = (m->*c.value).load(std::memory_order_relaxed);
+                out += std::string(c.name) + "{computer=\"" + std::to_string(m->computerID) + "\"} " + (c.scale == 1 ? std::to_string(value) : formatNumber(value * c.scale)) + "\n";
+            }
+        }
+        writeHeader(out, "craftos_computer_memory_bytes", "gauge", "Memory used by the computer's Lua state.");
+        for (const ComputerMetrics * m : computerMetrics) {
+            const ComputerAllocator * alloc = m->allocator.load();
+            if (alloc != NULL) out += "craftos_computer_memory_bytes{computer=\"" + std::to_string(m->computerID) + "\"} " + std::to_string(alloc->usedBytes()) + "\n";
+        }
+        writeHeader(out, "craftos_computer_memory_peak_bytes", "gauge", "Most memory used by the computer's Lua state at once.");
+        for (const ComputerMetrics * m : computerMetrics) {
+            const ComputerAllocator * alloc = m->allocator.load();
+            if (alloc != NULL) out += "craftos_computer_memory_peak_bytes{computer=\"" + std::to_string(m->computerID) + "\"} " + std::to_string(alloc->peakBytes()) + "\n";
+        }
+        writeHeader(out, "craftos_computer_lua_seconds", "histogram", "Time spent running Lua between events.");
+        for (const ComputerMetrics * m : computerMetrics)
+            m->luaTime.write(out, "craftos_computer_lua_seconds", "computer=\"" + std::to_string(m->computerID) + "\"");
+    }
+    {
+        // renderTargetsLock keeps the render loop from using the metrics while closed terminals are dropped
+        std::lock_guard<std::mutex> rlock(renderTargetsLock);
+        std::lock_guard<std::mutex> lock(terminalsLock);
+        std::unordered_set<const void*> open;
+        for (const Terminal * term : renderTargets) if (term->metrics != NULL) open.insert(term->metrics);
+        writeHeader(out, "craftos_terminal_render_seconds", "histogram", "Time taken to render each frame of a terminal.");
+        for (auto it = terminalMetrics.begin(); it != terminalMetrics.end();) {
+            if (open.find(it->second.get()) == open.end()) {
+                it = terminalMetrics.erase(it);
+                continue;
+            }
+            it->second->renderTime.write(out, "craftos_terminal_render_seconds", "terminal=\"" + std::to_string(it->first) + "\"");
+            ++it;
+        }
+    }
+    writeHeader(out, "craftos_bytecode_cache_hits_total", "counter", "Chunks loaded from the bytecode cache.");
+    out += "craftos_bytecode_cache_hits_total " + std::to_string(chunkCacheHits.load()) + "\n";
+    writeHeader(out, "craftos_bytecode_cache_misses_total", "counter", "Chunks that had to be compiled.");
+    out += "craftos_bytecode_cache_misses_total " + std::to_string(chunkCacheMisses.load()) + "\n";
+    return out;
+}
+
+#ifndef __EMSCRIPTEN__
+class MetricsHandler: public Poco::Net::HTTPRequestHandler {
+public:
+    void handleRequest(Poco::Net::HTTPServerRequest& req, Poco::Net::HTTPServerResponse& res) override {
+        if (req.getURI() != "/metrics" && req.getURI() != "/") {
+            res.setStatus(Poco::Net::HTTPResponse::HTTP_NOT_FOUND);
+            res.send() << "Not found\n";
+            return;
+        }
+        const std::string text = metricsText();
+        res.setContentType("text/plain; version=0.0.4");
+        res.setContentLength((std::streamsize)text.size());
+        res.send() << text;
+    }
+    class Factory: public Poco::Net::HTTPRequestHandlerFactory {
+    public:
+        Poco::Net::HTTPRequestHandler * createRequestHandler(const Poco::Net::HTTPServerRequest&) override {return new MetricsHandler;}
+    };
+};
+
+static Poco::Net::HTTPServer * metricsServer = NULL;
+#endif
+
+static std::thread * writerThread = NULL;
+static std::mutex writerLock;
+static std::condition_variable writerNotify;
+static bool writerStopping = false;
+
+// Writes to a temporary file first, so readers never see half of the metrics.
+static void writeMetricsFile() {
+    const path_t tmppath = metricsFile + WS(".tmp");
+    FILE * fp = platform_fopen(tmppath.c_str(), "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open %s for writing\n", astr(tmppath).c_str());
+        return;
+    }
+    const std::string text = metricsText();
+    fwrite(text.data(), 1, text.size(), fp);
+    const bool ok = !ferror(fp);
+    fclose(fp);
+#ifdef WIN32
+    // Windows can't rename over an existing file
+    if (ok) _wremove(metricsFile.c_str());
+    if (!ok || _wrename(tmppath.c_str(), metricsFile.c_str()) != 0) _wremove(tmppath.c_str());
+#else
+    if (!ok || rename(tmppath.c_str(), metricsFile.c_str()) != 0) remove(tmppath.c_str());
+#endif
+}
+
+static void metricsWriterThread() {
+    std::unique_lock<std::mutex> lock(writerLock);
+    while (!writerStopping) {
+        writerNotify.wait_for(lock, std::chrono::seconds(metricsInterval), []()->bool {return writerStopping;});
+        writeMetricsFile();
+    }
+}
+
+std::string startMetrics() {
+    if (metricsPort == 0 && metricsFile.empty()) return "";
+    if (metricsInterval < 1) return "The metrics interval must be at least 1 second";
+    metricsEnabled = true;
+#ifdef __EMSCRIPTEN__
+    if (metricsPort != 0) return "Serving metrics is not supported on this platform";
+#else
+    if (metricsPort != 0) {
+        Poco::Net::HTTPServerParams * params = new Poco::Net::HTTPServerParams;
+        params->setMaxThreads(1);
+        params->setKeepAlive(false);
+        try {
+            // only local clients can read the metrics; put a proxy in front to expose them
+            metricsServer = new Poco::Net::HTTPServer(new MetricsHandler::Factory, Poco::Net::ServerSocket(Poco::Net::SocketAddress("127.0.0.1", metricsPort)), params);
+            metricsServer->start();
+        } catch (std::exception &e) {
+            metricsServer = NULL;
+            return "Could not open metrics server on port " + std::to_string(metricsPort) + ": " + e.what();
+        }
+    }
+#endif
+    if (!metricsFile.empty()) {
+        writerStopping = false;
+        writerThread = new std::thread(metricsWriterThread);
+        setThreadName(*writerThread, "Metrics Writer Thread");
+    }
+    return "";
+}
+
+void stopMetrics() {
+#ifndef __EMSCRIPTEN__
+    if (metricsServer != NULL) {
+        metricsServer->stopAll(true);
+        delete metricsServer;
+        metricsServer = NULL;
+    }
+#endif
+    if (writerThread != NULL) {
+        {
+            std::lock_guard<std::mutex> lock(writerLock);
+            writerStopping = true;
+        }
+        writerNotify.notify_all();
+        writerThread->join(); // writes the file one last time
+        delete writerThread;
+        writerThread = NULL;
+    }
+}
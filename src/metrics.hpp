@@ -0,0 +1,75 @@
+/*
+ * metrics.hpp
+ * CraftOS-PC 2
+ *
+ * This file defines the runtime metrics, which count what each computer is
+ * doing so it can be exported in the Prometheus text format.
+ *
+ * This code is licensed under the MIT license.
+ * Copyright (c) 2019-2021 JackMacWindows.
+ */
+
+#ifndef METRICS_HPP
+#define METRICS_HPP
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <Computer.hpp>
+#include <Terminal.hpp>
+#include "platform.hpp"
+
+class ComputerAllocator;
+
+// A latency histogram. Observing a value is lock-free, so it's safe from any thread.
+class MetricHistogram {
+public:
+    static const int bucketCount = 12;
+    std::atomic<unsigned long long> buckets[bucketCount + 1]; // the last bucket is +Inf
+    std::atomic<unsigned long long> count;
+    std::atomic<unsigned long long> sumNanoseconds;
+    MetricHistogram();
+    void observe(std::chrono::nanoseconds time);
+    // Appends the histogram as <name>_bucket, <name>_sum and <name>_count lines.
+    void write(std::string& out, const std::string& name, const std::string& labels) const;
+};
+
+// The metrics for one computer. Computers only have these while metrics are enabled.
+struct ComputerMetrics {
+    const int computerID;
+    std::atomic<unsigned long long> events;
+    std::atomic<unsigned long long> eventQueueDepth; // the number of events waiting after the last one was taken
+    std::atomic<unsigned long long> waitNanoseconds; // time spent waiting for events in getNextEvent
+    std::atomic<unsigned long long> fsOperations;
+    std::atomic<unsigned long long> fsBytesRead;
+    std::atomic<unsigned long long> fsBytesWritten;
+    std::atomic<unsigned long long> httpRequests;
+    std::atomic<unsigned long long> modemMessages;
+    std::atomic<unsigned long long> timers;
+    std::atomic<const ComputerAllocator*> allocator;
+    MetricHistogram luaTime; // time spent running Lua between each event
+    ComputerMetrics(int id);
+    ~ComputerMetrics();
+};
+
+// Where to serve metrics (0 = don't serve), and where and how often (in seconds) to write them.
+extern unsigned short metricsPort;
+extern path_t metricsFile;
+extern int metricsInterval;
+// Whether new computers collect metrics; set by startMetrics.
+extern bool metricsEnabled;
+
+// Adds to a counter of a computer, if it collects metrics.
+inline void countMetric(Computer * comp, std::atomic<unsigned long long> ComputerMetrics::*counter, unsigned long long n = 1) {
+    ComputerMetrics * metrics = (ComputerMetrics*)comp->metrics;
+    if (metrics != NULL) (metrics->*counter).fetch_add(n, std::memory_order_relaxed);
+}
+
+// Records how long a terminal took to render. This must be called from the render loop, with renderTargetsLock held.
+extern void observeRenderTime(Terminal * term, std::chrono::nanoseconds time);
+// Returns all metrics in the Prometheus text format.
+extern std::string metricsText();
+// Starts the metrics server and file writer if either was configured. Returns an error message, or an empty string on success.
+extern std::string startMetrics();
+extern void stopMetrics();
+
+#endif
@@ -0,0 +1,295 @@
+/*
+ * peripheral/channel.cpp
+ * CraftOS-PC 2
+ *
+ * This file defines the methods for the channel peripheral.
+ *
+ * This code is licensed under the MIT License.
+ * Copyright (c) 2019-2021 JackMacWindows.
+ */
+
+#include "../runtime.hpp"
+#include "channel.hpp"
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+static const size_t defaultChannelCapacity = 65536;
+static const size_t maxChannelCapacity = 16777216;
+
+struct channel_buffer {
+    std::string name;
+    std::mutex lock;
+    std::vector<char> data;
+    size_t head = 0; // index of the first unread byte
+    size_t size = 0; // number of unread bytes
+    std::list<channel*> attached;
+
+    // Copies up to len unread bytes into dst without consuming them.
+    size_t copyOut(char * dst, size_t len) const {
+        len = min(len, size);
+        const size_t first = min(len, data.size() - head);
+        memcpy(dst, &data[head], first);
+        if (first < len) memcpy(dst + first, &data[0], len - first);
+        return len;
+    }
+
+    // Appends len bytes from src; the caller checks there's enough space.
+    void copyIn(const char * src, size_t len) {
+        const size_t tail = (head + size) % data.size();
+        const size_t first = min(len, data.size() - tail);
+        memcpy(&data[tail], src, first);
+        if (first < len) memcpy(&data[0], src + first, len - first);
+        size += len;
+    }
+
+    void consume(size_t len) {
+        head = (head + len) % data.size();
+        size -= len;
+        if (size == 0) head = 0;
+    }
+};
+
+// Channels live as long as at least one peripheral is attached to them.
+static std::unordered_map<std::string, std::weak_ptr<channel_buffer>> channels;
+static std::mutex channelsLock;
+
+struct channel_event_data {
+    std::string side;
+    std::shared_ptr<channel_buffer> buffer;
+    std::shared_ptr<std::atomic_bool> pending;
+};
+
+static std::string channel_data(lua_State *L, void* data) {
+    channel_event_data * d = (channel_event_data*)data;
+    // clear the flag first so a write racing with this event queues another one
+    d->pending->store(false);
+    size_t available;
+    {
+        std::lock_guard<std::mutex> lock(d->buffer->lock);
+        available = d->buffer->size;
+    }
+    lua_pushstring(L, d->side.c_str());
+    lua_pushinteger(L, available);
+    delete d;
+    return "channel_data";
+}
+
+int channel::getName(lua_State *L) {
+    lastCFunction = __func__;
+    lua_pushlstring(L, buffer->name.c_str(), buffer->name.size());
+    return 1;
+}
+
+int channel::getCapacity(lua_State *L) {
+    lastCFunction = __func__;
+    lua_pushinteger(L, buffer->data.size());
+    return 1;
+}
+
+int channel::available(lua_State *L) {
+    lastCFunction = __func__;
+    std::lock_guard<std::mutex> lock(buffer->lock);
+    lua_pushinteger(L, buffer->size);
+    return 1;
+}
+
+int channel::space(lua_State *L) {
+    lastCFunction = __func__;
+    std::lock_guard<std::mutex> lock(buffer->lock);
+    lua_pushinteger(L, buffer->data.size() - buffer->size);
+    return 1;
+}
+
+int channel::write(lua_State *L) {
+    lastCFunction = __func__;
+    size_t len = 0;
+    const char * str = luaL_checklstring(L, 1, &len);
+    const bool partial = lua_toboolean(L, 2);
+    size_t written = 0;
+    {
+        std::lock_guard<std::mutex> lock(buffer->lock);
+        const size_t room = buffer->data.size() - buffer->size;
+        if (len <= room || partial) {
+            written = min(len, room);
+            buffer->copyIn(str, written);
+            if (written) notify();
+        }
+    }
+    lua_pushinteger(L, written);
+    return 1;
+}
+
+int channel::read(lua_State *L) {
+    lastCFunction = __func__;
+    const lua_Integer count = luaL_optinteger(L, 1, -1);
+    if (count == 0) {
+        lua_pushliteral(L, "");
+        return 1;
+    }
+    std::string retval;
+    {
+        std::lock_guard<std::mutex> lock(buffer->lock);
+        retval.resize(count < 0 ? buffer->size : min((size_t)count, buffer->size));
+        if (!retval.empty()) buffer->consume(buffer->copyOut(&retval[0], retval.size()));
+    }
+    if (retval.empty()) lua_pushnil(L);
+    else lua_pushlstring(L, retval.c_str(), retval.size());
+    return 1;
+}
+
+int channel::peek(lua_State *L) {
+    lastCFunction = __func__;
+    const lua_Integer count = luaL_optinteger(L, 1, -1);
+    if (count == 0) {
+        lua_pushliteral(L, "");
+        return 1;
+    }
+    std::string retval;
+    {
+        std::lock_guard<std::mutex> lock(buffer->lock);
+        retval.resize(count < 0 ? buffer->size : min((size_t)count, buffer->size));
+        if (!retval.empty()) buffer->copyOut(&retval[0], retval.size());
+    }
+    if (retval.empty()) lua_pushnil(L);
+    else lua_pushlstring(L, retval.c_str(), retval.size());
+    return 1;
+}
+
+int channel::clear(lua_State *L) {
+    lastCFunction = __func__;
+    std::lock_guard<std::mutex> lock(buffer->lock);
+    buffer->consume(buffer->size);
+    return 0;
+}
+
+// Kept on the stack while wait is yielding.
+struct channel_wait_ctx {
+    int top; // the stack size when the method yielded, as it sees it
+    lua_Integer timer; // the timeout timer's ID, or 0 if there's no timeout
+};
+
+int channel::wait(lua_State *L) {
+    lastCFunction = __func__;
+    channel_wait_ctx * ctx = (channel_wait_ctx*)lua_vcontext(L);
+    if (ctx == NULL) {
+        lua_settop(L, 1);
+        const bool timeout = !lua_isnil(L, 1);
+        if (timeout) luaL_checknumber(L, 1);
+        ctx = (channel_wait_ctx*)lua_newuserdata(L, sizeof(channel_wait_ctx));
+        ctx->timer = 0;
+        if (timeout) {
+            lua_getglobal(L, "os");
+            lua_getfield(L, -1, "startTimer");
+            lua_pushvalue(L, 1);
+            lua_call(L, 1, 1);
+            ctx->timer = lua_tointeger(L, -1);
+            lua_pop(L, 2);
+        }
+    } else {
+        // resumed with an event
+        const int ev = ctx->top + 1;
+        const bool terminated = lua_gettop(L) >= ev && lua_isstring(L, ev) && strcmp(lua_tostring(L, ev), "terminate") == 0;
+        const bool timedOut = lua_gettop(L) >= ev + 1 && ctx->timer != 0 && lua_isstring(L, ev) && strcmp(lua_tostring(L, ev), "timer") == 0 && lua_tointeger(L, ev + 1) == ctx->timer;
+        lua_settop(L, ctx->top);
+        if (terminated) return luaL_error(L, "Terminated");
+        if (timedOut) {
+            std::lock_guard<std::mutex> lock(buffer->lock);
+            lua_pushboolean(L, buffer->size > 0);
+            return 1;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(buffer->lock);
+        if (buffer->size > 0) {
+            lua_pushboolean(L, true);
+            return 1;
+        }
+    }
+    // peripheral.call is called again when the computer resumes, so put its arguments back
+    lua_pushlstring(L, side.c_str(), side.size());
+    lua_insert(L, 1);
+    lua_pushliteral(L, "wait");
+    lua_insert(L, 2);
+    ctx->top = lua_gettop(L) - 2;
+    return lua_vyield(L, 0, ctx);
+}
+
+// Queues a channel_data event on every other peripheral attached to the
+// channel, unless one is already waiting to be pulled. buffer->lock must be held.
+void channel::notify() {
+    for (channel * c : buffer->attached) {
+        if (c == this || c->eventPending->exchange(true)) continue;
+        channel_event_data * d = new channel_event_data;
+        d->side = c->side;
+        d->buffer = buffer;
+        d->pending = c->eventPending;
+        queueEvent(c->comp, channel_data, d);
+    }
+}
+
+channel::channel(lua_State *L, const char * side) {
+    const std::string name = luaL_checkstring(L, 3);
+    const lua_Integer capacity = luaL_optinteger(L, 4, defaultChannelCapacity);
+    if (capacity < 1 || (size_t)capacity > maxChannelCapacity) throw std::invalid_argument("Channel capacity must be between 1 and " + std::to_string(maxChannelCapacity) + " bytes");
+    comp = get_comp(L);
+    this->side = side;
+    {
+        // a channel that already exists keeps its original capacity
+        std::lock_guard<std::mutex> lock(channelsLock);
+        buffer = channels[name].lock();
+        if (!buffer) {
+            buffer = std::make_shared<channel_buffer>();
+            buffer->name = name;
+            buffer->data.resize(capacity);
+            channels[name] = buffer;
+        }
+    }
+    std::lock_guard<std::mutex> lock(buffer->lock);
+    buffer->attached.push_back(this);
+}
+
+channel::~channel() {
+    {
+        std::lock_guard<std::mutex> lock(buffer->lock);
+        buffer->attached.remove(this);
+    }
+    std::lock_guard<std::mutex> lock(channelsLock);
+    auto it = channels.find(buffer->name);
+    buffer.reset();
+    if (it != channels.end() && it->second.expired()) channels.erase(it);
+}
+
+const peripheral_method_table<channel> channel::dispatch = {
+    {"getName", &channel::getName},
+    {"getCapacity", &channel::getCapacity},
+    {"available", &channel::available},
+    {"space", &channel::space},
+    {"write", &channel::write},
+    {"read", &channel::read},
+    {"peek", &channel::peek},
+    {"clear", &channel::clear},
+    {"wait", &channel::wait}
+};
+
+int channel::call(lua_State *L, const char * method) {
+    return dispatch.call(this, L, method);
+}
+
+static luaL_Reg channel_reg[] = {
+    {"getName", NULL},
+    {"getCapacity", NULL},
+    {"available", NULL},
+    {"space", NULL},
+    {"write", NULL},
+    {"read", NULL},
+    {"peek", NULL},
+    {"clear", NULL},
+    {"wait", NULL},
+    {NULL, NULL}
+};
+
+library_t channel::methods = {"channel", channel_reg, nullptr, nullptr};
@@ -0,0 +1,52 @@
+/*
+ * peripheral/channel.hpp
+ * CraftOS-PC 2
+ *
+ * This file defines the class for the channel peripheral.
+ *
+ * This code is licensed under the MIT License.
+ * Copyright (c) 2019-2021 JackMacWindows.
+ */
+
+#ifndef PERIPHERAL_CHANNEL_HPP
+#define PERIPHERAL_CHANNEL_HPP
+#include <atomic>
+#include <memory>
+#include <string>
+#include <peripheral.hpp>
+
+struct channel_buffer;
+
+// A channel is a named byte ring buffer shared by every computer that attaches
+// a channel peripheral with the same name. Data is copied straight between the
+// ring and Lua strings, and readers are told about new data with a
+// `channel_data` event instead of receiving the data in the event itself.
+class channel: public peripheral {
+private:
+    Computer * comp;
+    std::string side;
+    std::shared_ptr<channel_buffer> buffer;
+    std::shared_ptr<std::atomic_bool> eventPending = std::make_shared<std::atomic_bool>(false);
+    int getName(lua_State *L);
+    int getCapacity(lua_State *L);
+    int available(lua_State *L);
+    int space(lua_State *L);
+    int write(lua_State *L);
+    int read(lua_State *L);
+    int peek(lua_State *L);
+    int clear(lua_State *L);
+    int wait(lua_State *L);
+    void notify();
+public:
+    static library_t methods;
+    static const peripheral_method_table<channel> dispatch;
+    static peripheral * init(lua_State *L, const char * side) {return new channel(L, side);}
+    static void deinit(peripheral * p) {delete (channel*)p;}
+    destructor getDestructor() const override {return deinit;}
+    library_t getMethods() const override {return methods;}
+    channel(lua_State *L, const char * side);
+    ~channel();
+    int call(lua_State *L, const char * method) override;
+};
+
+#endif
@@ -24,6 +24,7 @@ class computer: public peripheral {
     int getLabel(lua_State *L);
 public:
     static library_t methods;
+    static const peripheral_method_table<computer> dispatch;
     static peripheral * init(lua_State *L, const char * side) {return new computer(L, side);}
     static void deinit(peripheral * p) {delete (computer*)p;}
     destructor getDestructor() const override {return deinit;}
@@ -75,15 +75,17 @@ computer::~computer() {
     }
 }
 
+const peripheral_method_table<computer> computer::dispatch = {
+    {"turnOn", &computer::turnOn},
+    {"shutdown", &computer::shutdown},
+    {"reboot", &computer::reboot},
+    {"getID", &computer::getID},
+    {"isOn", &computer::isOn},
+    {"getLabel", &computer::getLabel}
+};
+
 int computer::call(lua_State *L, const char * method) {
-    const std::string m(method);
-    if (m == "turnOn") return turnOn(L);
-    else if (m == "shutdown") return shutdown(L);
-    else if (m == "reboot") return reboot(L);
-    else if (m == "getID") return getID(L);
-    else if (m == "isOn") return isOn(L);
-    else if (m == "getLabel") return getLabel(L);
-    else return 0;
+    return dispatch.call(this, L, method);
 }
 
 static luaL_Reg computer_reg[] = {
@@ -173,6 +173,7 @@ static int debugger_lib_setBreakpoint(lua_State *L) {
     debugger * dbg = (debugger*)lua_touserdata(L, -1);
     const int id = !dbg->computer->breakpoints.empty() ? dbg->computer->breakpoints.rbegin()->first + 1 : 1;
     dbg->computer->breakpoints[id] = std::make_pair("@/" + astr(fixpath(dbg->computer, lua_tostring(L, 1), false, false)), lua_tointeger(L, 2));
+    updateBreakpointIndex(dbg->computer);
     dbg->computer->hasBreakpoints = true;
     lua_pushinteger(L, id);
     return 1;
@@ -184,6 +185,7 @@ static int debugger_lib_unsetBreakpoint(lua_State *L) {
     debugger * dbg = (debugger*)lua_touserdata(L, -1);
     if (dbg->computer->breakpoints.find((int)lua_tointeger(L, 1)) != dbg->computer->breakpoints.end()) {
         dbg->computer->breakpoints.erase((int)lua_tointeger(L, 1));
+        updateBreakpointIndex(dbg->computer);
         if (dbg->computer->breakpoints.empty())
             dbg->computer->hasBreakpoints = false;
         lua_pushboolean(L, true);
@@ -481,6 +483,7 @@ int debugger::setBreakpoint(lua_State *L) {
     Computer * computer = get_comp(L);
     const int id = !computer->breakpoints.empty() ? computer->breakpoints.rbegin()->first + 1 : 1;
     computer->breakpoints[id] = std::make_pair("@/" + astr(fixpath(computer, luaL_checkstring(L, 1), false, false)), luaL_checkinteger(L, 2));
+    updateBreakpointIndex(computer);
     computer->hasBreakpoints = true;
     lua_pushinteger(L, id);
     return 1;
@@ -564,21 +567,21 @@ debugger::debugger(lua_State *L, const char * side) {
     computerThreads.push_back(compThread);
     computer->shouldDeinitDebugger = false;
     computer->debugger = this;
-    lua_sethook(computer->L, termHook, LUA_MASKLINE | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 0);
-    lua_sethook(computer->coro, termHook, LUA_MASKLINE | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 0);
-    lua_sethook(L, termHook, LUA_MASKLINE | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 0);
+    setComputerHook(computer, computer->L, LUA_MASKLINE | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 0);
+    setComputerHook(computer, computer->coro, LUA_MASKLINE | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 0);
+    setComputerHook(computer, L, LUA_MASKLINE | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 0);
     lua_getfield(L, LUA_REGISTRYINDEX, "_coroutine_stack");
     for (size_t i = 1; i <= lua_objlen(L, -1); i++) {
         lua_rawgeti(L, -1, (int)i);
-        if (lua_isthread(L, -1)) lua_sethook(lua_tothread(L, -1), termHook, LUA_MASKLINE | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 0);
+        if (lua_isthread(L, -1)) setComputerHook(computer, lua_tothread(L, -1), LUA_MASKLINE | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 0);
         lua_pop(L, 1);
     }
     lua_pop(L, 1);
 }
 
 void debugger::reinitialize(lua_State *L) {
-    lua_sethook(computer->coro, termHook, LUA_MASKLINE | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 0);
-    lua_sethook(L, termHook, LUA_MASKLINE | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 0);
+    setComputerHook(computer, computer->coro, LUA_MASKLINE | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 0);
+    setComputerHook(computer, L, LUA_MASKLINE | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 0);
 }
 
 debugger::~debugger() {
@@ -602,20 +605,23 @@ debugger::~debugger() {
     computer->shouldDeinitDebugger = true;
 }
 
+const peripheral_method_table<debugger> debugger::dispatch = {
+    {"stop", &debugger::_break},
+    {"break", &debugger::_break},
+    {"setBreakpoint", &debugger::setBreakpoint},
+    {"print", &debugger::print},
+    {"deinit", &debugger::_deinit}
+};
+
 int debugger::call(lua_State *L, const char * method) {
-    const std::string m(method);
-    if (m == "stop" || m == "break") return _break(L);
-    else if (m == "setBreakpoint") return setBreakpoint(L);
-    else if (m == "print") return print(L);
-    else if (m == "deinit") return _deinit(L);
-    else return 0;
+    return dispatch.call(this, L, method);
 }
 
 int debugger::_deinit(lua_State *L) {
     if (!computer->hasBreakpoints) {
-        lua_sethook(computer->L, termHook, LUA_MASKCOUNT | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 1000000);
-        lua_sethook(computer->coro, termHook, LUA_MASKCOUNT | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 1000000);
-        lua_sethook(L, termHook, LUA_MASKCOUNT | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 1000000);
+        setComputerHook(computer, computer->L, LUA_MASKCOUNT | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 1000000);
+        setComputerHook(computer, computer->coro, LUA_MASKCOUNT | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 1000000);
+        setComputerHook(computer, L, LUA_MASKCOUNT | LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 1000000);
     }
     return 0;
 }
@@ -41,6 +41,7 @@ private:
     int _deinit(lua_State *L);
     library_t * createDebuggerLibrary();
     static library_t methods;
+    static const peripheral_method_table<debugger> dispatch;
 public:
     struct profile_entry {
         bool running;
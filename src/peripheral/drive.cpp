@@ -229,21 +229,23 @@ drive::~drive() {
     stopAudio(NULL);
 }
 
+const peripheral_method_table<drive> drive::dispatch = {
+    {"isDiskPresent", &drive::isDiskPresent},
+    {"getDiskLabel", &drive::getDiskLabel},
+    {"setDiskLabel", &drive::setDiskLabel},
+    {"hasData", &drive::hasData},
+    {"getMountPath", &drive::getMountPath},
+    {"hasAudio", &drive::hasAudio},
+    {"getAudioTitle", &drive::getAudioTitle},
+    {"playAudio", &drive::playAudio},
+    {"stopAudio", &drive::stopAudio},
+    {"ejectDisk", &drive::ejectDisk},
+    {"getDiskID", &drive::getDiskID},
+    {"insertDisk", &drive::insertDiskMethod}
+};
+
 int drive::call(lua_State *L, const char * method) {
-    const std::string m(method);
-    if (m == "isDiskPresent") return isDiskPresent(L);
-    else if (m == "getDiskLabel") return getDiskLabel(L);
-    else if (m == "setDiskLabel") return setDiskLabel(L);
-    else if (m == "hasData") return hasData(L);
-    else if (m == "getMountPath") return getMountPath(L);
-    else if (m == "hasAudio") return hasAudio(L);
-    else if (m == "getAudioTitle") return getAudioTitle(L);
-    else if (m == "playAudio") return playAudio(L);
-    else if (m == "stopAudio") return stopAudio(L);
-    else if (m == "ejectDisk") return ejectDisk(L);
-    else if (m == "getDiskID") return getDiskID(L);
-    else if (m == "insertDisk") return insertDisk(L);
-    else return 0;
+    return dispatch.call(this, L, method);
 }
 
 static luaL_Reg drive_reg[] = {
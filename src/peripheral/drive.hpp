@@ -47,8 +47,10 @@ private:
     int ejectDisk(lua_State *L);
     int getDiskID(lua_State *L);
     int insertDisk(lua_State *L, bool init = false);
+    int insertDiskMethod(lua_State *L) {return insertDisk(L);} // for the method table, which can't use default arguments
 public:
     static library_t methods;
+    static const peripheral_method_table<drive> dispatch;
     static peripheral * init(lua_State *L, const char * side) {return new drive(L, side);}
     static void deinit(peripheral * p) {delete (drive*)p;}
     destructor getDestructor() const override {return deinit;}
@@ -11,12 +11,153 @@
 #include "../runtime.hpp"
 static std::string modem_message(lua_State *message, void* data);
 #include "modem.hpp"
-#include <list>
+#include <cstring>
+#include <memory>
 #include <unordered_map>
 #include <configuration.hpp>
 #include "../apis.hpp"
+#include "../metrics.hpp"
 
-static std::unordered_map<int, std::list<modem*>> network;
+// Each network keeps an index from port to the modems that have it open, so
+// transmitting only visits modems that are listening. Computers run on their
+// own threads, so the index is guarded by the network's mutex.
+struct modem_network {
+    std::mutex lock;
+    std::unordered_map<uint16_t, std::unordered_set<modem*>> ports;
+};
+
+static std::unordered_map<int, modem_network> networks;
+static std::mutex networksMutex;
+static std::mutex modemMessagesMutex;
+
+// Messages are serialized once when transmitted, and every receiver decodes the
+// same immutable buffer on its own thread. Each value is a tag byte followed by
+// its data: numbers are raw lua_Numbers, strings are a uint32 length + bytes,
+// and tables are uint32 array + hash sizes followed by that many key/value pairs.
+// Tables are numbered in the order they're first written, and any later
+// reference to one (shared subtables or cycles) is written as a reference to
+// that number. Values that can't be copied are converted to strings, like xcopy.
+enum {
+    MODEM_PAYLOAD_NIL,
+    MODEM_PAYLOAD_FALSE,
+    MODEM_PAYLOAD_TRUE,
+    MODEM_PAYLOAD_NUMBER,
+    MODEM_PAYLOAD_STRING,
+    MODEM_PAYLOAD_TABLE,
+    MODEM_PAYLOAD_REF
+};
+
+static void modem_payload_write_string(std::string& out, const char * str, size_t len) {
+    const uint32_t size = (uint32_t)len;
+    out.push_back(MODEM_PAYLOAD_STRING);
+    out.append((const char*)&size, sizeof(size));
+    out.append(str, len);
+}
+
+static void modem_payload_write(lua_State *L, int idx, std::string& out, std::unordered_map<const void*, uint32_t>& tables) {
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL: out.push_back(MODEM_PAYLOAD_NIL); break;
+    case LUA_TBOOLEAN: out.push_back(lua_toboolean(L, idx) ? MODEM_PAYLOAD_TRUE : MODEM_PAYLOAD_FALSE); break;
+    case LUA_TNUMBER: {
+        const lua_Number n = lua_tonumber(L, idx);
+        out.push_back(MODEM_PAYLOAD_NUMBER);
+        out.append((const char*)&n, sizeof(n));
+        break;
+    } case LUA_TSTRING: {
+        size_t len = 0;
+        const char * str = lua_tolstring(L, idx, &len);
+        modem_payload_write_string(out, str, len);
+        break;
+    } case LUA_TTABLE: {
+        const auto ref = tables.find(lua_topointer(L, idx));
+        if (ref != tables.end()) {
+            out.push_back(MODEM_PAYLOAD_REF);
+            out.append((const char*)&ref->second, sizeof(ref->second));
+            break;
+        }
+        const uint32_t id = (uint32_t)tables.size() + 1;
+        tables[lua_topointer(L, idx)] = id;
+        luaL_checkstack(L, 3, "table is too deep to transmit");
+        if (idx < 0) idx = lua_gettop(L) + idx + 1;
+        out.push_back(MODEM_PAYLOAD_TABLE);
+        const size_t header = out.size();
+        out.append(2 * sizeof(uint32_t), '\0');
+        uint32_t count = 0;
+        lua_pushnil(L);
+        while (lua_next(L, idx) != 0) {
+            modem_payload_write(L, -2, out, tables);
+            modem_payload_write(L, -1, out, tables);
+            lua_pop(L, 1);
+            count++;
+        }
+        const uint32_t narr = min((uint32_t)lua_objlen(L, idx), count), nrec = count - narr;
+        memcpy(&out[header], &narr, sizeof(narr));
+        memcpy(&out[header + sizeof(narr)], &nrec, sizeof(nrec));
+        break;
+    } default: {
+        if (!luaL_callmeta(L, idx, "__tostring")) lua_pushfstring(L, "<%s: %p>", lua_typename(L, lua_type(L, idx)), lua_topointer(L, idx));
+        size_t len = 0;
+        const char * str = lua_tolstring(L, -1, &len);
+        if (str) modem_payload_write_string(out, str, len);
+        else modem_payload_write_string(out, "", 0);
+        lua_pop(L, 1);
+        break;
+    }
+    }
+}
+
+static std::shared_ptr<const std::string> modem_payload_encode(lua_State *L, int idx) {
+    std::shared_ptr<std::string> out = std::make_shared<std::string>();
+    std::unordered_map<const void*, uint32_t> tables;
+    modem_payload_write(L, idx, *out, tables);
+    return out;
+}
+
+// Pushes the value at pos onto L and advances pos past it. Decoded tables are
+// stored in the table at the (absolute) index memo so references can find them.
+// Returns false if the stack can't grow enough for the nesting; L is left
+// with extra values on it then, which the caller has to clear.
+static bool modem_payload_decode(lua_State *L, const char *& pos, int memo, uint32_t& ntables) {
+    switch ((uint8_t)*pos++) {
+    case MODEM_PAYLOAD_FALSE: lua_pushboolean(L, false); break;
+    case MODEM_PAYLOAD_TRUE: lua_pushboolean(L, true); break;
+    case MODEM_PAYLOAD_NUMBER: {
+        lua_Number n;
+        memcpy(&n, pos, sizeof(n));
+        pos += sizeof(n);
+        lua_pushnumber(L, n);
+        break;
+    } case MODEM_PAYLOAD_STRING: {
+        uint32_t len;
+        memcpy(&len, pos, sizeof(len));
+        pos += sizeof(len);
+        lua_pushlstring(L, pos, len);
+        pos += len;
+        break;
+    } case MODEM_PAYLOAD_TABLE: {
+        uint32_t narr, nrec;
+        memcpy(&narr, pos, sizeof(narr));
+        memcpy(&nrec, pos + sizeof(narr), sizeof(nrec));
+        pos += sizeof(narr) + sizeof(nrec);
+        if (!lua_checkstack(L, 3)) return false;
+        lua_createtable(L, (int)narr, (int)nrec);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, memo, ++ntables);
+        for (uint32_t i = narr + nrec; i > 0; i--) {
+            if (!modem_payload_decode(L, pos, memo, ntables) || !modem_payload_decode(L, pos, memo, ntables)) return false;
+            lua_rawset(L, -3);
+        }
+        break;
+    } case MODEM_PAYLOAD_REF: {
+        uint32_t id;
+        memcpy(&id, pos, sizeof(id));
+        pos += sizeof(id);
+        lua_rawgeti(L, memo, id);
+        break;
+    } default: lua_pushnil(L); break;
+    }
+    return true;
+}
 
 // todo: probably check port range
 
@@ -29,19 +170,36 @@ int modem::isOpen(lua_State *L) {
 int modem::open(lua_State *L) {
     lastCFunction = __func__;
     luaL_checknumber(L, 1); // argument error > too many open channels
+    const uint16_t port = (uint16_t)lua_tointeger(L, 1);
+    if (openPorts.find(port) != openPorts.end()) return 0;
     if (openPorts.size() >= (size_t)config.maxOpenPorts) luaL_error(L, "Too many open channels");
-    openPorts.insert((uint16_t)lua_tointeger(L, 1));
+    openPorts.insert(port);
+    std::lock_guard<std::mutex> lock(network->lock);
+    network->ports[port].insert(this);
     return 0;
 }
 
+void modem::closePort(uint16_t port) {
+    auto it = network->ports.find(port);
+    if (it == network->ports.end()) return;
+    it->second.erase(this);
+    if (it->second.empty()) network->ports.erase(it);
+}
+
 int modem::close(lua_State *L) {
     lastCFunction = __func__;
-    openPorts.erase((uint16_t)luaL_checkinteger(L, 1));
+    const uint16_t port = (uint16_t)luaL_checkinteger(L, 1);
+    if (openPorts.erase(port)) {
+        std::lock_guard<std::mutex> lock(network->lock);
+        closePort(port);
+    }
     return 0;
 }
 
 int modem::closeAll(lua_State *L) {
     lastCFunction = __func__;
+    std::lock_guard<std::mutex> lock(network->lock);
+    for (uint16_t port : openPorts) closePort(port);
     openPorts.clear();
     return 0;
 }
@@ -52,34 +210,20 @@ int modem::transmit(lua_State *L) {
     luaL_checkany(L, 3);
     lua_settop(L, 3);
     const uint16_t port = (uint16_t)luaL_checkinteger(L, 1);
-    std::lock_guard<std::mutex> lock(eventQueueMutex);
-    if (!idsToDelete.empty()) {
-        for (int i : idsToDelete) {
-            lua_pushinteger(eventQueue, i);
-            lua_pushnil(eventQueue);
-            lua_settable(eventQueue, 1);
-        }
-        idsToDelete.clear();
-    }
-    const int id = (int)lua_objlen(eventQueue, 1) + 1;
-    int * refc = new int(0);
-    lua_pushinteger(eventQueue, id);
-    lua_newtable(eventQueue);
-    lua_pushlightuserdata(eventQueue, refc);
-    lua_setfield(eventQueue, -2, "refcount");
-    lua_xmove(L, eventQueue, 1);
-    lua_setfield(eventQueue, -2, "data");
-    lua_settable(eventQueue, 1);
-    for (modem* m : network[netID]) if (m != this && m->openPorts.find(port) != m->openPorts.end()) {
-        m->receive(port, (uint16_t)lua_tointeger(L, 2), id, this);
-        (*refc)++;
-    }
-    if (*refc == 0) {
-        lua_pushinteger(eventQueue, id);
-        lua_pushnil(eventQueue);
-        lua_settable(eventQueue, 1);
-        delete refc;
+    const uint16_t replyPort = (uint16_t)lua_tointeger(L, 2);
+    countMetric(comp, &ComputerMetrics::modemMessages);
+    bool listening;
+    {
+        std::lock_guard<std::mutex> lock(network->lock);
+        auto it = network->ports.find(port);
+        listening = it != network->ports.end() && (it->second.size() > 1 || it->second.find(this) == it->second.end());
     }
+    // only serialize once somebody is actually listening; this can raise Lua errors, so the lock can't be held
+    if (!listening) return 0;
+    std::shared_ptr<const std::string> payload = modem_payload_encode(L, 3);
+    std::lock_guard<std::mutex> lock(network->lock);
+    auto it = network->ports.find(port);
+    if (it != network->ports.end()) for (modem* m : it->second) if (m != this) m->receive(port, replyPort, payload);
     return 0;
 }
 
@@ -134,102 +278,89 @@ int modem::callRemote(lua_State *L) {
 
 struct modem_message_data {
     modem * m;
-    modem * sender;
-    int id;
+    std::shared_ptr<const std::string> payload;
     uint16_t port;
     uint16_t replyPort;
 };
 
 static std::string modem_message(lua_State *message, void* data) {
     struct modem_message_data * d = (modem_message_data*)data;
-    if (d->sender == NULL) {
-        fprintf(stderr, "Modem message event is missing sender, skipping event");
-        delete d;
-        return NULL;
+    std::string side;
+    {
+        // the receiving modem may have been detached while the event was queued
+        std::lock_guard<std::mutex> lock(modemMessagesMutex);
+        if (d->m == NULL) {
+            delete d;
+            return "";
+        }
+        d->m->modemMessages.erase((void*)d);
+        side = d->m->side;
     }
-    lua_pushstring(message, d->m->side.c_str());
+    const int top = lua_gettop(message);
+    lua_pushstring(message, side.c_str());
     lua_pushinteger(message, d->port);
     lua_pushinteger(message, d->replyPort);
-    std::lock_guard<std::mutex> lock(d->sender->eventQueueMutex);
-    lua_pushinteger(d->sender->eventQueue, d->id);
-    lua_gettable(d->sender->eventQueue, 1);
-    if (lua_isnil(d->sender->eventQueue, -1)) {
-        fprintf(stderr, "Missing event data for id %d\n", d->id);
+    const char * pos = d->payload->data();
+    uint32_t ntables = 0;
+    lua_newtable(message);
+    if (!modem_payload_decode(message, pos, lua_gettop(message), ntables)) {
+        // the message is nested too deeply for this computer, so it's dropped
+        lua_settop(message, top);
         delete d;
-        return NULL;
+        return "";
     }
-    lua_getfield(d->sender->eventQueue, -1, "data");
-    xcopy(d->sender->eventQueue, message, 1);
-    lua_pop(d->sender->eventQueue, 1);
-    lua_getfield(d->sender->eventQueue, -1, "refcount");
-    int * refc = (int*)lua_touserdata(d->sender->eventQueue, -1);
-    lua_pop(d->sender->eventQueue, 2);
-    if (!--(*refc)) {
-        delete refc;
-        d->sender->idsToDelete.insert(d->id);
-    }
-    d->m->modemMessages.erase((void*)d);
+    lua_remove(message, -2);
     delete d;
     lua_pushinteger(message, 0);
     return "modem_message";
 };
 
-void modem::receive(uint16_t port, uint16_t replyPort, int id, modem * sender) {
+void modem::receive(uint16_t port, uint16_t replyPort, const std::shared_ptr<const std::string>& payload) {
     struct modem_message_data * d = new struct modem_message_data;
-    d->id = id;
+    d->payload = payload;
     d->port = port;
     d->replyPort = replyPort;
     d->m = this;
-    d->sender = sender;
-    modemMessages.insert((void*)d);
+    {
+        std::lock_guard<std::mutex> lock(modemMessagesMutex);
+        modemMessages.insert((void*)d);
+    }
     queueEvent(comp, modem_message, d);
 }
 
 modem::modem(lua_State *L, const char * side) {
     if (lua_isnumber(L, 3)) netID = (int)lua_tointeger(L, 3);
     comp = get_comp(L);
-    eventQueue = lua_newthread(comp->L);
-    lua_newtable(eventQueue);
     this->side = side;
-    if (network.find(netID) == network.end()) network[netID] = std::list<modem*>();
-    network[netID].push_back(this);
-}
-
-void modem::reinitialize(lua_State *L) {
-    // eventQueue should be freed and inaccessible since the Lua state was closed
-    eventQueue = lua_newthread(L);
-    lua_newtable(eventQueue);
+    std::lock_guard<std::mutex> lock(networksMutex);
+    network = &networks[netID];
 }
 
 modem::~modem() {
-    for (std::list<modem*>::iterator it = network[netID].begin(); it != network[netID].end(); ++it) {if (*it == this) {network[netID].erase(it); return;}}
-    std::lock_guard<std::mutex> lock(eventQueueMutex);
-    for (void* d : modemMessages) {
-        ((modem_message_data*)d)->sender = NULL;
-        lua_pushinteger(eventQueue, ((modem_message_data*)d)->id);
-        lua_gettable(eventQueue, 1);
-        lua_getfield(eventQueue, -1, "refcount");
-        delete (int*)lua_touserdata(eventQueue, -1);
-        lua_pop(eventQueue, 2);
+    {
+        std::lock_guard<std::mutex> lock(network->lock);
+        for (uint16_t port : openPorts) closePort(port);
     }
-    lua_pop(eventQueue, 1);
-    for (int i = 1; i < lua_gettop(comp->L); i++) if (lua_type(comp->L, i) == LUA_TTHREAD && lua_tothread(comp->L, i) == eventQueue) lua_remove(comp->L, i--);
+    std::lock_guard<std::mutex> lock(modemMessagesMutex);
+    for (void* d : modemMessages) ((modem_message_data*)d)->m = NULL;
 }
 
+const peripheral_method_table<modem> modem::dispatch = {
+    {"isOpen", &modem::isOpen},
+    {"open", &modem::open},
+    {"close", &modem::close},
+    {"closeAll", &modem::closeAll},
+    {"transmit", &modem::transmit},
+    {"isWireless", &modem::isWireless},
+    {"getNamesRemote", &modem::getNamesRemote},
+    {"getTypeRemote", &modem::getTypeRemote},
+    {"isPresentRemote", &modem::isPresentRemote},
+    {"getMethodsRemote", &modem::getMethodsRemote},
+    {"callRemote", &modem::callRemote}
+};
+
 int modem::call(lua_State *L, const char * method) {
-    const std::string m(method);
-    if (m == "isOpen") return isOpen(L);
-    else if (m == "open") return open(L);
-    else if (m == "close") return close(L);
-    else if (m == "closeAll") return closeAll(L);
-    else if (m == "transmit") return transmit(L);
-    else if (m == "isWireless") return isWireless(L);
-    else if (m == "getNamesRemote") return getNamesRemote(L);
-    else if (m == "getTypeRemote") return getTypeRemote(L);
-    else if (m == "isPresentRemote") return isPresentRemote(L);
-    else if (m == "getMethodsRemote") return getMethodsRemote(L);
-    else if (m == "callRemote") return callRemote(L);
-    else return 0;
+    return dispatch.call(this, L, method);
 }
 
 static luaL_Reg modem_reg[] = {
@@ -10,21 +10,23 @@
 
 #ifndef PERIPHERAL_MODEM_HPP
 #define PERIPHERAL_MODEM_HPP
+#include <memory>
 #include <mutex>
+#include <string>
 #include <unordered_set>
 #include <peripheral.hpp>
 
+struct modem_network;
+
 class modem: public peripheral {
 private:
     friend std::string modem_message(lua_State *, void*);
     std::unordered_set<uint16_t> openPorts;
-    std::unordered_set<void*> modemMessages;
+    std::unordered_set<void*> modemMessages; // pending events, guarded by modemMessagesMutex
     Computer * comp;
-    lua_State * eventQueue;
-    std::mutex eventQueueMutex;
-    std::unordered_set<int> idsToDelete;
     std::string side;
     int netID = 0;
+    modem_network * network;
     int isOpen(lua_State *L);
     int open(lua_State *L);
     int close(lua_State *L);
@@ -36,9 +38,11 @@ private:
     int isPresentRemote(lua_State *L);
     int getMethodsRemote(lua_State *L);
     int callRemote(lua_State *L);
-    void receive(uint16_t port, uint16_t replyPort, int id, modem * sender);
+    void closePort(uint16_t port); // network->lock must be held
+    void receive(uint16_t port, uint16_t replyPort, const std::shared_ptr<const std::string>& payload);
 public:
     static library_t methods;
+    static const peripheral_method_table<modem> dispatch;
     static peripheral * init(lua_State *L, const char * side) {return new modem(L, side);}
     static void deinit(peripheral * p) {delete (modem*)p;}
     destructor getDestructor() const override {return deinit;}
@@ -46,7 +50,6 @@ public:
     modem(lua_State *L, const char * side);
     ~modem();
     int call(lua_State *L, const char * method) override;
-    void reinitialize(lua_State *L) override;
 };
 
 #endif
\ No newline at end of file
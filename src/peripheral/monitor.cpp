@@ -15,6 +15,7 @@
 #include "../terminal/RawTerminal.hpp"
 #include "../terminal/TRoRTerminal.hpp"
 #include "../terminal/HardwareSDLTerminal.hpp"
+#include "../terminal/OffscreenTerminal.hpp"
 
 monitor::monitor(lua_State *L, const char * side) {
 #ifndef NO_CLI
@@ -31,7 +32,7 @@ monitor::monitor(lua_State *L, const char * side) {
         term = (HardwareSDLTerminal*)queueTask([ ](void* side)->void* {
             return new HardwareSDLTerminal("CraftOS Terminal: Monitor " + std::string((const char*)side));
         }, (void*)side);
-    } else throw std::invalid_argument("Monitors are not available in headless mode");
+    } else term = new OffscreenTerminal("CraftOS Terminal: Monitor " + std::string(side));
     term->canBlink = false;
 }
 
@@ -39,24 +40,25 @@ monitor::~monitor() {delete term;}
 
 int monitor::write(lua_State *L) {
     lastCFunction = __func__;
-    if (selectedRenderer == 4) printf("TW:%d;%s\n", term->id, luaL_checkstring(L, 1));
+    if (selectedRenderer == 4) {
+        size_t len = 0;
+        const char * text = luaL_checklstring(L, 1, &len);
+        ((TRoRTerminal*)term)->queueWrite(text, len);
+    }
     if (term->blinkY < 0 || (term->blinkX >= 0 && (unsigned)term->blinkX >= term->width) || (unsigned)term->blinkY >= term->height) return 0;
     size_t str_sz;
     const char * str = luaL_checklstring(L, 1, &str_sz);
     std::lock_guard<std::mutex> lock(term->locked);
-    for (unsigned i = 0; i < str_sz && (term->blinkX < 0 || (unsigned)term->blinkX < term->width); i++, term->blinkX++) {
-        if (term->blinkX >= 0) {
-            term->screen[term->blinkY][term->blinkX] = str[i];
-            term->colors[term->blinkY][term->blinkX] = colors;
-        }
-    }
+    term->screen.write_run(term->blinkX, term->blinkY, (const unsigned char*)str, str_sz);
+    term->colors.fill_run(term->blinkX, term->blinkY, colors, str_sz);
+    term->blinkX = (int)min<long long>((long long)term->blinkX + str_sz, term->width);
     term->changed = true;
     return 0;
 }
 
 int monitor::scroll(lua_State *L) {
     lastCFunction = __func__;
-    if (selectedRenderer == 4) printf("TS:%d;%d\n", term->id, (int)luaL_checkinteger(L, 1));
+    if (selectedRenderer == 4) ((TRoRTerminal*)term)->queuePacket("TS", "%d", (int)luaL_checkinteger(L, 1));
     const int lines = (int)luaL_checkinteger(L, 1);
     std::lock_guard<std::mutex> lock(term->locked);
     if (lines > 0 ? (unsigned)lines >= term->height : (unsigned)-lines >= term->height) {
@@ -80,7 +82,7 @@ int monitor::scroll(lua_State *L) {
 
 int monitor::setCursorPos(lua_State *L) {
     lastCFunction = __func__;
-    if (selectedRenderer == 4) printf("TC:%d;%d,%d\n", term->id, (int)luaL_checkinteger(L, 1), (int)luaL_checkinteger(L, 2));
+    if (selectedRenderer == 4) ((TRoRTerminal*)term)->queuePacket("TC", "%d,%d", (int)luaL_checkinteger(L, 1), (int)luaL_checkinteger(L, 2));
     const int x = (int)luaL_checkinteger(L, 1);
     const int y = (int)luaL_checkinteger(L, 2);
     std::lock_guard<std::mutex> lock(term->locked);
@@ -94,7 +96,7 @@ int monitor::setCursorBlink(lua_State *L) {
     luaL_checktype(L, 1, LUA_TBOOLEAN);
     std::lock_guard<std::mutex> lock(term->locked);
     term->canBlink = lua_toboolean(L, 1);
-    if (selectedRenderer == 4) printf("TB:%d;%s\n", term->id, lua_toboolean(L, 1) ? "true" : "false");
+    if (selectedRenderer == 4) ((TRoRTerminal*)term)->queuePacket("TB", "%s", lua_toboolean(L, 1) ? "true" : "false");
     return 0;
 }
 
@@ -125,7 +127,7 @@ int monitor::getSize(lua_State *L) {
 
 int monitor::clear(lua_State *L) {
     lastCFunction = __func__;
-    if (selectedRenderer == 4) printf("TE:%d;\n", term->id);
+    if (selectedRenderer == 4) ((TRoRTerminal*)term)->queuePacket("TE", "");
     std::lock_guard<std::mutex> lock(term->locked);
     if (term->mode > 0) {
         memset(term->pixels.data(), 0x0F, term->width * Terminal::fontWidth * term->height * Terminal::fontHeight);
@@ -139,7 +141,7 @@ int monitor::clear(lua_State *L) {
 
 int monitor::clearLine(lua_State *L) {
     lastCFunction = __func__;
-    if (selectedRenderer == 4) printf("TL:%d;\n", term->id);
+    if (selectedRenderer == 4) ((TRoRTerminal*)term)->queuePacket("TL", "");
     if (term->blinkY < 0 || (unsigned)term->blinkY >= term->height) return 0;
     std::lock_guard<std::mutex> lock(term->locked);
     memset(term->screen.data() + (term->blinkY * term->width), ' ', term->width);
@@ -151,7 +153,7 @@ int monitor::clearLine(lua_State *L) {
 int monitor::setTextColor(lua_State *L) {
     lastCFunction = __func__;
     if (selectedRenderer == 4 && luaL_checkinteger(L, 1) >= 0 && luaL_checkinteger(L, 1) < 16)
-        printf("TF:%d;%c\n", term->id, ("0123456789abcdef")[lua_tointeger(L, 1)]);
+        ((TRoRTerminal*)term)->queueTextColor((int)lua_tointeger(L, 1));
     const int c = log2i((int)luaL_checkinteger(L, 1));
     if (c < 0 || c > 15) return luaL_error(L, "bad argument #1 (invalid color %d)", c);
     colors = (colors & 0xf0) | c;
@@ -162,7 +164,7 @@ int monitor::setTextColor(lua_State *L) {
 int monitor::setBackgroundColor(lua_State *L) {
     lastCFunction = __func__;
     if (selectedRenderer == 4 && luaL_checkinteger(L, 1) >= 0 && luaL_checkinteger(L, 1) < 16)
-        printf("TK:%d;%c\n", term->id, ("0123456789abcdef")[lua_tointeger(L, 1)]);
+        ((TRoRTerminal*)term)->queueBackgroundColor((int)lua_tointeger(L, 1));
     const int c = log2i((int)luaL_checkinteger(L, 1));
     if (c < 0 || c > 15) return luaL_error(L, "bad argument #1 (invalid color %d)", c);
     colors = (colors & 0x0f) | (c << 4);
@@ -196,14 +198,23 @@ int monitor::blit(lua_State *L) {
     if (str_sz != fg_sz || fg_sz != bg_sz) luaL_error(L, "Arguments must be the same length");
     if (term->blinkY < 0 || (term->blinkX >= 0 && (unsigned)term->blinkX >= term->width) || (unsigned)term->blinkY >= term->height) return 0;
     std::lock_guard<std::mutex> lock(term->locked);
-    for (unsigned i = 0; i < str_sz && (term->blinkX < 0 || (unsigned)term->blinkX < term->width); i++, term->blinkX++) {
-        colors = htoi(bg[i]) << 4 | htoi(fg[i]);
-        if (dynamic_cast<SDLTerminal*>(term) != NULL) dynamic_cast<SDLTerminal*>(term)->cursorColor = htoi(fg[i]);
-        if (selectedRenderer == 4)
-            printf("TF:%d;%c\nTK:%d;%c\nTW:%d;%c\n", term->id, ("0123456789abcdef")[colors & 0xf], term->id, ("0123456789abcdef")[colors >> 4], term->id, str[i]);
-        term->screen[term->blinkY][term->blinkX] = str[i];
-        term->colors[term->blinkY][term->blinkX] = colors;
+    // characters left of the screen are skipped, and the cursor stops at the right edge
+    const size_t start = term->blinkX < 0 ? min<size_t>((size_t)-(long long)term->blinkX, str_sz) : 0;
+    const size_t end = min<long long>((long long)term->width - term->blinkX, str_sz);
+    const unsigned char * hex = htoiTable();
+    unsigned char * colorRow = term->colors.row_data(term->blinkY);
+    for (size_t i = start; i < end; i++) {
+        colors = hex[(unsigned char)bg[i]] << 4 | hex[(unsigned char)fg[i]];
+        if (selectedRenderer == 4) {
+            ((TRoRTerminal*)term)->queueTextColor(colors & 0xf);
+            ((TRoRTerminal*)term)->queueBackgroundColor(colors >> 4);
+            ((TRoRTerminal*)term)->queueWrite(&str[i], 1);
+        }
+        colorRow[term->blinkX + (long long)i] = colors;
     }
+    term->screen.write_run(term->blinkX, term->blinkY, (const unsigned char*)str, str_sz);
+    if (end > start && dynamic_cast<SDLTerminal*>(term) != NULL) dynamic_cast<SDLTerminal*>(term)->cursorColor = colors & 0x0F;
+    term->blinkX += (int)end;
     term->changed = true;
     return 0;
 }
@@ -243,7 +254,7 @@ int monitor::setPaletteColor(lua_State *L) {
         term->palette[color].b = (int)(lua_tonumber(L, 4) * 255);
     }
     if (selectedRenderer == 4 && color < 16) 
-        printf("TM:%d;%d,%f,%f,%f\n", term->id, color, term->palette[color].r / 255.0, term->palette[color].g / 255.0, term->palette[color].b / 255.0);
+        ((TRoRTerminal*)term)->queuePacket("TM", "%d,%f,%f,%f", color, term->palette[color].r / 255.0, term->palette[color].g / 255.0, term->palette[color].b / 255.0);
     term->changed = true;
     return 0;
 }
@@ -251,7 +262,7 @@ int monitor::setPaletteColor(lua_State *L) {
 int monitor::setGraphicsMode(lua_State *L) {
     lastCFunction = __func__;
     if (!lua_isnumber(L, 1) && !lua_isboolean(L, 1)) luaL_typerror(L, 1, "number");
-    if (selectedRenderer == 1 || selectedRenderer == 2) return 0;
+    if (selectedRenderer == 2) return 0;
     if (lua_isnumber(L, 1) && (lua_tointeger(L, 1) < 0 || lua_tointeger(L, 1) > 2)) return luaL_error(L, "bad argument %1 (invalid mode %d)", lua_tointeger(L, 1));
     std::lock_guard<std::mutex> lock(term->locked);
     term->mode = lua_isboolean(L, 1) ? (lua_toboolean(L, 1) ? 1 : 0) : (int)lua_tointeger(L, 1);
@@ -261,7 +272,7 @@ int monitor::setGraphicsMode(lua_State *L) {
 
 int monitor::getGraphicsMode(lua_State *L) {
     lastCFunction = __func__;
-    if (selectedRenderer == 1 || selectedRenderer == 2) {
+    if (selectedRenderer == 2) {
         lua_pushboolean(L, false);
         return 1;
     }
@@ -273,7 +284,7 @@ int monitor::getGraphicsMode(lua_State *L) {
 int monitor::setPixel(lua_State *L) {
     lastCFunction = __func__;
     luaL_checkinteger(L, 3);
-    if (selectedRenderer == 1 || selectedRenderer == 2) return 0;
+    if (selectedRenderer == 2) return 0;
     const int x = (int)luaL_checkinteger(L, 1);
     const int y = (int)luaL_checkinteger(L, 2);
     const int color = term->mode == 1 ? log2i((int)lua_tointeger(L, 3)) : (int)lua_tointeger(L, 3);
@@ -287,7 +298,7 @@ int monitor::setPixel(lua_State *L) {
 
 int monitor::getPixel(lua_State *L) {
     lastCFunction = __func__;
-    if (selectedRenderer == 1 || selectedRenderer == 2) return 0;
+    if (selectedRenderer == 2) return 0;
     const int x = (int)luaL_checkinteger(L, 1);
     const int y = (int)luaL_checkinteger(L, 2);
     if (x < 0 || y < 0 || (unsigned)x >= term->width * Terminal::fontWidth || (unsigned)y >= term->height * Terminal::fontHeight) lua_pushnil(L);
@@ -526,6 +537,12 @@ int monitor::getPixels(lua_State* L) {
 
 int monitor::screenshot(lua_State *L) {
     lastCFunction = __func__;
+    OffscreenTerminal * offscreen = dynamic_cast<OffscreenTerminal*>(this->term);
+    if (offscreen != NULL) {
+        // headless screenshots are written right away, since there's no render to wait for
+        if (!lua_toboolean(L, 1)) offscreen->screenshot();
+        return 0;
+    }
     if (selectedRenderer != 0 && selectedRenderer != 5) return 0;
     SDLTerminal * term = dynamic_cast<SDLTerminal*>(this->term);
     if (term == NULL) return 0;
@@ -537,6 +554,37 @@ int monitor::screenshot(lua_State *L) {
     return 0;
 }
 
+// Recording and raw export are only available for headless monitors, which have no window to do it from.
+int monitor::record(lua_State *L) {
+    lastCFunction = __func__;
+    OffscreenTerminal * offscreen = dynamic_cast<OffscreenTerminal*>(this->term);
+    if (offscreen != NULL) offscreen->record();
+    return 0;
+}
+
+int monitor::stopRecording(lua_State *L) {
+    lastCFunction = __func__;
+    OffscreenTerminal * offscreen = dynamic_cast<OffscreenTerminal*>(this->term);
+    if (offscreen != NULL) offscreen->stopRecording();
+    return 0;
+}
+
+int monitor::isRecording(lua_State *L) {
+    lastCFunction = __func__;
+    OffscreenTerminal * offscreen = dynamic_cast<OffscreenTerminal*>(this->term);
+    lua_pushboolean(L, offscreen != NULL && offscreen->isRecording());
+    return 1;
+}
+
+int monitor::exportRaw(lua_State *L) {
+    lastCFunction = __func__;
+    OffscreenTerminal * offscreen = dynamic_cast<OffscreenTerminal*>(this->term);
+    if (offscreen == NULL) return 0;
+    const std::string data = offscreen->exportRaw();
+    lua_pushlstring(L, data.data(), data.size());
+    return 1;
+}
+
 int monitor::setFrozen(lua_State *L) {
     lastCFunction = __func__;
     if (!lua_isboolean(L, 1)) luaL_typerror(L, 1, "boolean");
@@ -553,43 +601,49 @@ int monitor::getFrozen(lua_State *L) {
     return 1;
 }
 
+const peripheral_method_table<monitor> monitor::dispatch = {
+    {"write", &monitor::write},
+    {"scroll", &monitor::scroll},
+    {"setCursorPos", &monitor::setCursorPos},
+    {"setCursorBlink", &monitor::setCursorBlink},
+    {"getCursorPos", &monitor::getCursorPos},
+    {"getSize", &monitor::getSize},
+    {"clear", &monitor::clear},
+    {"clearLine", &monitor::clearLine},
+    {"setTextColour", &monitor::setTextColor},
+    {"setTextColor", &monitor::setTextColor},
+    {"setBackgroundColour", &monitor::setBackgroundColor},
+    {"setBackgroundColor", &monitor::setBackgroundColor},
+    {"isColour", &monitor::isColor},
+    {"isColor", &monitor::isColor},
+    {"getTextColour", &monitor::getTextColor},
+    {"getTextColor", &monitor::getTextColor},
+    {"getBackgroundColour", &monitor::getBackgroundColor},
+    {"getBackgroundColor", &monitor::getBackgroundColor},
+    {"blit", &monitor::blit},
+    {"getPaletteColor", &monitor::getPaletteColor},
+    {"getPaletteColour", &monitor::getPaletteColor},
+    {"setPaletteColor", &monitor::setPaletteColor},
+    {"setPaletteColour", &monitor::setPaletteColor},
+    {"setGraphicsMode", &monitor::setGraphicsMode},
+    {"getGraphicsMode", &monitor::getGraphicsMode},
+    {"setPixel", &monitor::setPixel},
+    {"getPixel", &monitor::getPixel},
+    {"setTextScale", &monitor::setTextScale},
+    {"getTextScale", &monitor::getTextScale},
+    {"drawPixels", &monitor::drawPixels},
+    {"getPixels", &monitor::getPixels},
+    {"screenshot", &monitor::screenshot},
+    {"record", &monitor::record},
+    {"stopRecording", &monitor::stopRecording},
+    {"isRecording", &monitor::isRecording},
+    {"exportRaw", &monitor::exportRaw},
+    {"setFrozen", &monitor::setFrozen},
+    {"getFrozen", &monitor::getFrozen}
+};
+
 int monitor::call(lua_State *L, const char * method) {
-    std::string m(method);
-    if (m == "write") return write(L);
-    else if (m == "scroll") return scroll(L);
-    else if (m == "setCursorPos") return setCursorPos(L);
-    else if (m == "setCursorBlink") return setCursorBlink(L);
-    else if (m == "getCursorPos") return getCursorPos(L);
-    else if (m == "getSize") return getSize(L);
-    else if (m == "clear") return clear(L);
-    else if (m == "clearLine") return clearLine(L);
-    else if (m == "setTextColour") return setTextColor(L);
-    else if (m == "setTextColor") return setTextColor(L);
-    else if (m == "setBackgroundColour") return setBackgroundColor(L);
-    else if (m == "setBackgroundColor") return setBackgroundColor(L);
-    else if (m == "isColour") return isColor(L);
-    else if (m == "isColor") return isColor(L);
-    else if (m == "getTextColour") return getTextColor(L);
-    else if (m == "getTextColor") return getTextColor(L);
-    else if (m == "getBackgroundColour") return getBackgroundColor(L);
-    else if (m == "getBackgroundColor") return getBackgroundColor(L);
-    else if (m == "blit") return blit(L);
-    else if (m == "getPaletteColor") return getPaletteColor(L);
-    else if (m == "getPaletteColour") return getPaletteColor(L);
-    else if (m == "setPaletteColor") return setPaletteColor(L);
-    else if (m == "setPaletteColour") return setPaletteColor(L);
-    else if (m == "setGraphicsMode") return setGraphicsMode(L);
-    else if (m == "getGraphicsMode") return getGraphicsMode(L);
-    else if (m == "setPixel") return setPixel(L);
-    else if (m == "getPixel") return getPixel(L);
-    else if (m == "setTextScale") return setTextScale(L);
-    else if (m == "getTextScale") return getTextScale(L);
-    else if (m == "drawPixels") return drawPixels(L);
-    else if (m == "getPixels") return getPixels(L);
-    else if (m == "screenshot") return screenshot(L);
-    else if (m == "setFrozen") return setFrozen(L);
-    else if (m == "getFrozen") return getFrozen(L);
-    else return 0;
+    return dispatch.call(this, L, method);
 }
 
 static luaL_Reg monitor_reg[] = {
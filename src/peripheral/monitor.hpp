@@ -47,11 +47,16 @@ private:
     int drawPixels(lua_State *L);
     int getPixels(lua_State *L);
     int screenshot(lua_State *L);
+    int record(lua_State *L);
+    int stopRecording(lua_State *L);
+    int isRecording(lua_State *L);
+    int exportRaw(lua_State *L);
     int setFrozen(lua_State *L);
     int getFrozen(lua_State *L);
 public:
     Terminal * term;
     static library_t methods;
+    static const peripheral_method_table<monitor> dispatch;
     static peripheral * init(lua_State *L, const char * side) {return new monitor(L, side);}
     static void deinit(peripheral * p) {delete (monitor*)p;}
     destructor getDestructor() const override {return deinit;}
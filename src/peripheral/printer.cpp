@@ -277,18 +277,20 @@ int printer::getPaperLevel(lua_State *L) {
     return 1;
 }
 
+const peripheral_method_table<printer> printer::dispatch = {
+    {"write", &printer::write},
+    {"setCursorPos", &printer::setCursorPos},
+    {"getCursorPos", &printer::getCursorPos},
+    {"getPageSize", &printer::getPageSize},
+    {"newPage", &printer::newPage},
+    {"endPage", &printer::endPage},
+    {"getInkLevel", &printer::getInkLevel},
+    {"setPageTitle", &printer::setPageTitle},
+    {"getPaperLevel", &printer::getPaperLevel}
+};
+
 int printer::call(lua_State *L, const char * method) {
-    const std::string m(method);
-    if (m == "write") return write(L);
-    else if (m == "setCursorPos") return setCursorPos(L);
-    else if (m == "getCursorPos") return getCursorPos(L);
-    else if (m == "getPageSize") return getPageSize(L);
-    else if (m == "newPage") return newPage(L);
-    else if (m == "endPage") return endPage(L);
-    else if (m == "getInkLevel") return getInkLevel(L);
-    else if (m == "setPageTitle") return setPageTitle(L);
-    else if (m == "getPaperLevel") return getPaperLevel(L);
-    else return 0;
+    return dispatch.call(this, L, method);
 }
 
 static luaL_Reg printer_reg[] = {
@@ -158,6 +158,7 @@
 class printer: public peripheral {
 private:
     static library_t methods;
+    static const peripheral_method_table<printer> dispatch;
     static const int width = 25;
     static const int height = 21;
 #if PRINT_TYPE == PRINT_TYPE_PDF
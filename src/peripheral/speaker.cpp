@@ -11,7 +11,9 @@
 #ifndef NO_MIXER
 #include <cmath>
 #include <algorithm>
+#include <array>
 #include <fstream>
+#include <mutex>
 #include <random>
 #include <configuration.hpp>
 #include <dirent.h>
@@ -20,6 +22,7 @@
 #include "../platform.hpp"
 #include "../runtime.hpp"
 #include "speaker.hpp"
+#include "speaker_mixer.hpp"
 
 #ifndef MIX_INIT_MID
 #define MIX_INIT_MID 0
@@ -259,10 +262,70 @@ static std::mt19937 RNG;
 static Mix_Music * currentlyPlayingMusic = NULL;
 static speaker * musicSpeaker = NULL;
 
+// Note samples are resampled once per (instrument, pitch) and kept until exit.
+// Each playing note gets its own Mix_Chunk header pointing at the cached samples
+// with allocated = 0, so channelFinished can free it without touching the cache.
+static std::unordered_map<std::string, std::array<Mix_Chunk*, 25> > noteCache;
+static std::mutex noteCacheLock;
+static std::mutex channelLock;
+static const int channelPoolGrowth = 16;
+// Set when --audio-output is used; notes and sounds then go to the software mixer instead of SDL_mixer channels.
+static SpeakerMixer * softwareMixer = NULL;
+path_t speakerOutputPath;
+
 static void musicFinished() { if (currentlyPlayingMusic != NULL) { Mix_FreeMusic(currentlyPlayingMusic); currentlyPlayingMusic = NULL; musicSpeaker = NULL; } }
 static void channelFinished(int c) { Mix_FreeChunk(Mix_GetChunk(c)); }
 
-static bool playSoundEvent(std::string name, float volume, float speed, unsigned int channel) {
+// Returns a free channel in the group, moving one over from the free pool
+// (group 0) if needed. The pool grows in blocks instead of one channel at a time.
+static int allocateChannel(int group) {
+    std::lock_guard<std::mutex> lock(channelLock);
+    int channel;
+    for (channel = Mix_GroupAvailable(group); channel == -1; channel = Mix_GroupAvailable(group)) {
+        int next = Mix_GroupAvailable(0);
+        if (next == -1) {
+            const int count = Mix_AllocateChannels(-1);
+            const int newCount = Mix_AllocateChannels(count + max(count / 2, channelPoolGrowth));
+            if (newCount <= count) return -1;
+            Mix_GroupChannels(count, newCount - 1, 0);
+            next = count;
+        }
+        Mix_GroupChannel(next, group);
+    }
+    return channel;
+}
+
+// Returns the cached sample for an instrument at a pitch, decoding and resampling it the first time.
+static Mix_Chunk * getNoteSample(const std::string& inst, int pitch) {
+    std::lock_guard<std::mutex> lock(noteCacheLock);
+    auto it = noteCache.find(inst);
+    if (it == noteCache.end()) {
+        it = noteCache.insert(std::make_pair(inst, std::array<Mix_Chunk*, 25>())).first;
+        it->second.fill(NULL);
+    }
+    Mix_Chunk *& cached = it->second[pitch];
+    if (cached != NULL) return cached;
+    Mix_Chunk * chunk = Mix_LoadWAV_RW(SDL_RWFromConstMem(speaker_sounds[inst].first, speaker_sounds[inst].second), true);
+    if (chunk == NULL) return NULL;
+    float speed = (float)pow(2.0, (pitch - 12.0) / 12.0);
+    CustomSdlMixerPlaybackSpeedEffectHandler<Sint16> handler(speed, chunk, false); // frees chunk on scope exit
+    const Uint32 frameSize = formatSampleSize(AudioSpec::format) * AudioSpec::channelCount;
+    const Uint32 length = (Uint32)((float)chunk->alen / speed) / frameSize * frameSize;
+    void * data = SDL_malloc(length);
+    if (data == NULL) return NULL;
+    memcpy(data, chunk->abuf, min(chunk->alen, length)); // the handler leaves the buffer alone at normal speed
+    handler.modifyStreamPlaybackSpeed(0, data, length);
+    cached = (Mix_Chunk*)SDL_malloc(sizeof(Mix_Chunk));
+    cached->abuf = (Uint8*)data;
+    cached->alen = length;
+    cached->allocated = true;
+    cached->volume = MIX_MAX_VOLUME;
+    return cached;
+}
+
+// Plays a sound event on channel. With the software mixer, channel is -1 on
+// entry and gets set to the ID of the voice in the speaker's group.
+static bool playSoundEvent(std::string name, float volume, float speed, int& channel, int group) {
     if (name.find(':') == std::string::npos) name = "minecraft:" + name;
     if (soundEvents.find(name) == soundEvents.end()) return false;
     unsigned randMax = 0;
@@ -272,7 +335,7 @@ static bool playSoundEvent(std::string name, float volume, float speed, unsigned
     for (const sound_file_t& f : soundEvents[name]) {
         if ((i += f.pitch) > num) {
             // play this event
-            if (f.isEvent) return playSoundEvent(f.name, min(volume * f.volume, 3.0f), min(speed * f.pitch, 2.0f), channel);
+            if (f.isEvent) return playSoundEvent(f.name, min(volume * f.volume, 3.0f), min(speed * f.pitch, 2.0f), channel, group);
 #ifdef WIN32
             std::string path(astr(getROMPath() + WS("\\sounds\\") + wstr(f.name.find(':') == std::string::npos ? name.substr(0, name.find(':')) : f.name.substr(0, f.name.find(':'))) + WS("\\sounds\\") + wstr(f.name.find(':') == std::string::npos ? f.name : f.name.substr(f.name.find(':') + 1))));
             for (char& c : path) if (c == '/') c = '\\';
@@ -324,6 +387,10 @@ static bool playSoundEvent(std::string name, float volume, float speed, unsigned
                 newchunk->alen = (Uint32)((float)chunk->alen / speed);
                 newchunk->allocated = true;
                 newchunk->volume = (int)(min(volume * f.volume, 3.0f) * (MIX_MAX_VOLUME / 3.0f));
+                if (softwareMixer != NULL) {
+                    channel = softwareMixer->play(group, (const Sint16*)newchunk->abuf, newchunk->alen / sizeof(Sint16), newchunk->volume, newchunk);
+                    return true;
+                }
                 if (Mix_PlayChannel(channel, newchunk, 0) == -1) return false;
                 Mix_ChannelFinished(channelFinished);
                 return true;
@@ -350,35 +417,33 @@ int speaker::playNote(lua_State *L) {
         return 1;
     }
     noteCount++;
-    int channel;
-    for (channel = Mix_GroupAvailable(channelGroup); channel == -1; channel = Mix_GroupAvailable(channelGroup)) {
-        int next = Mix_GroupAvailable(0);
-        if (next == -1) next = Mix_AllocateChannels(Mix_AllocateChannels(-1) + 1) - 1;
-        Mix_GroupChannel(next, channelGroup);
+    int channel = -1;
+    if (softwareMixer == NULL && (channel = allocateChannel(channelGroup)) == -1) {
+        lua_pushboolean(L, false);
+        return 1;
     }
     if (soundEvents.find("minecraft:block.note_block." + inst) != soundEvents.end()) {
-        lua_pushboolean(L, playSoundEvent("minecraft:block.note_block." + inst, volume, (float)pow(2.0, (pitch - 12.0) / 12.0), channel));
+        lua_pushboolean(L, playSoundEvent("minecraft:block.note_block." + inst, volume, (float)pow(2.0, (pitch - 12.0) / 12.0), channel, channelGroup));
     } else if (soundEvents.find("minecraft:block.note." + inst) != soundEvents.end()) {
-        lua_pushboolean(L, playSoundEvent("minecraft:block.note." + inst, volume, (float)pow(2.0, (pitch - 12.0) / 12.0), channel));
+        lua_pushboolean(L, playSoundEvent("minecraft:block.note." + inst, volume, (float)pow(2.0, (pitch - 12.0) / 12.0), channel, channelGroup));
     } else {
-        Mix_Chunk * chunk = Mix_LoadWAV_RW(SDL_RWFromConstMem(speaker_sounds[inst].first, speaker_sounds[inst].second), true);
-        if (chunk == NULL) luaL_error(L, "Fatal error while reading instrument sample");
-        float speed = (float)pow(2.0, (pitch - 12.0) / 12.0);
-        CustomSdlMixerPlaybackSpeedEffectHandler<Sint16> handler(speed, chunk, false);
-        void * data = SDL_malloc(max(chunk->alen, (Uint32)ceil((float)chunk->alen / speed)));
-        memset(data, 0, max(chunk->alen, (Uint32)ceil((float)chunk->alen / speed)));
-        memcpy(data, chunk->abuf, chunk->alen);
-        handler.modifyStreamPlaybackSpeed(0, data, chunk->alen);
-        Mix_Chunk * newchunk = (Mix_Chunk*)SDL_malloc(sizeof(Mix_Chunk));
-        newchunk->abuf = (Uint8*)data;
-        newchunk->alen = (Uint32)((float)chunk->alen / speed);
-        newchunk->allocated = true;
-        newchunk->volume = (Uint8)(volume * (MIX_MAX_VOLUME / 3.0f));
-        if (Mix_PlayChannel(channel, newchunk, 0) == -1) {
-            lua_pushboolean(L, false);
-            return 1;
+        Mix_Chunk * sample = getNoteSample(inst, pitch);
+        if (sample == NULL) luaL_error(L, "Fatal error while reading instrument sample");
+        if (softwareMixer != NULL) {
+            channel = softwareMixer->play(channelGroup, (const Sint16*)sample->abuf, sample->alen / sizeof(Sint16), (int)(volume * (MIX_MAX_VOLUME / 3.0f)));
+        } else {
+            Mix_Chunk * newchunk = (Mix_Chunk*)SDL_malloc(sizeof(Mix_Chunk));
+            newchunk->abuf = sample->abuf;
+            newchunk->alen = sample->alen;
+            newchunk->allocated = false;
+            newchunk->volume = (Uint8)(volume * (MIX_MAX_VOLUME / 3.0f));
+            if (Mix_PlayChannel(channel, newchunk, 0) == -1) {
+                SDL_free(newchunk);
+                lua_pushboolean(L, false);
+                return 1;
+            }
+            Mix_ChannelFinished(channelFinished);
         }
-        Mix_ChannelFinished(channelFinished);
         lua_pushboolean(L, true);
     }
     if (lua_toboolean(L, -1)) { lua_pushinteger(L, channel); return 2; }
@@ -405,13 +470,12 @@ int speaker::playSound(lua_State *L) {
         return 1;
     }
     noteCount = UINT_MAX;
-    int channel;
-    for (channel = Mix_GroupAvailable(channelGroup); channel == -1; channel = Mix_GroupAvailable(channelGroup)) {
-        int next = Mix_GroupAvailable(0);
-        if (next == -1) next = Mix_AllocateChannels(Mix_AllocateChannels(-1) + 1) - 1;
-        Mix_GroupChannel(next, channelGroup);
+    int channel = -1;
+    if (softwareMixer == NULL && (channel = allocateChannel(channelGroup)) == -1) {
+        lua_pushboolean(L, false);
+        return 1;
     }
-    lua_pushboolean(L, playSoundEvent(inst, volume, speed, channel));
+    lua_pushboolean(L, playSoundEvent(inst, volume, speed, channel, channelGroup));
     lua_pushinteger(L, channel);
     return 2;
 #endif
@@ -477,10 +541,13 @@ int speaker::setSoundFont(lua_State *L) {
 
 int speaker::stopSounds(lua_State *L) {
     lastCFunction = __func__;
-    if (lua_isnumber(L, 1)) Mix_HaltChannel((int)lua_tointeger(L, 1));
-    else {
+    if (lua_isnumber(L, 1)) {
+        if (softwareMixer != NULL) softwareMixer->stop((int)lua_tointeger(L, 1));
+        else Mix_HaltChannel((int)lua_tointeger(L, 1));
+    } else {
         if (musicSpeaker == this) { Mix_HaltMusic(); musicSpeaker = NULL; }
-        Mix_HaltGroup(channelGroup);
+        if (softwareMixer != NULL) softwareMixer->stopGroup(channelGroup);
+        else Mix_HaltGroup(channelGroup);
     }
     return 0;
 }
@@ -492,19 +559,22 @@ speaker::speaker(lua_State *L, const char * side) {
 
 speaker::~speaker() {
     if (musicSpeaker == this) { Mix_HaltMusic(); musicSpeaker = NULL; }
+    if (softwareMixer != NULL) softwareMixer->stopGroup(channelGroup);
     Mix_HaltGroup(channelGroup);
     for (int channel = Mix_GroupAvailable(channelGroup); channel != -1; channel = Mix_GroupAvailable(channelGroup))
         Mix_GroupChannel(channel, 0);
 }
 
+const peripheral_method_table<speaker> speaker::dispatch = {
+    {"playNote", &speaker::playNote},
+    {"playSound", &speaker::playSound},
+    {"listSounds", &speaker::listSounds},
+    {"playLocalMusic", &speaker::playLocalMusic},
+    {"setSoundFont", &speaker::setSoundFont}
+};
+
 int speaker::call(lua_State *L, const char * method) {
-    const std::string m(method);
-    if (m == "playNote") return playNote(L);
-    else if (m == "playSound") return playSound(L);
-    else if (m == "listSounds") return listSounds(L);
-    else if (m == "playLocalMusic") return playLocalMusic(L);
-    else if (m == "setSoundFont") return setSoundFont(L);
-    else return 0;
+    return dispatch.call(this, L, method);
 }
 
 #define MIXER_FORMATS (MIX_INIT_FLAC | MIX_INIT_MP3 | MIX_INIT_OGG | MIX_INIT_MID)
@@ -519,6 +589,13 @@ void speakerInit() {
         fprintf(stderr, "\n");
     }
     Mix_GroupChannels(0, Mix_AllocateChannels(config.maxNotesPerTick)-1, 0);
+    if (!speakerOutputPath.empty()) {
+        try {
+            softwareMixer = new SpeakerMixer(speakerOutputPath);
+        } catch (std::exception &e) {
+            fprintf(stderr, "Could not start audio output: %s\n", e.what());
+        }
+    }
 #ifndef STANDALONE_ROM
     platform_DIR * d = platform_opendir((getROMPath() + WS("/sounds")).c_str());
     if (d) {
@@ -570,7 +647,17 @@ void speakerInit() {
 }
 
 void speakerQuit() {
+    // the mixer may still be reading cached note samples
+    if (softwareMixer != NULL) {
+        delete softwareMixer;
+        softwareMixer = NULL;
+    }
     Mix_HaltChannel(-1); // automatically frees chunks
+    std::lock_guard<std::mutex> lock(noteCacheLock);
+    for (const auto& inst : noteCache)
+        for (Mix_Chunk * chunk : inst.second)
+            if (chunk != NULL) Mix_FreeChunk(chunk);
+    noteCache.clear();
 }
 
 static luaL_Reg speaker_reg[] = {
@@ -16,6 +16,7 @@
 
 class speaker: public peripheral {
     static library_t methods;
+    static const peripheral_method_table<speaker> dispatch;
     static int nextChannelGroup;
     std::chrono::system_clock::time_point lastTickReset = std::chrono::system_clock::now();
     unsigned int noteCount = 0;
@@ -36,6 +37,9 @@ public:
     library_t getMethods() const override {return methods;}
 };
 
+// Where to write speaker output mixed in software: a WAV file, "null" to
+// discard it, or empty to play through the audio device as usual.
+extern path_t speakerOutputPath;
 extern void speakerInit();
 extern void speakerQuit();
 
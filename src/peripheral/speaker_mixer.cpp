@@ -0,0 +1,183 @@
+/*
+ * peripheral/speaker_mixer.cpp
+ * CraftOS-PC 2
+ *
+ * This file implements the software mixer used to capture speaker output.
+ *
+ * This code is licensed under the MIT license.
+ * Copyright (c) 2019-2021 JackMacWindows.
+ */
+
+#ifndef NO_MIXER
+#include <stdexcept>
+#include "../platform.hpp"
+#include "../util.hpp"
+#include "speaker_mixer.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SPEAKER_MIXER_SSE2
+#endif
+
+// Adds n samples scaled by volume into the accumulator, which holds samples * MIX_MAX_VOLUME.
+static void mixSamples(int32_t * dst, const Sint16 * src, size_t n, int volume) {
+    size_t i = 0;
+#ifdef SPEAKER_MIXER_SSE2
+    const __m128i vol = _mm_set1_epi16((short)volume);
+    for (; i + 8 <= n; i += 8) {
+        const __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        // the low and high halves of each 16x16 product interleave into 32-bit results
+        const __m128i lo = _mm_mullo_epi16(s, vol), hi = _mm_mulhi_epi16(s, vol);
+        __m128i * d = (__m128i*)(dst + i);
+        _mm_storeu_si128(d, _mm_add_epi32(_mm_loadu_si128(d), _mm_unpacklo_epi16(lo, hi)));
+        _mm_storeu_si128(d + 1, _mm_add_epi32(_mm_loadu_si128(d + 1), _mm_unpackhi_epi16(lo, hi)));
+    }
+#endif
+    for (; i < n; i++) dst[i] += src[i] * volume;
+}
+
+// Scales the accumulator back down (MIX_MAX_VOLUME is 1 << 7) and clips it to 16 bits.
+static void packSamples(Sint16 * dst, const int32_t * src, size_t n) {
+    size_t i = 0;
+#ifdef SPEAKER_MIXER_SSE2
+    for (; i + 8 <= n; i += 8) {
+        const __m128i a = _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(src + i)), 7);
+        const __m128i b = _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(src + i + 4)), 7);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(a, b));
+    }
+#endif
+    for (; i < n; i++) dst[i] = (Sint16)max(min(src[i] >> 7, 32767), -32768);
+}
+
+static void writeLE(FILE * fp, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) fputc((value >> (i * 8)) & 0xFF, fp);
+}
+
+SpeakerMixer::SpeakerMixer(const path_t& path) {
+    Uint16 format = 0;
+    if (!Mix_QuerySpec(&frequency, &format, &channels)) throw std::runtime_error(std::string("Audio device is not open: ") + Mix_GetError());
+    if (format != AUDIO_S16SYS) throw std::runtime_error("Audio device does not use 16-bit samples");
+    if (path != WS("null")) {
+        out = platform_fopen(path.c_str(), "wb");
+        if (out == NULL) throw std::runtime_error("Could not open audio output file");
+        // the sizes are patched on close; if the output can't seek, they stay at the streaming maximum
+        fwrite("RIFF", 4, 1, out);
+        writeLE(out, 0xFFFFFFFF, 4);
+        fwrite("WAVEfmt ", 8, 1, out);
+        writeLE(out, 16, 4);
+        writeLE(out, 1, 2); // PCM
+        writeLE(out, channels, 2);
+        writeLE(out, frequency, 4);
+        writeLE(out, frequency * channels * 2, 4);
+        writeLE(out, channels * 2, 2);
+        writeLE(out, 16, 2);
+        fwrite("data", 4, 1, out);
+        writeLE(out, 0xFFFFFFFF, 4);
+    }
+    accumulator.resize(blockFrames * channels);
+    block.resize(blockFrames * channels);
+    startTime = std::chrono::steady_clock::now();
+    thread = std::thread(&SpeakerMixer::run, this);
+    setThreadName(thread, "Speaker Mixer Thread");
+}
+
+SpeakerMixer::~SpeakerMixer() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        running = false;
+        notify.notify_all();
+    }
+    thread.join();
+    for (const voice& v : voices) if (v.owned != NULL) Mix_FreeChunk(v.owned);
+    voices.clear();
+    if (out != NULL) {
+        if (fseek(out, 4, SEEK_SET) == 0) {
+            writeLE(out, (uint32_t)min(dataSize + 36, (uint64_t)0xFFFFFFFF), 4);
+            fseek(out, 40, SEEK_SET);
+            writeLE(out, (uint32_t)min(dataSize, (uint64_t)0xFFFFFFFF), 4);
+        }
+        fclose(out);
+    }
+    const double seconds = (double)position / frequency;
+    const double ms = std::chrono::duration_cast<std::chrono::microseconds>(mixTime).count() / 1000.0;
+    fprintf(stderr, "Mixed %.1f s of speaker audio in %.1f ms (%.0fx real time)\n", seconds, ms, ms > 0 ? seconds * 1000.0 / ms : 0.0);
+}
+
+uint64_t SpeakerMixer::now() const {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count() * frequency / 1000000;
+}
+
+int SpeakerMixer::play(int group, const Sint16 * samples, size_t count, int volume, Mix_Chunk * owned) {
+    std::lock_guard<std::mutex> guard(lock);
+    voice v;
+    v.id = nextID++;
+    v.group = group;
+    v.samples = samples;
+    v.count = count - count % channels;
+    v.pos = 0;
+    v.volume = min(max(volume, 0), MIX_MAX_VOLUME);
+    v.start = max(now(), position);
+    v.owned = owned;
+    voices.push_back(v);
+    return v.id;
+}
+
+void SpeakerMixer::stop(int id) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto it = voices.begin(); it != voices.end(); ++it) {
+        if (it->id == id) {
+            if (it->owned != NULL) Mix_FreeChunk(it->owned);
+            voices.erase(it);
+            return;
+        }
+    }
+}
+
+void SpeakerMixer::stopGroup(int group) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto it = voices.begin(); it != voices.end();) {
+        if (it->group == group) {
+            if (it->owned != NULL) Mix_FreeChunk(it->owned);
+            it = voices.erase(it);
+        } else ++it;
+    }
+}
+
+// Mixes the block starting at position into the block buffer. lock must be held.
+void SpeakerMixer::mixBlock() {
+    std::fill(accumulator.begin(), accumulator.end(), 0);
+    const uint64_t end = position + blockFrames;
+    for (auto it = voices.begin(); it != voices.end();) {
+        if (it->start >= end) { ++it; continue; }
+        const size_t offset = it->start > position ? (size_t)(it->start - position) * channels : 0;
+        const size_t n = min(accumulator.size() - offset, it->count - it->pos);
+        mixSamples(&accumulator[offset], it->samples + it->pos, n, it->volume);
+        it->pos += n;
+        if (it->pos >= it->count) {
+            if (it->owned != NULL) Mix_FreeChunk(it->owned);
+            it = voices.erase(it);
+        } else ++it;
+    }
+    packSamples(&block[0], &accumulator[0], block.size());
+    position = end;
+}
+
+void SpeakerMixer::run() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (running) {
+        // a block is only mixed once it's fully in the past, so a voice can never start before the mixer's position
+        const std::chrono::steady_clock::time_point due = startTime + std::chrono::microseconds((position + blockFrames) * 1000000 / frequency);
+        if (notify.wait_until(guard, due, [this]()->bool {return !running;})) break;
+        const std::chrono::steady_clock::time_point mixStart = std::chrono::steady_clock::now();
+        mixBlock();
+        mixTime += std::chrono::steady_clock::now() - mixStart;
+        if (out != NULL) {
+            guard.unlock();
+            fwrite(&block[0], sizeof(Sint16), block.size(), out);
+            dataSize += block.size() * sizeof(Sint16);
+            guard.lock();
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * peripheral/speaker_mixer.hpp
+ * CraftOS-PC 2
+ *
+ * This file defines the software mixer used to capture speaker output.
+ *
+ * This code is licensed under the MIT license.
+ * Copyright (c) 2019-2021 JackMacWindows.
+ */
+
+#ifndef NO_MIXER
+#ifndef PERIPHERAL_SPEAKER_MIXER_HPP
+#define PERIPHERAL_SPEAKER_MIXER_HPP
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <lib.hpp>
+#include <SDL2/SDL_mixer.h>
+
+// Mixes every speaker's voices in software instead of sending them to the
+// SDL_mixer device, and writes the result to a WAV file (or throws it away if
+// the path is "null"). Blocks are rendered as soon as their end time has passed
+// on the wall clock, and voices start at the exact sample they were played at.
+class SpeakerMixer {
+public:
+    static const unsigned blockFrames = 512;
+    // Uses the sample format SDL_mixer opened, so chunks can be mixed without conversion.
+    // Throws std::runtime_error if the format isn't 16-bit or the file can't be opened.
+    SpeakerMixer(const path_t& path);
+    ~SpeakerMixer();
+    // Starts a voice in a speaker's group and returns its ID. samples has count
+    // interleaved samples, and volume goes from 0 to MIX_MAX_VOLUME. If owned
+    // is set, the chunk is freed once the voice finishes or is stopped.
+    int play(int group, const Sint16 * samples, size_t count, int volume, Mix_Chunk * owned = NULL);
+    void stop(int id);
+    void stopGroup(int group);
+private:
+    struct voice {
+        int id;
+        int group;
+        const Sint16 * samples;
+        size_t count;
+        size_t pos;
+        int volume;
+        uint64_t start; // in frames since the mixer started
+        Mix_Chunk * owned;
+    };
+    std::mutex lock;
+    std::condition_variable notify;
+    std::list<voice> voices;
+    std::thread thread;
+    bool running = true;
+    FILE * out = NULL;
+    int frequency = 0;
+    int channels = 0;
+    int nextID = 1;
+    uint64_t position = 0; // first frame of the next block
+    uint64_t dataSize = 0;
+    std::chrono::steady_clock::time_point startTime;
+    std::chrono::steady_clock::duration mixTime = std::chrono::steady_clock::duration::zero();
+    std::vector<int32_t> accumulator;
+    std::vector<Sint16> block;
+    uint64_t now() const;
+    void mixBlock();
+    void run();
+};
+
+#endif
+#endif
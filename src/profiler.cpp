@@ -0,0 +1,82 @@
+/*
+ * profiler.cpp
+ * CraftOS-PC 2
+ *
+ * This file implements the Profiler class.
+ *
+ * This code is licensed under the MIT license.
+ * Copyright (c) 2019-2021 JackMacWindows.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include "platform.hpp"
+#include "profiler.hpp"
+#include "termsupport.hpp"
+#include "util.hpp"
+
+path_t profileDir;
+unsigned profileRate = 1000;
+
+Profiler::Profiler(unsigned rate) {
+    interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::microseconds(1000000 / (rate ? rate : 1)));
+    nextSample = std::chrono::steady_clock::now() + interval;
+}
+
+void Profiler::sample(lua_State *L) {
+    lua_Debug ar;
+    stack.clear();
+    for (int level = 0; level < maxDepth && lua_getstack(L, level, &ar); level++) {
+        lua_getinfo(L, "Sn", &ar);
+        std::string name;
+        if (strcmp(ar.what, "tail") == 0) name = "(tail call)";
+        else {
+            name = ar.name != NULL && *ar.name ? ar.name : (strcmp(ar.what, "main") == 0 ? "(main)" : "?");
+            if (*ar.what == 'C') name += " [C]";
+            else name += " (" + std::string(ar.short_src) + ":" + std::to_string(ar.linedefined) + ")";
+        }
+        // semicolons separate frames in the output
+        for (char& c : name) if (c == ';') c = ',';
+        auto it = functionIDs.find(name);
+        if (it == functionIDs.end()) {
+            it = functionIDs.insert(std::make_pair(name, (unsigned)functionNames.size())).first;
+            functionNames.push_back(name);
+        }
+        stack.push_back(it->second);
+    }
+    if (stack.empty()) return;
+    stacks[stack]++;
+    sampleCount++;
+}
+
+bool Profiler::save(const path_t& path) const {
+    FILE * fp = platform_fopen(path.c_str(), "w");
+    if (fp == NULL) return false;
+    for (const auto& s : stacks) {
+        for (auto it = s.first.rbegin(); it != s.first.rend(); ++it) {
+            if (it != s.first.rbegin()) fputc(';', fp);
+            fputs(functionNames[*it].c_str(), fp);
+        }
+        fprintf(fp, " %lu\n", s.second);
+    }
+    fclose(fp);
+    return true;
+}
+
+void startProfiler(Computer * comp, lua_State *L) {
+    if (profileDir.empty() || comp->isDebugger) return;
+    if (comp->profiler == NULL) comp->profiler = new Profiler(profileRate);
+    // new coroutines inherit the hook, so this covers everything the computer runs
+    setComputerHook(comp, L, 0, 0);
+}
+
+void stopProfiler(Computer * comp) {
+    if (comp->profiler == NULL) return;
+    Profiler * profiler = (Profiler*)comp->profiler;
+    comp->profiler = NULL;
+    createDirectory(profileDir);
+    const path_t path = profileDir + PATH_SEP + to_path_t(comp->id) + WS(".folded");
+    if (!profiler->save(path)) fprintf(stderr, "Could not write profile for computer %d\n", comp->id);
+    else fprintf(stderr, "Wrote %lu samples for computer %d to %s\n", profiler->samples(), comp->id, astr(path).c_str());
+    delete profiler;
+}
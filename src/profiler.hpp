@@ -0,0 +1,61 @@
+/*
+ * profiler.hpp
+ * CraftOS-PC 2
+ *
+ * This file defines the Profiler class, which samples the Lua call stack of a
+ * computer at a fixed rate and writes the results as collapsed stacks.
+ *
+ * This code is licensed under the MIT license.
+ * Copyright (c) 2019-2021 JackMacWindows.
+ */
+
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+#include <chrono>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <Computer.hpp>
+
+// Where to write profiles of each computer (empty = don't profile), and how many samples to take per second.
+extern path_t profileDir;
+extern unsigned profileRate;
+
+// Unlike the debugger's profiler, this doesn't hook every call and return.
+// A count hook checks the clock every hookCount instructions, and once a
+// sample is due the whole stack is recorded as a list of interned function IDs.
+// Identical stacks are counted together, so memory only grows with the number
+// of distinct stacks seen.
+class Profiler {
+    std::chrono::steady_clock::duration interval;
+    std::chrono::steady_clock::time_point nextSample;
+    std::unordered_map<std::string, unsigned> functionIDs;
+    std::vector<std::string> functionNames;
+    std::map<std::vector<unsigned>, unsigned long> stacks;
+    std::vector<unsigned> stack; // scratch space for the current sample, innermost frame first
+    unsigned long sampleCount = 0;
+    void sample(lua_State *L);
+public:
+    static const int hookCount = 1000;
+    static const int maxDepth = 256;
+    Profiler(unsigned rate);
+    // Called from the count hook; takes a sample if one is due.
+    void hook(lua_State *L) {
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (now < nextSample) return;
+        nextSample = now + interval;
+        sample(L);
+    }
+    // Writes every stack as "outer;...;inner count" lines, which flamegraph.pl,
+    // inferno and speedscope can all read. Returns false if the file can't be opened.
+    bool save(const path_t& path) const;
+    unsigned long samples() const {return sampleCount;}
+};
+
+// Starts profiling a computer (if --profile was passed) and hooks a freshly created Lua state.
+extern void startProfiler(Computer * comp, lua_State *L);
+// Writes a computer's profile to the profile directory and frees the profiler.
+extern void stopProfiler(Computer * comp);
+
+#endif
@@ -0,0 +1,229 @@
+/*
+ * recorder.cpp
+ * CraftOS-PC 2
+ *
+ * This file implements the TerminalRecorder class.
+ *
+ * This code is licensed under the MIT license.
+ * Copyright (c) 2019-2021 JackMacWindows.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <SDL2/SDL.h>
+#include <configuration.hpp>
+#include "platform.hpp"
+#include "recorder.hpp"
+#include "util.hpp"
+
+extern "C" {
+    struct font_image {
+        unsigned int 	 width;
+        unsigned int 	 height;
+        unsigned int 	 bytes_per_pixel; /* 2:RGB16, 3:RGB, 4:RGBA */
+        unsigned char	 pixel_data[128 * 175 * 2 + 1];
+    };
+    extern struct font_image font_image;
+}
+
+// Each glyph row is stored as a bitmask, bit 0 being the leftmost pixel
+static TerminalRecorder::glyph_t fontGlyphs[256];
+static TerminalRecorder::glyph_t customGlyphs[256];
+static unsigned customGlyphScale = 0; // the size of a font pixel in the custom font, or 0 if there's none
+static std::once_flag fontGlyphsFlag;
+static const unsigned recordingMargin = 2; // in font pixels, same as the SDL renderer
+
+// Loads the custom font the same way the SDL renderer does. Fonts it can't load are left out, and the built-in font is used instead.
+static void loadCustomGlyphs() {
+    if (config.customFontPath.empty()) return;
+    const unsigned fontScale = config.customFontPath == "hdfont" ? 1 : config.customFontScale;
+    if (fontScale != 1 && fontScale != 2) return;
+    SDL_Surface * old_bmp;
+#ifndef STANDALONE_ROM
+    if (config.customFontPath == "hdfont") old_bmp = SDL_LoadBMP(astr(getROMPath() + WS("/hdfont.bmp")).c_str());
+    else
+#endif
+    old_bmp = SDL_LoadBMP(config.customFontPath.c_str());
+    if (old_bmp == NULL) {
+        fprintf(stderr, "Could not load custom font for recording, using the default font: %s\n", SDL_GetError());
+        return;
+    }
+    SDL_Surface * bmp = SDL_ConvertSurfaceFormat(old_bmp, SDL_PIXELFORMAT_RGBA32, 0);
+    SDL_FreeSurface(old_bmp);
+    if (bmp == NULL) {
+        fprintf(stderr, "Could not load custom font for recording, using the default font: %s\n", SDL_GetError());
+        return;
+    }
+    const unsigned gs = 2 / fontScale;
+    if ((unsigned)bmp->w >= 16 * (Terminal::fontWidth + 2) * gs && (unsigned)bmp->h >= 16 * (Terminal::fontHeight + 2) * gs) {
+        SDL_LockSurface(bmp);
+        for (unsigned c = 0; c < 256; c++) {
+            const unsigned ox = (Terminal::fontWidth + 2) * gs * (c & 15) + gs, oy = (Terminal::fontHeight + 2) * gs * (c >> 4) + gs;
+            for (unsigned y = 0; y < Terminal::fontHeight * gs; y++) {
+                uint16_t mask = 0;
+                for (unsigned x = 0; x < Terminal::fontWidth * gs; x++) {
+                    const unsigned char * p = (const unsigned char*)bmp->pixels + (oy + y) * bmp->pitch + (ox + x) * 4;
+                    if (p[0] || p[1] || p[2]) mask |= 1 << x;
+                }
+                customGlyphs[c][y] = mask;
+            }
+        }
+        SDL_UnlockSurface(bmp);
+        customGlyphScale = gs;
+    } else fprintf(stderr, "Custom font is too small to record with, using the default font\n");
+    SDL_FreeSurface(bmp);
+}
+
+static void loadFontGlyphs() {
+    for (unsigned c = 0; c < 256; c++) {
+        const unsigned ox = 8 * (c & 15) + 1, oy = 11 * (c >> 4) + 1;
+        for (unsigned y = 0; y < Terminal::fontHeight; y++) {
+            uint16_t mask = 0;
+            for (unsigned x = 0; x < Terminal::fontWidth; x++) {
+                const unsigned char * p = &font_image.pixel_data[((oy + y) * font_image.width + ox + x) * font_image.bytes_per_pixel];
+                if (p[0] || p[1]) mask |= 1 << x; // black is the transparent color key
+            }
+            fontGlyphs[c][y] = mask;
+        }
+    }
+    loadCustomGlyphs();
+}
+
+TerminalRecorder::TerminalRecorder(const path_t& path, Terminal * term, unsigned scale): scale(scale ? scale : 1) {
+    std::call_once(fontGlyphsFlag, loadFontGlyphs);
+    // like the SDL renderer, the original font is used if the scale doesn't fit the custom font
+    if (customGlyphScale != 0 && this->scale % customGlyphScale == 0) {
+        glyphs = customGlyphs;
+        glyphScale = customGlyphScale;
+        this->scale /= customGlyphScale;
+    } else {
+        glyphs = fontGlyphs;
+        glyphScale = 1;
+    }
+    {
+        std::lock_guard<std::mutex> lock(term->locked);
+        imageWidth = (term->width * Terminal::fontWidth + 2 * recordingMargin) * glyphScale;
+        imageHeight = (term->height * Terminal::fontHeight + 2 * recordingMargin) * glyphScale;
+    }
+    writer.f = platform_fopen(path.c_str(), "wb");
+    if (writer.f == NULL) throw std::runtime_error("Could not open recording file");
+    GifBegin(&writer, NULL, imageWidth * this->scale, imageHeight * this->scale, 100 / config.recordingFPS);
+    memset(&writtenPalette, 0, sizeof(writtenPalette));
+}
+
+TerminalRecorder::~TerminalRecorder() {
+    flush();
+    GifEnd(&writer);
+}
+
+void TerminalRecorder::rasterize(Terminal * term, int cursorColor) {
+    memset(&palette, 0, sizeof(palette));
+    frame.resize(imageWidth * imageHeight);
+    std::lock_guard<std::mutex> lock(term->locked);
+    const int mode = term->mode;
+    const unsigned ncolors = mode == 2 ? 256 : 16;
+    for (unsigned i = 0; i < ncolors; i++) {
+        Color c = term->palette[i];
+        if (term->grayscale) c.r = c.g = c.b = ((int)c.r + (int)c.g + (int)c.b) / 3;
+        palette.r[i] = c.r; palette.g[i] = c.g; palette.b[i] = c.b;
+    }
+    // 16-color modes get 5 bits so there are always spare indices for transparency
+    palette.bitDepth = mode == 2 ? 8 : 5;
+    uint8_t margin = 15;
+    if (mode == 1) {
+        // graphics mode borders always use the default black, even if the palette changed it
+        margin = 16;
+        palette.r[16] = defaultPalette[15].r; palette.g[16] = defaultPalette[15].g; palette.b[16] = defaultPalette[15].b;
+    } else if (mode == 2) {
+        for (unsigned i = 0; i < 256; i++) {
+            if (palette.r[i] == defaultPalette[15].r && palette.g[i] == defaultPalette[15].g && palette.b[i] == defaultPalette[15].b) {
+                margin = (uint8_t)i;
+                break;
+            }
+        }
+    }
+    std::fill(frame.begin(), frame.end(), margin);
+    // sizes below are in image pixels, which are glyphScale x glyphScale font pixels
+    const unsigned gs = glyphScale, charWidth = Terminal::fontWidth * gs, charHeight = Terminal::fontHeight * gs, border = recordingMargin * gs;
+    // the terminal may have been resized since the recording started, so clip to the image
+    const unsigned w = min(term->width * charWidth, imageWidth - 2 * border);
+    const unsigned h = min(term->height * charHeight, imageHeight - 2 * border);
+    if (mode != 0) {
+        for (unsigned y = 0; y < h; y++) {
+            const unsigned char * src = &term->pixels[y / gs][0];
+            uint8_t * dst = &frame[(y + border) * imageWidth + border];
+            if (gs == 1) {
+                if (mode == 1) for (unsigned x = 0; x < w; x++) dst[x] = src[x] & 0x0F;
+                else memcpy(dst, src, w);
+            } else for (unsigned x = 0; x < w; x++) dst[x] = mode == 1 ? src[x / gs] & 0x0F : src[x / gs];
+        }
+        return;
+    }
+    for (unsigned y = 0; y < h; y++) {
+        const unsigned cy = y / charHeight, gy = y % charHeight;
+        uint8_t * dst = &frame[(y + border) * imageWidth + border];
+        for (unsigned x = 0; x < w; x += charWidth) {
+            const unsigned cx = x / charWidth;
+            const uint16_t mask = glyphs[term->screen[cy][cx]][gy];
+            const uint8_t fg = term->colors[cy][cx] & 0x0F, bg = term->colors[cy][cx] >> 4;
+            for (unsigned i = 0; i < charWidth; i++) dst[x + i] = (mask >> i) & 1 ? fg : bg;
+        }
+    }
+    if (term->blink && term->blinkX >= 0 && term->blinkY >= 0 && (unsigned)term->blinkX * charWidth < w && (unsigned)term->blinkY * charHeight < h) {
+        const uint8_t fg = cursorColor >= 0 ? (uint8_t)(cursorColor & 0x0F) : term->colors[term->blinkY][term->blinkX] & 0x0F;
+        for (unsigned gy = 0; gy < charHeight; gy++) {
+            const uint16_t mask = glyphs['_'][gy];
+            uint8_t * dst = &frame[(term->blinkY * charHeight + gy + border) * imageWidth + term->blinkX * charWidth + border];
+            for (unsigned i = 0; i < charWidth; i++) if ((mask >> i) & 1) dst[i] = fg;
+        }
+    }
+}
+
+void TerminalRecorder::flush() {
+    if (pending.empty()) return;
+    const unsigned sw = imageWidth * scale, sh = imageHeight * scale;
+    if (scale == 1) scaled = pending;
+    else {
+        scaled.resize(sw * sh);
+        for (unsigned y = 0; y < imageHeight; y++) {
+            uint8_t * dst = &scaled[y * scale * sw];
+            const uint8_t * src = &pending[y * imageWidth];
+            for (unsigned x = 0; x < imageWidth; x++) memset(dst + x * scale, src[x], scale);
+            for (unsigned i = 1; i < scale; i++) memcpy(dst + i * sw, dst, sw);
+        }
+    }
+    // unchanged pixels are only valid if they still map to the same colors
+    if (pendingPalette.bitDepth != writtenPalette.bitDepth || memcmp(pendingPalette.r, writtenPalette.r, 256) || memcmp(pendingPalette.g, writtenPalette.g, 256) || memcmp(pendingPalette.b, writtenPalette.b, 256)) {
+        writer.firstFrame = true;
+        writtenPalette = pendingPalette;
+    }
+    GifWriteIndexedFrame(&writer, scaled.data(), sw, sh, pendingDelay, &pendingPalette);
+    pending.clear();
+    pendingDelay = 0;
+}
+
+void TerminalRecorder::capture(Terminal * term, int cursorColor) {
+    const uint32_t delay = 100 / config.recordingFPS;
+    rasterize(term, cursorColor);
+    recordedFrames++;
+    if (!pending.empty() && pendingDelay + delay <= 0xFFFF && frame == pending && pendingPalette.bitDepth == palette.bitDepth &&
+        !memcmp(pendingPalette.r, palette.r, 256) && !memcmp(pendingPalette.g, palette.g, 256) && !memcmp(pendingPalette.b, palette.b, 256)) {
+        pendingDelay += delay;
+        return;
+    }
+    flush();
+    pending.swap(frame);
+    pendingPalette = palette;
+    pendingDelay = delay;
+}
+
+bool TerminalRecorder::tick(Terminal * term, int cursorColor) {
+    if (recordedFrames >= config.maxRecordingTime * config.recordingFPS) return false;
+    if (--frameWait < 1) {
+        capture(term, cursorColor);
+        frameWait = config.clockSpeed / config.recordingFPS;
+    }
+    return true;
+}
@@ -0,0 +1,60 @@
+/*
+ * recorder.hpp
+ * CraftOS-PC 2
+ *
+ * This file defines the TerminalRecorder class, which records the contents of
+ * a terminal to an animated GIF without needing a window to render into.
+ *
+ * This code is licensed under the MIT license.
+ * Copyright (c) 2019-2021 JackMacWindows.
+ */
+
+#ifndef RECORDER_HPP
+#define RECORDER_HPP
+#include <vector>
+#include <lib.hpp>
+#include <Terminal.hpp>
+#include "gif.hpp"
+
+// Captures frames straight from a terminal's buffers (text + colors or pixels)
+// as palette indices, so no RGB conversion or color quantization is needed.
+// Each frame only stores the area that changed since the last one, and frames
+// that are identical to the previous one are merged into a longer delay.
+class TerminalRecorder {
+public:
+    typedef uint16_t glyph_t[Terminal::fontHeight * 2]; // one bitmask per row, for fonts up to twice the standard size
+private:
+    GifWriter writer;
+    GifPalette palette;
+    const glyph_t * glyphs; // the font to draw text with, either the built-in font or the custom font
+    unsigned glyphScale; // the size of one font pixel in the image
+    unsigned scale; // how much the image is scaled up when writing
+    unsigned imageWidth;
+    unsigned imageHeight;
+    int frameWait = 0;
+    int recordedFrames = 0;
+    uint32_t pendingDelay = 0;
+    std::vector<uint8_t> frame; // 1x frame being captured
+    std::vector<uint8_t> pending; // 1x frame waiting for its final delay
+    std::vector<uint8_t> scaled; // pending frame scaled up for writing
+    GifPalette pendingPalette;
+    GifPalette writtenPalette;
+
+    void rasterize(Terminal * term, int cursorColor);
+    void flush();
+public:
+    // Opens the output file and sizes the image after the terminal's current size, with
+    // each standard font pixel drawn as scale x scale pixels.
+    // Throws std::runtime_error if the file can't be opened.
+    TerminalRecorder(const path_t& path, Terminal * term, unsigned scale = 2);
+    ~TerminalRecorder(); // Writes the last frame and closes the file
+    // Call once per render tick; captures a frame every clockSpeed / recordingFPS ticks.
+    // The terminal must not be locked by the caller. cursorColor overrides the cursor's
+    // color (-1 = use the color of the text under it).
+    // Returns false once the maximum recording time has been reached.
+    bool tick(Terminal * term, int cursorColor = -1);
+    // Captures a frame immediately, regardless of the frame rate.
+    void capture(Terminal * term, int cursorColor = -1);
+};
+
+#endif
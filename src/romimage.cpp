@@ -0,0 +1,165 @@
+/*
+ * romimage.cpp
+ * CraftOS-PC 2
+ *
+ * This file implements the functions that load and pack the ROM image.
+ *
+ * This code is licensed under the MIT license.
+ * Copyright (c) 2019-2021 JackMacWindows.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "romimage.hpp"
+#include "util.hpp"
+
+const FileEntry * romImage = NULL;
+
+static const char romImageMagic[8] = {'C', 'C', 'P', 'C', 'R', 'O', 'M', '1'};
+static const int maxDepth = 64;
+
+static bool readFile(const path_t& path, std::string& data) {
+    FILE * fp = platform_fopen(path.c_str(), "rb");
+    if (fp == NULL) return false;
+    char buf[16384];
+    size_t size;
+    while ((size = fread(buf, 1, sizeof(buf), fp)) > 0) data.append(buf, size);
+    const bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+static bool readDirectory(const path_t& path, std::map<std::string, FileEntry>& entries, int depth) {
+    if (depth >= maxDepth) return false;
+    platform_DIR * d = platform_opendir(path.c_str());
+    if (d == NULL) return false;
+    bool ok = true;
+    struct_dirent * dir;
+    while (ok && (dir = platform_readdir(d)) != NULL) {
+        const path_t name = dir->d_name;
+        if (name == WS(".") || name == WS("..") || name == WS(".DS_Store") || name == WS("desktop.ini")) continue;
+        const path_t child = path + PATH_SEP + name;
+        struct_stat st;
+        if (platform_stat(child.c_str(), &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) ok = readDirectory(child, entries.insert(std::make_pair(astr(name), FileEntry(std::map<std::string, FileEntry>()))).first->second.dir, depth + 1);
+        else ok = readFile(child, entries.insert(std::make_pair(astr(name), FileEntry(std::string()))).first->second.data);
+    }
+    platform_closedir(d);
+    return ok;
+}
+
+// Reads the parts of a ROM directory that computers use.
+static bool readROMDirectory(const path_t& path, FileEntry& image) {
+    struct_stat st;
+    if (!readDirectory(path + PATH_SEP + WS("rom"), image.dir.insert(std::make_pair("rom", FileEntry(std::map<std::string, FileEntry>()))).first->second.dir, 1)) return false;
+    if (platform_stat((path + PATH_SEP + WS("debug")).c_str(), &st) == 0 && S_ISDIR(st.st_mode) &&
+        !readDirectory(path + PATH_SEP + WS("debug"), image.dir.insert(std::make_pair("debug", FileEntry(std::map<std::string, FileEntry>()))).first->second.dir, 1)) return false;
+    return readFile(path + PATH_SEP + WS("bios.lua"), image.dir.insert(std::make_pair("bios.lua", FileEntry(std::string()))).first->second.data);
+}
+
+static bool readString(FILE * fp, std::string& str) {
+    uint32_t size;
+    if (fread(&size, sizeof(size), 1, fp) != 1) return false;
+    str.resize(size);
+    return size == 0 || fread(&str[0], 1, size, fp) == size;
+}
+
+static void writeString(FILE * fp, const std::string& str) {
+    const uint32_t size = (uint32_t)str.size();
+    fwrite(&size, sizeof(size), 1, fp);
+    fwrite(str.data(), 1, str.size(), fp);
+}
+
+// Packed directories are a count followed by (name, type, contents) for each entry.
+// Type 0 is a file, whose contents are a string; type 1 is another directory.
+static bool readPackedDirectory(FILE * fp, std::map<std::string, FileEntry>& entries, int depth) {
+    if (depth >= maxDepth) return false;
+    uint32_t count;
+    if (fread(&count, sizeof(count), 1, fp) != 1) return false;
+    for (uint32_t i = 0; i < count; i++) {
+        std::string name;
+        if (!readString(fp, name)) return false;
+        const int type = fgetc(fp);
+        if (type == 0) {
+            if (!readString(fp, entries.insert(std::make_pair(name, FileEntry(std::string()))).first->second.data)) return false;
+        } else if (type == 1) {
+            if (!readPackedDirectory(fp, entries.insert(std::make_pair(name, FileEntry(std::map<std::string, FileEntry>()))).first->second.dir, depth + 1)) return false;
+        } else return false;
+    }
+    return true;
+}
+
+static void writePackedDirectory(FILE * fp, const std::map<std::string, FileEntry>& entries) {
+    const uint32_t count = (uint32_t)entries.size();
+    fwrite(&count, sizeof(count), 1, fp);
+    for (const auto& e : entries) {
+        writeString(fp, e.first);
+        fputc(e.second.isDir ? 1 : 0, fp);
+        if (e.second.isDir) writePackedDirectory(fp, e.second.dir);
+        else writeString(fp, e.second.data);
+    }
+}
+
+static std::string checkImage(const FileEntry& image) {
+    auto rom = image.dir.find("rom");
+    if (rom == image.dir.end() || !rom->second.isDir) return "The ROM image does not contain a rom directory";
+    auto bios = image.dir.find("bios.lua");
+    if (bios == image.dir.end() || bios->second.isDir) return "The ROM image does not contain bios.lua";
+    return "";
+}
+
+std::string loadROMImage(const path_t& path) {
+    FileEntry * image = new FileEntry(std::map<std::string, FileEntry>());
+    struct_stat st;
+    if (platform_stat(path.c_str(), &st) != 0) {
+        delete image;
+        return "Could not find " + astr(path);
+    } else if (S_ISDIR(st.st_mode)) {
+        if (!readROMDirectory(path, *image)) {
+            delete image;
+            return "Could not read ROM directory " + astr(path);
+        }
+    } else {
+        FILE * fp = platform_fopen(path.c_str(), "rb");
+        if (fp == NULL) {
+            delete image;
+            return "Could not open " + astr(path);
+        }
+        char magic[sizeof(romImageMagic)];
+        const bool ok = fread(magic, sizeof(magic), 1, fp) == 1 && memcmp(magic, romImageMagic, sizeof(magic)) == 0 && readPackedDirectory(fp, image->dir, 0);
+        fclose(fp);
+        if (!ok) {
+            delete image;
+            return astr(path) + " is not a valid ROM image";
+        }
+    }
+    const std::string err = checkImage(*image);
+    if (!err.empty()) {
+        delete image;
+        return err;
+    }
+    freeROMImage();
+    romImage = image;
+    return "";
+}
+
+std::string packROMImage(const path_t& romPath, const path_t& outPath) {
+    FileEntry image(std::map<std::string, FileEntry>{});
+    if (!readROMDirectory(romPath, image)) return "Could not read ROM directory " + astr(romPath);
+    const std::string err = checkImage(image);
+    if (!err.empty()) return err;
+    FILE * fp = platform_fopen(outPath.c_str(), "wb");
+    if (fp == NULL) return "Could not open " + astr(outPath) + " for writing";
+    fwrite(romImageMagic, sizeof(romImageMagic), 1, fp);
+    writePackedDirectory(fp, image.dir);
+    const bool ok = !ferror(fp);
+    if (fclose(fp) != 0 || !ok) return "Could not write " + astr(outPath);
+    return "";
+}
+
+void freeROMImage() {
+    delete romImage;
+    romImage = NULL;
+}
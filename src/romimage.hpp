@@ -0,0 +1,28 @@
+/*
+ * romimage.hpp
+ * CraftOS-PC 2
+ *
+ * This file defines the functions that load the ROM into memory once, so
+ * that every computer can mount the same read-only copy.
+ *
+ * This code is licensed under the MIT license.
+ * Copyright (c) 2019-2021 JackMacWindows.
+ */
+
+#ifndef ROMIMAGE_HPP
+#define ROMIMAGE_HPP
+#include <FileEntry.hpp>
+#include "platform.hpp"
+
+// The ROM image, laid out like the ROM directory (rom/, debug/, bios.lua), or NULL if the ROM is read from disk.
+extern const FileEntry * romImage;
+
+// Loads the ROM image from a ROM directory or a file written by packROMImage.
+// Returns an error message, or an empty string on success.
+extern std::string loadROMImage(const path_t& path);
+// Reads a ROM directory and writes it to a single packed file.
+extern std::string packROMImage(const path_t& romPath, const path_t& outPath);
+// Frees the ROM image. No computers may be running.
+extern void freeROMImage();
+
+#endif
@@ -20,7 +20,9 @@
 #include <configuration.hpp>
 #include <dirent.h>
 #include <sys/stat.h>
+#include "headless.hpp"
 #include "main.hpp"
+#include "metrics.hpp"
 #include "runtime.hpp"
 #include "platform.hpp"
 #include "terminal/SDLTerminal.hpp"
@@ -193,6 +195,8 @@ int getNextEvent(lua_State *L, const std::string& filter) {
     Computer * computer = get_comp(L);
     if (computer->running != 1) return 0;
     computer->timeoutCheckCount = 0;
+    ComputerMetrics * metrics = (ComputerMetrics*)computer->metrics;
+    if (metrics != NULL) metrics->luaTime.observe(std::chrono::high_resolution_clock::now() - computer->last_event);
     std::string ev;
     computer->getting_event = true;
     lua_State *param;
@@ -210,7 +214,11 @@ int getNextEvent(lua_State *L, const std::string& filter) {
             }
         }
         if (computer->running != 1) return 0;
+        const bool waited = metrics != NULL && computer->eventQueue.empty();
+        const std::chrono::high_resolution_clock::time_point waitStart = waited ? std::chrono::high_resolution_clock::now() : std::chrono::high_resolution_clock::time_point();
         while (computer->eventQueue.empty()) {
+            // the computer is idle, so show whatever it has written so far
+            if (computer->headlessOutput != NULL) ((HeadlessOutput*)computer->headlessOutput)->flush(true);
             std::mutex m;
             std::unique_lock<std::mutex> l(m);
             while (computer->running == 1 && !termHasEvent(computer)) 
@@ -227,8 +235,13 @@ int getNextEvent(lua_State *L, const std::string& filter) {
                 }
             }
         }
+        if (waited) metrics->waitNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - waitStart).count();
         ev = computer->eventQueue.front();
         computer->eventQueue.pop();
+        if (metrics != NULL) {
+            metrics->events++;
+            metrics->eventQueueDepth = computer->eventQueue.size();
+        }
         if (!filter.empty() && ev != filter && ev != "terminate") lua_remove(computer->paramQueue, 1);
         lua_pop(computer->paramQueue, 1);
         std::this_thread::yield();
@@ -36,9 +36,14 @@ std::set<unsigned> CLITerminal::currentIDs;
 std::set<unsigned>::iterator CLITerminal::selectedWindow = currentIDs.begin();
 bool CLITerminal::stopRender = false;
 bool CLITerminal::forceRender = false;
-unsigned short CLITerminal::lastPaletteChecksum = 0;
+std::vector<uint16_t> CLITerminal::lastFrame;
+unsigned CLITerminal::lastFrameID = 0;
+Color CLITerminal::lastPalette[16];
+int CLITerminal::lastGrayscale = -1;
+std::string CLITerminal::lastNavbarTitle;
 
 void CLITerminal::renderNavbar(std::string title) {
+    lastNavbarTitle = title;
     move(LINES-1, 0);
     if (stopRender) return;
     attron(COLOR_PAIR(0x78));
@@ -109,34 +114,50 @@ void CLITerminal::render() {
     if (*selectedWindow == id && changed) {
         changed = false;
         std::lock_guard<std::mutex> locked_g(locked);
-        move(0, 0);
-        if (stopRender) {stopRender = false; return;}
-        clear();
-        if (stopRender) {stopRender = false; return;}
-        if (can_change_color()) {
-            unsigned short checksum = grayscale;
-            for (int i = 0; i < 48; i++) 
-                checksum = (checksum >> 1) + ((checksum & 1) << 15) + ((unsigned char*)palette)[i];
-            if (checksum != lastPaletteChecksum) {
-                for (int i = 0; i < 16; i++) {
-                    if (grayscale) {
-                        int c = (palette[i].r + palette[i].g + palette[i].b) * 1000 / 765;
-                        init_color(15-i, c, c, c);
-                    }
-                    else init_color(15-i, palette[i].r * (1000/255), palette[i].g * (1000/255), palette[i].b * (1000/255));
+        // Only switching windows or resizing needs a full repaint; otherwise just the cells that changed are sent.
+        const bool fullRedraw = lastFrame.size() != (size_t)width * height || lastFrameID != id || forceRender;
+        if (fullRedraw) {
+            lastFrame.assign((size_t)width * height, 0);
+            lastFrameID = id;
+            move(0, 0);
+            if (stopRender) {stopRender = false; lastFrame.clear(); return;}
+            clear();
+            if (stopRender) {stopRender = false; lastFrame.clear(); return;}
+        }
+        if (can_change_color() && ((int)grayscale != lastGrayscale || memcmp(palette, lastPalette, sizeof(lastPalette)) != 0)) {
+            for (int i = 0; i < 16; i++) {
+                if (grayscale) {
+                    int c = (palette[i].r + palette[i].g + palette[i].b) * 1000 / 765;
+                    init_color(15-i, c, c, c);
                 }
+                else init_color(15-i, palette[i].r * (1000/255), palette[i].g * (1000/255), palette[i].b * (1000/255));
             }
-            lastPaletteChecksum = checksum;
+            memcpy(lastPalette, palette, sizeof(lastPalette));
+            lastGrayscale = grayscale;
         }
+        std::vector<chtype> run(width);
         for (unsigned y = 0; y < height; y++) {
-            for (unsigned x = 0; x < width; x++) {
-                move(y, x);
-                addch((screen[y][x] ? screen[y][x] : ' ') | COLOR_PAIR(colors[y][x]));
-                if (stopRender) {stopRender = false; return;}
+            const unsigned char * chars = screen.row_data(y);
+            const unsigned char * cols = colors.row_data(y);
+            uint16_t * last = &lastFrame[(size_t)y * width];
+            for (unsigned x = 0; x < width;) {
+                const uint16_t cell = (chars[x] ? chars[x] : ' ') | (cols[x] << 8);
+                if (!fullRedraw && last[x] == cell) {x++; continue;}
+                // collect every changed cell up to the next unchanged one, and draw them in one call
+                unsigned n = 0;
+                for (; x + n < width; n++) {
+                    const uint16_t c = (chars[x+n] ? chars[x+n] : ' ') | (cols[x+n] << 8);
+                    if (!fullRedraw && last[x+n] == c) break;
+                    last[x+n] = c;
+                    run[n] = (c & 0xFF) | COLOR_PAIR(c >> 8);
+                }
+                mvaddchnstr(y, x, &run[0], n);
+                x += n;
+                if (stopRender) {stopRender = false; lastFrame.clear(); return;}
             }
         }
-        renderNavbar(title);
-        if (stopRender) {stopRender = false; return;}
+        if (fullRedraw || title != lastNavbarTitle) renderNavbar(title);
+        if (stopRender) {stopRender = false; lastFrame.clear(); return;}
         move(blinkY, blinkX);
         if (stopRender) {stopRender = false; return;}
         curs_set(canBlink);
@@ -326,6 +347,8 @@ bool CLITerminal::pollEvents() {
     if (resizeRefresh) {
         resizeRefresh = false;
         CLITerminal::stopRender = true;
+        // the screen was cleared, so the next render has to draw everything again
+        CLITerminal::forceRender = true;
         delwin(tmpwin);
         endwin();
         refresh();
@@ -13,6 +13,7 @@
 #define TERMINAL_CLITERMINAL_HPP
 #include <set>
 #include <string>
+#include <vector>
 #include <Terminal.hpp>
 #undef scroll
 
@@ -21,7 +22,13 @@ class CLITerminal: public Terminal {
     friend void pressControl(int sig);
     friend void pressAlt(int sig);
     unsigned last_pair;
-    static unsigned short lastPaletteChecksum;
+    // What's currently on screen, so only cells that changed are redrawn: each entry is the character in the low byte and the color pair in the high byte.
+    // An empty frame means the next render repaints the whole screen.
+    static std::vector<uint16_t> lastFrame;
+    static unsigned lastFrameID;
+    static Color lastPalette[16];
+    static int lastGrayscale;
+    static std::string lastNavbarTitle;
     static std::set<unsigned>::iterator selectedWindow;
     static std::set<unsigned> currentIDs;
 public:
@@ -294,32 +294,12 @@ void HardwareSDLTerminal::render() {
 #endif
     }
     if (shouldRecord) {
-        if (recordedFrames >= config.maxRecordingTime * config.recordingFPS) stopRecording();
-        else if (--frameWait < 1) {
-            std::lock_guard<std::mutex> lock(recorderMutex);
-            int w, h;
-            if (SDL_GetRendererOutputSize(ren, &w, &h) != 0) return;
-            SDL_Surface *sshot = SDL_CreateRGBSurface(0, w, h, 32, 0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000);
-            if (SDL_RenderReadPixels(ren, NULL, SDL_PIXELFORMAT_ABGR8888, sshot->pixels, sshot->pitch) != 0) return;
-            uint32_t uw = static_cast<uint32_t>(w), uh = static_cast<uint32_t>(h);
-            std::string rle = std::string((char*)&uw, 4) + std::string((char*)&uh, 4);
-            uint32_t * px = ((uint32_t*)sshot->pixels);
-            uint32_t data = px[0] & 0xFFFFFF;
-            for (int y = 0; y < h; y++) {
-                for (int x = 0; x < w; x++) {
-                    uint32_t p = px[y*w+x];
-                    if ((p & 0xFFFFFF) != (data & 0xFFFFFF) || (data & 0xFF000000) == 0xFF000000) {
-                        rle += std::string((char*)&data, 4);
-                        data = p & 0xFFFFFF;
-                    } else data += 0x1000000;
-                }
-            }
-            rle += std::string((char*)&data, 4);
-            SDL_FreeSurface(sshot);
-            recording.push_back(rle);
-            recordedFrames++;
-            frameWait = config.clockSpeed / config.recordingFPS;
-            if (gotResizeEvent) return;
+        recorderMutex.lock();
+        const bool full = recorder == NULL || !recorder->tick(this, newcursorColor);
+        recorderMutex.unlock();
+        if (full) {
+            stopRecording();
+            return;
         }
         SDL_Surface* circle = SDL_CreateRGBSurfaceWithFormatFrom(circlePix, 10, 10, 32, 40, SDL_PIXELFORMAT_BGRA32);
         if (circle == NULL) { fprintf(stderr, "Error creating circle: %s\n", SDL_GetError()); }
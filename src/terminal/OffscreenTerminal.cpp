@@ -0,0 +1,145 @@
+/*
+ * terminal/OffscreenTerminal.cpp
+ * CraftOS-PC 2
+ * 
+ * This file implements the OffscreenTerminal class.
+ * 
+ * This code is licensed under the MIT license.
+ * Copyright (c) 2019-2021 JackMacWindows.
+ */
+
+#include <cstdio>
+#include <ctime>
+#include <thread>
+#include <SDL2/SDL.h>
+#include <configuration.hpp>
+#include "OffscreenTerminal.hpp"
+#include "RawTerminal.hpp"
+#include "../platform.hpp"
+#include "../runtime.hpp"
+#include "../termsupport.hpp"
+
+std::set<unsigned> OffscreenTerminal::currentIDs;
+
+// Returns a timestamped path in the screenshots folder with the specified extension
+static path_t screenshotFolderPath(const char * ext) {
+    time_t now = time(0);
+    struct tm * nowt = localtime(&now);
+    path_t path = getBasePath();
+#ifdef WIN32
+    path += WS("\\screenshots\\");
+#else
+    path += WS("/screenshots/");
+#endif
+    createDirectory(path);
+    char tstr[24];
+    strftime(tstr, 24, "%F_%H.%M.%S", nowt);
+    tstr[23] = '\0';
+    return path + wstr(std::string(tstr)) + wstr(std::string(ext));
+}
+
+void OffscreenTerminal::init() {
+    SDL_Init(SDL_INIT_TIMER | SDL_INIT_AUDIO);
+    // the render thread only drives recordings, since nothing is ever drawn
+    renderThread = new std::thread(termRenderLoop);
+    setThreadName(*renderThread, "Render Thread");
+}
+
+void OffscreenTerminal::quit() {
+    renderThread->join();
+    delete renderThread;
+    SDL_Quit();
+}
+
+OffscreenTerminal::OffscreenTerminal(std::string title): Terminal(config.defaultWidth, config.defaultHeight) {
+    this->title = title;
+    for (id = 0; currentIDs.find(id) != currentIDs.end(); id++) {}
+    currentIDs.insert(id);
+    std::lock_guard<std::mutex> rlock(renderTargetsLock);
+    renderTargets.push_back(this);
+}
+
+OffscreenTerminal::~OffscreenTerminal() {
+    stopRecording();
+    const auto pos = currentIDs.find(id);
+    if (pos != currentIDs.end()) currentIDs.erase(pos);
+    std::lock_guard<std::mutex> rtlock(renderTargetsLock);
+    std::lock_guard<std::mutex> locked_g(locked);
+    for (auto it = renderTargets.begin(); it != renderTargets.end(); ++it) {
+        if (*it == this)
+            it = renderTargets.erase(it);
+        if (it == renderTargets.end()) break;
+    }
+}
+
+void OffscreenTerminal::render() {
+    changed = false;
+    // recordings are ticked even if nothing changed, so that the frame timing stays right
+    std::lock_guard<std::mutex> lock(recorderMutex);
+    if (recorder != NULL && !recorder->tick(this)) {
+        delete recorder;
+        recorder = NULL;
+    }
+}
+
+bool OffscreenTerminal::resize(unsigned w, unsigned h) {
+    std::lock_guard<std::mutex> lock(locked);
+    if (w == width && h == height) return false;
+    screen.resize(w, h, ' ');
+    colors.resize(w, h, 0xF0);
+    pixels.resize(w * fontWidth, h * fontHeight, 0x0F);
+    width = w;
+    height = h;
+    changed = true;
+    return true;
+}
+
+void OffscreenTerminal::showMessage(uint32_t flags, const char * title, const char * message) {
+    fprintf(stderr, "%s: %s\n", title, message);
+}
+
+void OffscreenTerminal::setLabel(std::string label) {
+    title = label;
+}
+
+bool OffscreenTerminal::screenshot(std::string path) {
+    const path_t p = path.empty() ? screenshotFolderPath(".gif") : wstr(path);
+    try {
+        TerminalRecorder image(p, this);
+        image.capture(this);
+    } catch (std::exception &e) {
+        fprintf(stderr, "Could not save screenshot: %s\n", e.what());
+        return false;
+    }
+    return true;
+}
+
+void OffscreenTerminal::record(std::string path) {
+    const path_t p = path.empty() ? screenshotFolderPath(".gif") : wstr(path);
+    std::lock_guard<std::mutex> lock(recorderMutex);
+    if (recorder != NULL) delete recorder;
+    try {
+        recorder = new TerminalRecorder(p, this);
+    } catch (std::exception &e) {
+        recorder = NULL;
+        fprintf(stderr, "Could not start recording: %s\n", e.what());
+        return;
+    }
+    changed = true;
+}
+
+void OffscreenTerminal::stopRecording() {
+    std::lock_guard<std::mutex> lock(recorderMutex);
+    if (recorder != NULL) delete recorder;
+    recorder = NULL;
+}
+
+bool OffscreenTerminal::isRecording() {
+    std::lock_guard<std::mutex> lock(recorderMutex);
+    return recorder != NULL;
+}
+
+std::string OffscreenTerminal::exportRaw() {
+    std::lock_guard<std::mutex> lock(locked);
+    return encodeRawTerminalData(this);
+}
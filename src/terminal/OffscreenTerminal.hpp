@@ -0,0 +1,44 @@
+/*
+ * terminal/OffscreenTerminal.hpp
+ * CraftOS-PC 2
+ * 
+ * This file defines the OffscreenTerminal class, which keeps a terminal's
+ * contents in memory without displaying them anywhere.
+ * 
+ * This code is licensed under the MIT license.
+ * Copyright (c) 2019-2021 JackMacWindows.
+ */
+
+#ifndef TERMINAL_OFFSCREENTERMINAL_HPP
+#define TERMINAL_OFFSCREENTERMINAL_HPP
+#include <mutex>
+#include <set>
+#include <string>
+#include <Terminal.hpp>
+#include "../recorder.hpp"
+
+// A framebuffer-only terminal for headless mode. Its contents can be saved as a
+// screenshot or GIF recording, or exported as a raw mode packet, on demand.
+class OffscreenTerminal: public Terminal {
+    static std::set<unsigned> currentIDs;
+    TerminalRecorder * recorder = NULL;
+    std::mutex recorderMutex;
+public:
+    static void init();
+    static void quit();
+    OffscreenTerminal(std::string title);
+    ~OffscreenTerminal() override;
+    void render() override;
+    bool resize(unsigned w, unsigned h) override;
+    void showMessage(uint32_t flags, const char * title, const char * message) override;
+    void setLabel(std::string label) override;
+    // Saves the current contents as a GIF image. An empty path saves to the screenshots folder.
+    // Returns false if the image couldn't be written.
+    bool screenshot(std::string path = "");
+    void record(std::string path = ""); // An empty path saves to the screenshots folder
+    void stopRecording();
+    bool isRecording();
+    std::string exportRaw(); // Returns the contents as a raw mode terminal data packet
+};
+
+#endif
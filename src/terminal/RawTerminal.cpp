@@ -123,7 +123,7 @@ enum {
     CCPC_RAW_MESSAGE_DATA
 };
 
-static void sendRawData(const uint8_t type, const uint8_t id, const std::function<void(std::ostream&)>& callback) {
+static std::string encodeRawPacket(const uint8_t type, const uint8_t id, const std::function<void(std::ostream&)>& callback) {
     std::stringstream output;
     output.put(type);
     output.put(id);
@@ -133,11 +133,98 @@ static void sendRawData(const uint8_t type, const uint8_t id, const std::functio
     Poco::Checksum chk;
     chk.update(str);
     const uint32_t sum = chk.checksum();
-    std::cout << "!CPC" << std::hex << std::setfill('0') << std::setw(4) << str.length() << std::dec;
-    std::cout << str << std::hex << std::setfill('0') << std::setw(8) << sum << "\n";
+    std::stringstream packet;
+    packet << "!CPC" << std::hex << std::setfill('0') << std::setw(4) << str.length() << std::dec;
+    packet << str << std::hex << std::setfill('0') << std::setw(8) << sum << "\n";
+    return packet.str();
+}
+
+static void sendRawData(const uint8_t type, const uint8_t id, const std::function<void(std::ostream&)>& callback) {
+    std::cout << encodeRawPacket(type, id, callback);
     std::cout.flush();
 }
 
+// Writes the contents of a terminal as a terminal data packet body. The terminal must be locked.
+static void writeRawTerminalData(Terminal * term, std::ostream& output) {
+    const int mode = term->mode;
+    const unsigned width = term->width, height = term->height;
+    vector2d<unsigned char>& screen = term->screen;
+    vector2d<unsigned char>& colors = term->colors;
+    vector2d<unsigned char>& pixels = term->pixels;
+    const Color * palette = term->palette;
+    output.put((char)mode);
+    output.put((char)term->blink);
+    output.write((char*)&width, 2);
+    output.write((char*)&height, 2);
+    output.write((char*)&term->blinkX, 2);
+    output.write((char*)&term->blinkY, 2);
+    output.put(term->grayscale ? 1 : 0);
+    for (int i = 0; i < 3; i++) output.put(0);
+    if (mode == 0) {
+        unsigned char c = screen[0][0];
+        unsigned char n = 0;
+        for (unsigned y = 0; y < height; y++) {
+            for (unsigned x = 0; x < width; x++) {
+                if (screen[y][x] != c || n == 255) {
+                    output.put(c);
+                    output.put(n);
+                    c = screen[y][x];
+                    n = 0;
+                }
+                n++;
+            }
+        }
+        if (n > 0) {
+            output.put(c);
+            output.put(n);
+        }
+        c = colors[0][0];
+        n = 0;
+        for (unsigned y = 0; y < height; y++) {
+            for (unsigned x = 0; x < width; x++) {
+                if (colors[y][x] != c || n == 255) {
+                    output.put(c);
+                    output.put(n);
+                    c = colors[y][x];
+                    n = 0;
+                }
+                n++;
+            }
+        }
+        if (n > 0) {
+            output.put(c);
+            output.put(n);
+        }
+    } else {
+        unsigned char c = pixels[0][0];
+        unsigned char n = 0;
+        for (unsigned y = 0; y < height * 9; y++) {
+            for (unsigned x = 0; x < width * 6; x++) {
+                if (pixels[y][x] != c || n == 255) {
+                    output.put(c);
+                    output.put(n);
+                    c = pixels[y][x];
+                    n = 0;
+                }
+                n++;
+            }
+        }
+        if (n > 0) {
+            output.put(c);
+            output.put(n);
+        }
+    }
+    for (int i = 0; i < (mode == 2 ? 256 : 16); i++) {
+        output.put(palette[i].r);
+        output.put(palette[i].g);
+        output.put(palette[i].b);
+    }
+}
+
+std::string encodeRawTerminalData(Terminal * term) {
+    return encodeRawPacket(CCPC_RAW_TERMINAL_DATA, (uint8_t)term->id, [term](std::ostream& output) {writeRawTerminalData(term, output);});
+}
+
 static void parseIBTTag(std::istream& in, lua_State *L) {
     const char type = (char)in.get();
     if (type == 0) {
@@ -524,75 +611,7 @@ void RawTerminal::render() {
     }
     if (!changed) return;
     changed = false;
-    sendRawData(CCPC_RAW_TERMINAL_DATA, (uint8_t)id, [this](std::ostream& output) {
-        output.put((char)mode);
-        output.put((char)blink);
-        output.write((char*)&width, 2);
-        output.write((char*)&height, 2);
-        output.write((char*)&blinkX, 2);
-        output.write((char*)&blinkY, 2);
-        output.put(grayscale ? 1 : 0);
-        for (int i = 0; i < 3; i++) output.put(0);
-        if (mode == 0) {
-            unsigned char c = screen[0][0];
-            unsigned char n = 0;
-            for (unsigned y = 0; y < height; y++) {
-                for (unsigned x = 0; x < width; x++) {
-                    if (screen[y][x] != c || n == 255) {
-                        output.put(c);
-                        output.put(n);
-                        c = screen[y][x];
-                        n = 0;
-                    }
-                    n++;
-                }
-            }
-            if (n > 0) {
-                output.put(c);
-                output.put(n);
-            }
-            c = colors[0][0];
-            n = 0;
-            for (unsigned y = 0; y < height; y++) {
-                for (unsigned x = 0; x < width; x++) {
-                    if (colors[y][x] != c || n == 255) {
-                        output.put(c);
-                        output.put(n);
-                        c = colors[y][x];
-                        n = 0;
-                    }
-                    n++;
-                }
-            }
-            if (n > 0) {
-                output.put(c);
-                output.put(n);
-            }
-        } else {
-            unsigned char c = pixels[0][0];
-            unsigned char n = 0;
-            for (unsigned y = 0; y < height * 9; y++) {
-                for (unsigned x = 0; x < width * 6; x++) {
-                    if (pixels[y][x] != c || n == 255) {
-                        output.put(c);
-                        output.put(n);
-                        c = pixels[y][x];
-                        n = 0;
-                    }
-                    n++;
-                }
-            }
-            if (n > 0) {
-                output.put(c);
-                output.put(n);
-            }
-        }
-        for (int i = 0; i < (mode == 2 ? 256 : 16); i++) {
-            output.put(palette[i].r);
-            output.put(palette[i].g);
-            output.put(palette[i].b);
-        }
-    });
+    sendRawData(CCPC_RAW_TERMINAL_DATA, (uint8_t)id, [this](std::ostream& output) {writeRawTerminalData(this, output);});
 }
 
 void RawTerminal::showMessage(uint32_t flags, const char * title, const char * message) {
@@ -29,5 +29,7 @@ public:
 };
 
 extern void sendRawEvent(SDL_Event e);
+// Returns a complete raw mode terminal data packet for a terminal. The terminal must be locked.
+extern std::string encodeRawTerminalData(Terminal * term);
 
 #endif
\ No newline at end of file
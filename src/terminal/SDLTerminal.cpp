@@ -325,30 +325,12 @@ void SDLTerminal::render() {
 #endif
     }
     if (shouldRecord) {
-        if (recordedFrames >= config.maxRecordingTime * config.recordingFPS) stopRecording();
-        else if (--frameWait < 1) {
-            recorderMutex.lock();
-            uint32_t uw = static_cast<uint32_t>(surf->w), uh = static_cast<uint32_t>(surf->h);
-            std::string rle = std::string((char*)&uw, 4) + std::string((char*)&uh, 4);
-            SDL_Surface * temp = SDL_ConvertSurfaceFormat(surf, SDL_PIXELFORMAT_ABGR8888, 0);
-            uint32_t * px = ((uint32_t*)temp->pixels);
-            uint32_t data = px[0] & 0xFFFFFF;
-            for (int y = 0; y < surf->h; y++) {
-                for (int x = 0; x < surf->w; x++) {
-                    uint32_t p = px[y*surf->w+x];
-                    if ((p & 0xFFFFFF) != (data & 0xFFFFFF) || (data & 0xFF000000) == 0xFF000000) {
-                        rle += std::string((char*)&data, 4);
-                        data = p & 0xFFFFFF;
-                    } else data += 0x1000000;
-                }
-            }
-            rle += std::string((char*)&data, 4);
-            SDL_FreeSurface(temp);
-            recording.push_back(rle);
-            recordedFrames++;
-            frameWait = config.clockSpeed / config.recordingFPS;
-            recorderMutex.unlock();
-            if (gotResizeEvent) return;
+        recorderMutex.lock();
+        const bool full = recorder == NULL || !recorder->tick(this, newcursorColor);
+        recorderMutex.unlock();
+        if (full) {
+            stopRecording();
+            return;
         }
         SDL_Surface* circle = SDL_CreateRGBSurfaceWithFormatFrom(circlePix, 10, 10, 32, 40, SDL_PIXELFORMAT_BGRA32);
         if (circle == NULL) { fprintf(stderr, "Error creating circle: %s\n", SDL_GetError()); }
@@ -421,9 +403,6 @@ void SDLTerminal::screenshot(std::string path) {
 }
 
 void SDLTerminal::record(std::string path) {
-    shouldRecord = true;
-    recordedFrames = 0;
-    frameWait = 0;
     if (!path.empty()) recordingPath = wstr(path);
     else {
         time_t now = time(0);
@@ -439,43 +418,25 @@ void SDLTerminal::record(std::string path) {
         strftime(tstr, 20, "%F_%H.%M.%S", nowt);
         recordingPath += wstr(std::string(tstr)) + WS(".gif");
     }
+    std::lock_guard<std::mutex> lock(recorderMutex);
+    if (recorder != NULL) delete recorder;
+    try {
+        recorder = new TerminalRecorder(recordingPath, this, charScale * (2 / fontScale));
+    } catch (std::exception &e) {
+        recorder = NULL;
+        fprintf(stderr, "Could not start recording: %s\n", e.what());
+        return;
+    }
+    shouldRecord = true;
     changed = true;
 }
 
-#ifndef __APPLE__
-static uint32_t *memset_int(uint32_t *ptr, uint32_t value, size_t num) {
-    for (size_t i = 0; i < num; i++) memcpy(&ptr[i], &value, 4);
-    return &ptr[num];
-}
-#endif
-
 void SDLTerminal::stopRecording() {
     shouldRecord = false;
     recorderMutex.lock();
-    if (recording.empty()) { recorderMutex.unlock(); return; }
-    GifWriter g;
-    g.f = platform_fopen(recordingPath.c_str(), "wb");
-    GifBegin(&g, NULL, reinterpret_cast<uint32_t*>(&recording[0][0])[0], reinterpret_cast<uint32_t*>(&recording[0][0])[1], 100 / config.recordingFPS);
-    for (std::string s : recording) {
-        const uint32_t w = reinterpret_cast<uint32_t*>(&s[0])[0], h = reinterpret_cast<uint32_t*>(&s[0])[1];
-        uint32_t* ipixels = new uint32_t[w * h];
-        uint32_t* lp = ipixels;
-        for (unsigned i = 2; i*4 < s.size(); i++) {
-#ifdef __APPLE__
-            // macOS has memset_pattern4, which is much more efficient than my C implementation, so use that if available
-            uint32_t c = ((uint32_t*)&s[0])[i] & 0xFFFFFF;
-            memset_pattern4(lp, &c, min(((((uint32_t*)&s[0])[i] & 0xFF000000) >> 24) + 1, (unsigned int)((w * h) - (lp - ipixels))) * 4);
-            lp += min(((((uint32_t*)&s[0])[i] & 0xFF000000) >> 24) + 1, (unsigned int)((w * h) - (lp - ipixels)));
-#else
-            const uint32_t c = reinterpret_cast<uint32_t*>(&s[0])[i];
-            lp = memset_int(lp, c & 0xFFFFFF, min(((c & 0xFF000000) >> 24) + 1, (unsigned int)((w*h) - (lp - ipixels))));
-#endif
-        }
-        GifWriteFrame(&g, (uint8_t*)ipixels, w, h, 100 / config.recordingFPS);
-        delete[] ipixels;
-    }
-    GifEnd(&g);
-    recording.clear();
+    if (recorder == NULL) { recorderMutex.unlock(); return; }
+    delete recorder;
+    recorder = NULL;
     recorderMutex.unlock();
 #ifdef __EMSCRIPTEN__
     queueTask([](void*)->void*{syncfs(); return NULL;}, NULL, true);
@@ -18,6 +18,7 @@
 #include <SDL2/SDL.h>
 #include <Terminal.hpp>
 #include "../platform.hpp"
+#include "../recorder.hpp"
 
 inline SDL_Rect * setRect(SDL_Rect * rect, int x, int y, int w, int h) {
     rect->x = x;
@@ -38,9 +39,7 @@ protected:
     bool fullscreen = false;
     path_t screenshotPath;
     path_t recordingPath;
-    int recordedFrames = 0;
-    int frameWait = 0;
-    std::vector<std::string> recording;
+    TerminalRecorder * recorder = NULL;
     std::mutex recorderMutex;
     std::mutex renderlock;
     bool overridden = false;
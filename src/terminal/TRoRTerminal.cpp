@@ -9,7 +9,9 @@
  */
 
 #include <iostream>
+#include <cstdarg>
 #include <cstdio>
+#include <vector>
 #include <thread>
 #include "TRoRTerminal.hpp"
 #include "SDLTerminal.hpp"
@@ -35,6 +37,8 @@ is assumed to be meant for the first window (ID 0).
 std::set<unsigned> TRoRTerminal::currentIDs;
 static std::unordered_set<std::string> trorExtensions;
 static std::thread * inputThread;
+// Every terminal shares stdout, so each terminal's packets are written in one piece.
+static std::mutex stdoutLock;
 
 #ifdef __EMSCRIPTEN__
 #define checkWindowID(c, wid) (c->term == *renderTarget || findMonitorFromWindowID(c, (*renderTarget)->id, tmps) != NULL)
@@ -139,13 +143,20 @@ void TRoRTerminal::init() {
     renderThread = new std::thread(termRenderLoop);
     inputThread = new std::thread(trorInputLoop);
     setThreadName(*renderThread, "Render Thread");
+    std::lock_guard<std::mutex> lock(stdoutLock);
     printf("SP:;-ccpcTerm-\n");
+    fflush(stdout);
 }
 
 void TRoRTerminal::quit() {
-    printf("SC:;Server closed\n");
+    // let the render thread send what it has left first, so SC is the last packet
     renderThread->join();
     delete renderThread;
+    {
+        std::lock_guard<std::mutex> lock(stdoutLock);
+        printf("SC:;Server closed\n");
+        fflush(stdout);
+    }
     inputThread->join();
     delete inputThread;
     SDL_Quit();
@@ -153,19 +164,28 @@ void TRoRTerminal::quit() {
 
 void TRoRTerminal::showGlobalMessage(Uint32 flags, const char * title, const char * message) {
     // This may be called before initialization, so we're always sending it
+    std::lock_guard<std::mutex> lock(stdoutLock);
     printf("TA:;\"%s\",\"%s\"\n", title, message);
+    fflush(stdout);
 }
 
 TRoRTerminal::TRoRTerminal(std::string title): Terminal(config.defaultWidth, config.defaultHeight) {
     this->title = title;
     for (id = 0; currentIDs.find(id) != currentIDs.end(); id++) 
         ;
-    if (trorExtensions.find("ccpcTerm") != trorExtensions.end()) printf("TN:%d;%s\n", id, title.c_str());
+    if (trorExtensions.find("ccpcTerm") != trorExtensions.end()) {
+        std::lock_guard<std::mutex> lock(stdoutLock);
+        printf("TN:%d;%s\n", id, title.c_str());
+    }
     renderTargets.push_back(this);
 }
 
 TRoRTerminal::~TRoRTerminal() {
-    if (trorExtensions.find("ccpcTerm") != trorExtensions.end()) printf("TQ:%d;\n", id);
+    render();
+    if (trorExtensions.find("ccpcTerm") != trorExtensions.end()) {
+        std::lock_guard<std::mutex> lock(stdoutLock);
+        printf("TQ:%d;\n", id);
+    }
     const auto pos = currentIDs.find(id);
     if (pos != currentIDs.end()) currentIDs.erase(pos);
     renderTargetsLock.lock();
@@ -179,10 +199,65 @@ TRoRTerminal::~TRoRTerminal() {
 }
 
 void TRoRTerminal::showMessage(Uint32 flags, const char * title, const char * message) {
-    if (trorExtensions.find("ccpcTerm") != trorExtensions.end()) printf("TA:%d;\"%s\",\"%s\"\n", id, title, message);
+    if (trorExtensions.find("ccpcTerm") != trorExtensions.end()) queuePacket("TA", "\"%s\",\"%s\"", title, message);
 }
 
 void TRoRTerminal::setLabel(std::string label) {
     this->title = label;
-    if (trorExtensions.find("ccpcTerm") != trorExtensions.end()) printf("TZ:%d;%s\n", id, label.c_str());
+    if (trorExtensions.find("ccpcTerm") != trorExtensions.end()) queuePacket("TZ", "%s", label.c_str());
+}
+
+// Closes the TW packet being built, if any. packetLock must be held.
+void TRoRTerminal::finishWrite() {
+    if (pendingText.empty()) return;
+    packets += "TW:" + std::to_string(id) + ";" + pendingText + "\n";
+    pendingText.clear();
+}
+
+void TRoRTerminal::render() {
+    std::string out;
+    {
+        std::lock_guard<std::mutex> lock(packetLock);
+        finishWrite();
+        if (packets.empty()) return;
+        out.swap(packets);
+    }
+    std::lock_guard<std::mutex> lock(stdoutLock);
+    fwrite(out.data(), 1, out.size(), stdout);
+    fflush(stdout);
+}
+
+void TRoRTerminal::queuePacket(const char * code, const char * format, ...) {
+    va_list args, args2;
+    va_start(args, format);
+    va_copy(args2, args);
+    const int size = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    std::vector<char> payload(size > 0 ? size + 1 : 1, 0);
+    if (size > 0) vsnprintf(&payload[0], payload.size(), format, args2);
+    va_end(args2);
+    std::lock_guard<std::mutex> lock(packetLock);
+    finishWrite();
+    packets += std::string(code) + ":" + std::to_string(id) + ";" + &payload[0] + "\n";
+}
+
+void TRoRTerminal::queueWrite(const char * text, size_t len) {
+    std::lock_guard<std::mutex> lock(packetLock);
+    pendingText.append(text, len);
+}
+
+void TRoRTerminal::queueTextColor(int color) {
+    std::lock_guard<std::mutex> lock(packetLock);
+    if (clientColors[0] == color) return;
+    finishWrite();
+    packets += "TF:" + std::to_string(id) + ";" + "0123456789abcdef"[color & 15] + "\n";
+    clientColors[0] = color;
+}
+
+void TRoRTerminal::queueBackgroundColor(int color) {
+    std::lock_guard<std::mutex> lock(packetLock);
+    if (clientColors[1] == color) return;
+    finishWrite();
+    packets += "TK:" + std::to_string(id) + ";" + "0123456789abcdef"[color & 15] + "\n";
+    clientColors[1] = color;
 }
\ No newline at end of file
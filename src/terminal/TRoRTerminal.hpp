@@ -10,18 +10,33 @@
 
 #ifndef TERMINAL_TRORTERMINAL_HPP
 #define TERMINAL_TRORTERMINAL_HPP
+#include <mutex>
 #include <set>
+#include <string>
 #include <Terminal.hpp>
 
 class TRoRTerminal: public Terminal {
     static std::set<unsigned> currentIDs;
+    std::mutex packetLock;
+    std::string packets; // packets waiting for the next render
+    std::string pendingText; // text for a TW packet that later writes can still be added to
+    int clientColors[2] = {-1, -1}; // the text and background colors the client will have after the queued packets (-1 = unknown)
+    void finishWrite();
 public:
     static void init();
     static void quit();
     static void showGlobalMessage(uint32_t flags, const char * title, const char * message);
     TRoRTerminal(std::string title);
     ~TRoRTerminal() override;
-    void render() override {}
+    // Sends all queued packets at once; called every render tick.
+    void render() override;
+    // Queues a packet (printf-style payload) to send on the next render.
+    void queuePacket(const char * code, const char * format, ...);
+    // Queues text to write; consecutive writes are merged into one TW packet.
+    void queueWrite(const char * text, size_t len);
+    // Queues TF/TK packets for a color (0-15), unless the client already has it.
+    void queueTextColor(int color);
+    void queueBackgroundColor(int color);
     void showMessage(uint32_t flags, const char * title, const char * message) override;
     void setLabel(std::string label) override;
     bool resize(unsigned w, unsigned h) override {return false;}
@@ -23,9 +23,12 @@
 #endif
 #include <Terminal.hpp>
 #include "apis.hpp"
+#include "headless.hpp"
+#include "metrics.hpp"
 #include "runtime.hpp"
 #include "peripheral/monitor.hpp"
 #include "peripheral/debugger.hpp"
+#include "profiler.hpp"
 #include "terminal/SDLTerminal.hpp"
 #include "termsupport.hpp"
 #ifndef NO_CLI
@@ -372,6 +375,47 @@ extern "C" {
     extern const char KEY_HOOK;
 }
 
+// The debugger changes breakpoints from its own thread while the hook reads the
+// index on the computer's thread, so a new index is built and swapped in whole.
+void updateBreakpointIndex(Computer * comp) {
+    std::shared_ptr<std::unordered_map<lua_Integer, std::vector<std::string> > > index = std::make_shared<std::unordered_map<lua_Integer, std::vector<std::string> > >();
+    for (const auto& b : comp->breakpoints) {
+        std::vector<std::string>& sources = (*index)[b.second.second];
+        sources.push_back(b.second.first);
+        sources.push_back("@" + b.second.first.substr(2));
+    }
+    std::atomic_store(&comp->breakpointIndex, std::shared_ptr<const std::unordered_map<lua_Integer, std::vector<std::string> > >(index));
+}
+
+// Checks whether a breakpoint is set on the line in a line event. The line
+// number is looked up first, so the source is only fetched for lines that
+// have a breakpoint in some file.
+static bool breakpointAt(Computer * computer, lua_State *L, lua_Debug *ar) {
+    const auto index = std::atomic_load(&computer->breakpointIndex);
+    if (index == NULL) return false;
+    const auto it = index->find(ar->currentline);
+    if (it == index->end()) return false;
+    lua_getinfo(L, "Sl", ar);
+    for (const std::string& source : it->second)
+        if (source == ar->source) return true;
+    return false;
+}
+
+// Checks whether a function (with "S" info) contains a breakpoint. Main chunks
+// span their whole file.
+static bool functionHasBreakpoint(Computer * computer, const lua_Debug *ar) {
+    if (*ar->what == 'C') return false;
+    const bool main = *ar->what == 'm';
+    const auto index = std::atomic_load(&computer->breakpointIndex);
+    if (index == NULL) return false;
+    for (const auto& line : *index) {
+        if (!main && (line.first < ar->linedefined || line.first > ar->lastlinedefined)) continue;
+        for (const std::string& source : line.second)
+            if (source == ar->source) return true;
+    }
+    return false;
+}
+
 void termHook(lua_State *L, lua_Debug *ar) {
     std::string name; // For some reason MSVC explodes when this isn't at the top of the function
                       // I've had issues with it randomly moving scope boundaries around (see apis/config.cpp:101, runtime.cpp:249),
@@ -386,45 +430,49 @@ void termHook(lua_State *L, lua_Debug *ar) {
         lua_getfield(L, LUA_REGISTRYINDEX, "_coroutine_stack");
         for (size_t i = 1; i <= lua_objlen(L, -1); i++) {
             lua_rawgeti(L, -1, (int)i);
-            if (lua_isthread(L, -1)) lua_sethook(lua_tothread(L, -1), NULL, 0, 0); //lua_sethook(lua_tothread(L, -1), termHook, LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 0);
+            if (lua_isthread(L, -1)) setComputerHook(computer, lua_tothread(L, -1), 0, 0); //lua_sethook(lua_tothread(L, -1), termHook, LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 0);
             lua_pop(L, 1);
         }
         lua_pop(L, 1);
         /*lua_sethook(computer->L, termHook, LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 0);
         lua_sethook(computer->coro, termHook, LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 0);
         lua_sethook(L, termHook, LUA_MASKRET | LUA_MASKCALL | LUA_MASKERROR | LUA_MASKRESUME | LUA_MASKYIELD, 0);*/
-        lua_sethook(computer->L, NULL, 0, 0);
-        lua_sethook(computer->coro, NULL, 0, 0);
-        lua_sethook(L, NULL, 0, 0);
+        setComputerHook(computer, computer->L, 0, 0);
+        setComputerHook(computer, computer->coro, 0, 0);
+        setComputerHook(computer, L, 0, 0);
         queueTask([](void*arg)->void*{delete (debugger*)arg; return NULL;}, computer->debugger, true);
         computer->debugger = NULL;
     }
+    if (ar->event == LUA_HOOKCOUNT) {
+        if (computer->profiler != NULL) ((Profiler*)computer->profiler)->hook(L);
+        return;
+    }
     if (ar->event == LUA_HOOKLINE && ::config.debug_enable) {
         if (computer->debugger == NULL && computer->hasBreakpoints) {
-            lua_getinfo(L, "Sl", ar);
-            for (std::pair<int, std::pair<std::string, lua_Integer> > b : computer->breakpoints) {
-                if ((b.second.first == std::string(ar->source) || "@" + b.second.first.substr(2) == std::string(ar->source)) && b.second.second == ar->currentline) {
-                    noDebuggerBreak(L, computer, ar);
-                    break;
-                }
-            }
+            if (breakpointAt(computer, L, ar)) noDebuggerBreak(L, computer, ar);
         } else if (computer->debugger != NULL && !computer->isDebugger) {
             debugger * dbg = (debugger*)computer->debugger;
             if (dbg->thread == NULL) {
                 if (dbg->breakType == DEBUGGER_BREAK_TYPE_LINE) {
                     if (dbg->stepCount == 0) debuggerBreak(L, computer, dbg, "Pause");
                     else dbg->stepCount--;
-                } else if (!computer->breakpoints.empty()) {
-                    lua_getinfo(L, "Sl", ar);
-                    for (std::pair<int, std::pair<std::string, lua_Integer> > b : computer->breakpoints) {
-                        if ((b.second.first == std::string(ar->source) || "@" + b.second.first.substr(2) == std::string(ar->source)) && b.second.second == ar->currentline) {
-                            if (debuggerBreak(L, computer, dbg, "Breakpoint")) return;
-                            break;
-                        }
-                    }
+                } else if (!computer->breakpoints.empty() && breakpointAt(computer, L, ar)) {
+                    if (debuggerBreak(L, computer, dbg, "Breakpoint")) return;
                 }
             }
         }
+    } else if ((ar->event == LUA_HOOKCALL || ar->event == LUA_HOOKRET) && computer->debugger == NULL && computer->hasBreakpoints && ::config.debug_enable) {
+        // only keep line events on while running a function that has a breakpoint in it
+        lua_Debug caller;
+        lua_Debug * func = ar;
+        if (ar->event == LUA_HOOKRET) {
+            if (!lua_getstack(L, 1, &caller)) return;
+            func = &caller;
+        }
+        lua_getinfo(L, "S", func);
+        const bool wantLines = functionHasBreakpoint(computer, func);
+        const int mask = lua_gethookmask(L);
+        if (((mask & LUA_MASKLINE) != 0) != wantLines) setComputerHook(computer, L, wantLines ? mask | LUA_MASKLINE : mask & ~LUA_MASKLINE, lua_gethookcount(L));
     } else if (ar->event == LUA_HOOKERROR) {
         if (config.logErrors) {
             if (config.debug_enable && !computer->isDebugger && (computer->debugger == NULL || ((debugger*)computer->debugger)->thread == NULL)) {
@@ -489,6 +537,16 @@ void termHook(lua_State *L, lua_Debug *ar) {
     }
 }
 
+// Sets the hooks on one of a computer's Lua states. If the computer is being
+// profiled, the profiler's count hook is kept on top of the requested hooks.
+void setComputerHook(Computer * comp, lua_State *L, int mask, int count) {
+    if (comp->profiler != NULL) {
+        mask |= LUA_MASKCOUNT;
+        count = Profiler::hookCount;
+    }
+    lua_sethook(L, mask ? termHook : NULL, mask, count);
+}
+
 void termRenderLoop() {
 #ifdef __APPLE__
     pthread_setname_np("Render Thread");
@@ -510,8 +568,10 @@ void termRenderLoop() {
             }
             if (term->frozen) continue;
             const bool changed = term->changed;
+            const std::chrono::high_resolution_clock::time_point renderStart = std::chrono::high_resolution_clock::now();
             try {
                 term->render();
+                if (metricsEnabled) observeRenderTime(term, std::chrono::high_resolution_clock::now() - renderStart);
             } catch (std::exception &ex) {
                 fprintf(stderr, "Warning: Render on term %d threw an error: %s (%d)\n", term->id, ex.what(), term->errorcount);
                 if (term->errorcount++ > 10) {
@@ -532,6 +592,7 @@ void termRenderLoop() {
             term->framecount++;
         }
         renderTargetsLock.unlock();
+        if (selectedRenderer == 1) flushHeadlessOutputs();
         if (errored) continue;
         if (pushEvent) {
             SDL_Event ev;
@@ -31,6 +31,9 @@ extern int convertX(SDLTerminal *term, int x);
 extern int convertY(SDLTerminal *term, int y);
 extern void termRenderLoop();
 extern void termHook(lua_State *L, lua_Debug *ar);
+extern void setComputerHook(Computer * comp, lua_State *L, int mask, int count);
+// Rebuilds comp->breakpointIndex; call this after changing comp->breakpoints.
+extern void updateBreakpointIndex(Computer * comp);
 extern int termPanic(lua_State *L);
 extern monitor * findMonitorFromWindowID(Computer *comp, unsigned id, std::string& sideReturn);
 extern void displayFailure(Terminal * term, const std::string& message, const std::string& extra = "");
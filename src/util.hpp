@@ -123,6 +123,15 @@ inline unsigned char htoi(char c) {
     return 0;
 }
 
+// Table version of htoi for converting whole blit strings at once
+inline const unsigned char * htoiTable() {
+    static const struct table_t {
+        unsigned char v[256];
+        table_t() {for (int i = 0; i < 256; i++) v[i] = htoi((char)i);}
+    } table;
+    return table.v;
+}
+
 inline std::string asciify(std::string str) {
     std::string retval;
     for (char c : str) { if (c < 32 || c > 127) retval += '?'; else retval += c; }
@@ -167,7 +176,9 @@ extern path_t fixpath(Computer *comp, const char * path, bool exists, bool addEx
 extern bool fixpath_ro(Computer *comp, const char * path);
 extern path_t fixpath_mkdir(Computer * comp, const std::string& path, bool md = true, std::string * mountPath = NULL);
 extern std::set<std::string> getMounts(Computer * computer, const char * comp_path);
-extern void peripheral_update(Computer *comp);
+extern void setPeripheralUpdateRate(Computer * comp, peripheral * p, unsigned rate);
+extern void removePeripheralUpdates(Computer * comp, peripheral * p = NULL);
+extern void peripheralUpdateQuit();
 extern struct computer_configuration getComputerConfig(int id);
 extern void setComputerConfig(int id, const computer_configuration& cfg);
 extern void config_init();
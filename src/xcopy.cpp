@@ -0,0 +1,231 @@
+/*
+ * xcopy.cpp
+ * CraftOS-PC 2
+ *
+ * This file implements xcopy, which copies values from one Lua state to
+ * another. It only depends on Lua, so resources/BenchmarkXcopy.cpp can be
+ * built against this file alone.
+ *
+ * This code is licensed under the MIT license.
+ * Copyright (c) 2019-2021 JackMacWindows.
+ */
+
+extern "C" {
+#include <lua.h>
+#include <lauxlib.h>
+}
+#include <unordered_map>
+
+// xcopy copies tables breadth-first from a worklist instead of recursing. Every
+// source table gets an ID the first time it's seen, and its copy is created
+// empty and pre-sized under the same ID. Later references to the same table
+// (shared subtables and cycles) reuse the copy, so the structure of the
+// original is preserved. Tables passed directly as values already sit at fixed
+// places on both stacks, so they're used from there; only tables found inside
+// other tables are kept in a list table in `from` (so they can be iterated
+// later) and a memo table in `to`. Plain values and small tables therefore cost
+// about as much as a straight copy.
+#define XCOPY_STACK_TABLES 16 // how many top-level tables are used from the stacks
+#define XCOPY_SEEN_TABLES 16 // how many IDs are looked up linearly before using the hash map
+
+struct xcopy_state {
+    lua_State *from;
+    lua_State *to;
+    bool nested = false; // whether top-level values have all been copied
+    bool lists = false; // whether the list tables below have been made yet
+    int fromList = 0; // absolute index of the source table list in `from`, once there is room for one
+    int toMemo = 0; // absolute index of the copied table list in `to`, once there is room for one
+    int count = 0;
+    int onStack = 0; // the first IDs are for tables that stay on the stacks
+    int stack[XCOPY_STACK_TABLES][2]; // absolute indices of those sources and copies
+    const void * seen[XCOPY_SEEN_TABLES];
+    std::unordered_map<const void*, int> ids; // the IDs of any later tables
+};
+
+// Returns the ID of a table that was seen before, or gives it the next ID and returns 0.
+static int xcopy_find(xcopy_state& st, const void * ptr) {
+    const int n = st.count < XCOPY_SEEN_TABLES ? st.count : XCOPY_SEEN_TABLES;
+    for (int i = 0; i < n; i++) if (st.seen[i] == ptr) return i + 1;
+    if (st.count < XCOPY_SEEN_TABLES) {
+        st.seen[st.count++] = ptr;
+        return 0;
+    }
+    if (st.count == XCOPY_SEEN_TABLES) st.ids.reserve(64);
+    const auto it = st.ids.emplace(ptr, st.count + 1);
+    if (!it.second) return it.first->second;
+    st.count++;
+    return 0;
+}
+
+static void xcopy_push_source(xcopy_state& st, int id) {
+    if (id <= st.onStack) lua_pushvalue(st.from, st.stack[id-1][0]);
+    else lua_rawgeti(st.from, st.fromList, id - st.onStack);
+}
+
+static void xcopy_push_copy(xcopy_state& st, int id) {
+    if (id <= st.onStack) lua_pushvalue(st.to, st.stack[id-1][1]);
+    else lua_rawgeti(st.to, st.toMemo, id - st.onStack);
+}
+
+// Pushes a copy of the value at index idx in `from` onto `to`, which must not be a table.
+static void xcopy_plain(lua_State *from, lua_State *to, int idx, int type) {
+    switch (type) {
+    case LUA_TNIL: lua_pushnil(to); break;
+    case LUA_TBOOLEAN: lua_pushboolean(to, lua_toboolean(from, idx)); break;
+    case LUA_TNUMBER: lua_pushnumber(to, lua_tonumber(from, idx)); break;
+    case LUA_TSTRING: {
+        size_t len = 0;
+        const char * str = lua_tolstring(from, idx, &len);
+        lua_pushlstring(to, str, len);
+        break;
+    } default: {
+        if (luaL_callmeta(from, idx, "__tostring")) {
+            size_t len = 0;
+            const char * str = lua_tolstring(from, -1, &len);
+            if (str) lua_pushlstring(to, str, len);
+            else lua_pushnil(to);
+            lua_pop(from, 1);
+        } else lua_pushfstring(to, "<%s: %p>", lua_typename(from, type), lua_topointer(from, idx));
+        break;
+    }
+    }
+}
+
+// Pushes a copy of the value at (absolute) index idx in `from` onto `to`.
+static void xcopy_value(xcopy_state& st, int idx) {
+    lua_State *from = st.from, *to = st.to;
+    const int type = lua_type(from, idx);
+    if (type != LUA_TTABLE) {
+        xcopy_plain(from, to, idx, type);
+        return;
+    }
+    if (st.count == 0) lua_checkstack(from, 8);
+    const int seen = xcopy_find(st, lua_topointer(from, idx));
+    if (seen != 0) {
+        xcopy_push_copy(st, seen);
+        return;
+    }
+    // size the copy up front so it never has to rehash; plain lists have
+    // nothing after their last element, so they don't need to be counted
+    const int narr = (int)lua_objlen(from, idx);
+    int nrec = 0;
+    bool isList = false;
+    if (narr > 0) {
+        lua_pushinteger(from, narr);
+        if (lua_next(from, idx) != 0) lua_pop(from, 2);
+        else isList = true;
+    }
+    if (!isList) {
+        lua_pushnil(from);
+        while (lua_next(from, idx) != 0) {
+            lua_pop(from, 1);
+            nrec++;
+        }
+        nrec = nrec > narr ? nrec - narr : 0;
+    }
+    const int id = st.count;
+    lua_createtable(to, narr, nrec);
+    if (!st.nested && id <= XCOPY_STACK_TABLES) {
+        // a top-level value stays where it is until the copy is finished
+        st.stack[id-1][0] = idx;
+        st.stack[id-1][1] = lua_gettop(to);
+        st.onStack = id;
+        return;
+    }
+    if (st.toMemo == 0) {
+        // there are too many top-level tables: make room for the lists below the copy
+        lua_pushnil(from);
+        st.fromList = lua_gettop(from);
+        lua_pushnil(to);
+        lua_insert(to, -2);
+        st.toMemo = lua_gettop(to) - 1;
+    }
+    if (!st.lists) {
+        // the lists are only made once they're needed, so copying plain values stays cheap
+        lua_newtable(from);
+        lua_replace(from, st.fromList);
+        lua_newtable(to);
+        lua_replace(to, st.toMemo);
+        st.lists = true;
+    }
+    lua_pushvalue(from, idx);
+    lua_rawseti(from, st.fromList, id - st.onStack);
+    lua_pushvalue(to, -1);
+    lua_rawseti(to, st.toMemo, id - st.onStack);
+}
+
+// Fills the copy of the table with the given ID. Array slots are copied with
+// rawgeti/rawseti, which is all that's needed for flat lists of numbers or
+// strings; anything else is picked up by a lua_next pass that skips the array.
+static void xcopy_fill(xcopy_state& st, int id) {
+    lua_State *from = st.from, *to = st.to;
+    xcopy_push_source(st, id); // src
+    xcopy_push_copy(st, id); // dst
+    const int src = lua_gettop(from), dst = lua_gettop(to);
+    const int narr = (int)lua_objlen(from, src);
+    for (int i = 1; i <= narr; i++) {
+        lua_rawgeti(from, src, i);
+        switch (lua_type(from, -1)) {
+        case LUA_TNIL: lua_pop(from, 1); continue;
+        case LUA_TNUMBER: lua_pushnumber(to, lua_tonumber(from, -1)); break;
+        case LUA_TSTRING: {
+            size_t len = 0;
+            const char * str = lua_tolstring(from, -1, &len);
+            lua_pushlstring(to, str, len);
+            break;
+        } default: xcopy_value(st, lua_gettop(from)); break;
+        }
+        lua_rawseti(to, dst, i);
+        lua_pop(from, 1);
+    }
+    lua_pushnil(from);
+    while (lua_next(from, src) != 0) {
+        if (lua_type(from, -2) == LUA_TNUMBER) {
+            const lua_Number k = lua_tonumber(from, -2);
+            if (k >= 1 && k <= narr && k == (lua_Number)(int)k) {
+                lua_pop(from, 1);
+                continue;
+            }
+        }
+        const int top = lua_gettop(from);
+        xcopy_value(st, top - 1);
+        xcopy_value(st, top);
+        lua_rawset(to, dst);
+        lua_pop(from, 1);
+    }
+    lua_pop(from, 1);
+    lua_pop(to, 1);
+}
+
+void xcopy(lua_State *from, lua_State *to, int n) {
+    if (n <= 0) return;
+    // callers leave room to push a few results like any C function does, so
+    // only long lists of values need the stack to be grown up front
+    if (n > LUA_MINSTACK / 2) luaL_checkstack(to, n, "out of memory");
+    const int base = lua_gettop(from) - n + 1;
+    int i = 0;
+    // plain values are copied straight away, without setting up for tables
+    for (; i < n; i++) {
+        const int type = lua_type(from, base + i);
+        if (type == LUA_TTABLE) break;
+        xcopy_plain(from, to, base + i, type);
+    }
+    if (i == n) return;
+    luaL_checkstack(to, n - i + 6, "out of memory");
+    xcopy_state st;
+    st.from = from;
+    st.to = to;
+    for (; i < n; i++) xcopy_value(st, base + i);
+    st.nested = true;
+    if (st.toMemo == 0) {
+        // filling can find nested tables, so reserve slots for the lists before the stacks are in use
+        lua_pushnil(from);
+        st.fromList = lua_gettop(from);
+        lua_pushnil(to);
+        st.toMemo = lua_gettop(to);
+    }
+    // copying a table can discover more tables, so keep going until the list stops growing
+    for (int id = 1; id <= st.count; id++) xcopy_fill(st, id);
+    lua_remove(to, st.toMemo);
+    lua_remove(from, st.fromList);
+}